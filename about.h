@@ -38,6 +38,7 @@ Keyboard Controls:\n\
   '3', '4'               : Change Neutron Pulse Height Threshold\n\
   '5', '6'               : Change Neutron CPM Summary Graph Scale\n\
   '>', '<'               : Set Playback Speed\n\
+  't'                    : Flight Recorder Snapshot (live mode)\n\
 \n\
   (*) Use Ctl or Alt with Left/Right Arrow to increase response\n\
 \n\
@@ -32,11 +32,34 @@ SOFTWARE.
 #define OWON_B35_FUSOR_CURRENT_METER_ID    1
 #define OWON_B35_FUSOR_CURRENT_METER_ADDR  "98:84:E3:CD:B8:06"
 
+#define DATAQ_ADC_CHAN_VOLTAGE   1
+#define DATAQ_ADC_CHAN_CURRENT   2
 #define DATAQ_ADC_CHAN_PRESSURE  3
 
 #define MAX_ADC_DATA                1200
-#define MAX_NEUTRON_PULSE           256 
+#define MAX_NEUTRON_PULSE_WAVEFORM  20000   // max neutron pulses stored in data part2, per second
+#define MAX_NEUTRON_PULSE_TIME      100000  // max neutron pulse times stored in data part2, per second
 #define MAX_NEUTRON_ADC_PULSE_DATA  20
+#define MAX_DATA_PART2_LENGTH       2500000
+
+// neutron pulse height histogram bins; the bin widths match the steps used by
+// the display to adjust the pulse height threshold, so the number of pulses at 
+// or above a threshold that is on a bin boundary is exact
+//     0 -   499 mv :   1 mv bins
+//   500 -   999 mv :   5 mv bins
+//  1000 -  1999 mv :  10 mv bins
+//  2000 -  2999 mv :  20 mv bins
+//  3000 -  9999 mv : 100 mv bins
+//  >= 10000     mv : last bin
+#define MAX_NEUTRON_PHT_BIN  821
+#define NEUTRON_PHT_BIN(mv) \
+    ((mv) < 0     ? 0                         : \
+     (mv) < 500   ? (mv)                      : \
+     (mv) < 1000  ? 500 + ((mv) - 500) / 5    : \
+     (mv) < 2000  ? 600 + ((mv) - 1000) / 10  : \
+     (mv) < 3000  ? 700 + ((mv) - 2000) / 20  : \
+     (mv) < 10000 ? 750 + ((mv) - 3000) / 100 : \
+                    820)
 
 #define IS_ERROR(x) ((int32_t)(x) >= ERROR_FIRST && (int32_t)(x) <= ERROR_LAST)
 #define ERROR_FIRST                   1000000 
@@ -52,8 +75,18 @@ SOFTWARE.
 
 #define PORT 9001
 
-#define MAGIC_DATA_PART1  0xaabbccdd55aa55aa
-#define MAGIC_DATA_PART2  0x77777777aaaaaaaa
+#define MAGIC_DATA_PART1  0xaabbccdd55aa55af
+#define MAGIC_DATA_PART2  0x77777777aaaaaaae
+#define MAGIC_CMD         0x3333333355aa55a1
+
+// commands sent by the display program to get_data, on the data connection
+#define CMD_FLIGHT_RECORDER_TRIGGER  1
+
+typedef struct {
+    uint64_t magic;
+    int32_t  cmd;
+    int32_t  arg;
+} cmd_t;
 
 // data_part1_s and data_part2_s are each padded to 8 byte boundary
 typedef struct {
@@ -65,9 +98,23 @@ typedef struct {
         float    current_ma;
         float    d2_pressure_mtorr;
         float    n2_pressure_mtorr;
-        int16_t  neutron_pulse_mv[MAX_NEUTRON_PULSE];  // store pulse height for each pulse, in mv
-        int32_t  max_neutron_pulse;
-        int32_t  pad1;
+        // the neutron values are ERROR_NO_VALUE when get_data does not have the neutron
+        // data for the second, for example because the mccdaq is not yet ready
+        int32_t  neutron_pulse_count;    // number of neutron pulses detected, each peak of a pile-up is counted
+        int32_t  neutron_pulse_count_corrected;  // neutron_pulse_count corrected for dead time
+        int32_t  neutron_pileup_count;   // number of pile-ups, pulses with multiple peaks
+        int32_t  neutron_live_time_us;   // time that the pulse detector was receiving samples, 
+                                         //  and was not in a pulse
+        int32_t  neutron_samples_expected;   // samples expected in the second, per the sample clock
+        int32_t  neutron_samples_received;   // samples processed by the pulse detector
+        int32_t  neutron_samples_discarded;  // samples discarded because analysis fell behind
+        int32_t  neutron_restart_gap_us;     // time lost while the mccdaq scan was restarted
+        float    neutron_baseline_mv;    // pulse detector baseline
+        float    neutron_baseline_rms_mv;  // rms noise of the baseline
+        int32_t  max_neutron_pulse;      // number of neutron pulses stored in data part2
+        int32_t  max_neutron_pulse_time; // number of neutron pulse times stored in data part2
+        uint16_t neutron_pulse_hist[MAX_NEUTRON_PHT_BIN];  // pulse height histogram, of all pulses
+        int8_t   pad1[6];
 
         off_t    data_part2_offset;      // for use by display pgm
         uint32_t data_part2_length;
@@ -82,10 +129,34 @@ typedef struct {
         int16_t  voltage_adc_data[MAX_ADC_DATA];    // mv, 1200/sec
         int16_t  current_adc_data[MAX_ADC_DATA];    // mv, 1200/sec
         int16_t  pressure_adc_data[MAX_ADC_DATA];   // mv, 1200/sec
-        int16_t  neutron_adc_pulse_data[MAX_NEUTRON_PULSE][MAX_NEUTRON_ADC_PULSE_DATA];  
-                                                    // mv, neutron pulses, 20 samples each
-        uint8_t  jpeg_buff[0];
+        uint8_t  var_data[0];                       // neutron pulses and jpeg_buff, see below
     } part2;
 } data_t;
 
+// data_part2_s is followed by variable length data:
+// - the neutron pulse section:
+//   . uint32_t neutron_pulse_time_ns[max_neutron_pulse_time]: the time of the
+//     pulse's first sample, ns since the start of the second that precedes
+//     part1.time; these are in pulse order, and the first max_neutron_pulse
+//     are the times of the stored pulses
+//   . int16_t neutron_pulse_mv[max_neutron_pulse]: pulse height, mv
+//   . int16_t neutron_adc_pulse_data[max_neutron_pulse][MAX_NEUTRON_ADC_PULSE_DATA]: 
+//     mv, 20 samples each; when get_data uses a filter (-f option) these are
+//     the filter output, not the adc samples
+//   . padded to 8 byte boundary
+// - the jpeg buff, data_part2_jpeg_buff_len bytes
+#define DATA_PART2_NEUTRON_PULSE_LEN(dp1) \
+    (((dp1)->max_neutron_pulse_time * sizeof(uint32_t) + \
+      (dp1)->max_neutron_pulse * (1 + MAX_NEUTRON_ADC_PULSE_DATA) * sizeof(int16_t) + 7) & ~7)
+#define DATA_PART2_NEUTRON_PULSE_TIME_NS(dp1,dp2) \
+    ((uint32_t*)(dp2)->var_data)
+#define DATA_PART2_NEUTRON_PULSE_MV(dp1,dp2) \
+    ((int16_t*)((uint32_t*)(dp2)->var_data + (dp1)->max_neutron_pulse_time))
+#define DATA_PART2_NEUTRON_ADC_PULSE_DATA(dp1,dp2) \
+    ((int16_t (*)[MAX_NEUTRON_ADC_PULSE_DATA])(DATA_PART2_NEUTRON_PULSE_MV(dp1,dp2) + (dp1)->max_neutron_pulse))
+#define DATA_PART2_JPEG_BUFF(dp1,dp2) \
+    ((dp2)->var_data + DATA_PART2_NEUTRON_PULSE_LEN(dp1))
+#define DATA_PART2_LENGTH(dp1) \
+    (sizeof(struct data_part2_s) + DATA_PART2_NEUTRON_PULSE_LEN(dp1) + (dp1)->data_part2_jpeg_buff_len)
+
 #endif
@@ -58,10 +58,9 @@ SOFTWARE.
 
 #define MODE_STR(m) ((m) == LIVE ? "LIVE" : (m) == PLAYBACK ? "PLAYBACK" : "TEST")
 
-#define MAGIC_FILE 0x1122334455667788
+#define MAGIC_FILE 0x112233445566778d
 
 #define MAX_FILE_DATA_PART1   (6*3600)  // 6 hours
-#define MAX_DATA_PART2_LENGTH 1000000
 
 #define FILE_DATA_PART2_OFFSET \
    ((sizeof(file_hdr_t) +  \
@@ -101,6 +100,8 @@ SOFTWARE.
         } \
     } while (0)
 
+#define MAX_ADC_DATA_GRAPH_SELECT  4   // neutron, pressure, voltage, current
+
 #define DEFAULT_IMAGE_X                     "320"
 #define DEFAULT_IMAGE_Y                     "240"
 #define DEFAULT_IMAGE_SIZE                  "300"
@@ -147,6 +148,7 @@ typedef struct {
 static enum mode                mode;
 static bool                     initial_mode;
 static bool                     lost_connection;
+static bool                     flight_trigger_req;
 static bool                     file_error;
 static bool                     time_error;
 static bool                     program_terminating;
@@ -370,6 +372,9 @@ static int32_t initialize(int32_t argc, char ** argv)
     {
         FATAL("invalid config value, not a number\n");
     }
+    if (adc_data_graph_select < 0 || adc_data_graph_select >= MAX_ADC_DATA_GRAPH_SELECT) {
+        adc_data_graph_select = 0;
+    }
     atexit(atexit_config_write);
 
     // if mode is live or test then 
@@ -635,9 +640,20 @@ static void * get_live_data_thread(void * cx)
     dp1->current_ma                               = ERROR_NO_VALUE;
     dp1->d2_pressure_mtorr                        = ERROR_NO_VALUE;
     dp1->n2_pressure_mtorr                        = ERROR_NO_VALUE;
+    dp1->neutron_pulse_count                      = ERROR_NO_VALUE;
+    dp1->neutron_pulse_count_corrected            = ERROR_NO_VALUE;
+    dp1->neutron_pileup_count                     = ERROR_NO_VALUE;
+    dp1->neutron_live_time_us                     = ERROR_NO_VALUE;
+    dp1->neutron_samples_expected                 = ERROR_NO_VALUE;
+    dp1->neutron_samples_received                 = ERROR_NO_VALUE;
+    dp1->neutron_samples_discarded                = ERROR_NO_VALUE;
+    dp1->neutron_restart_gap_us                   = ERROR_NO_VALUE;
+    dp1->neutron_baseline_mv                      = ERROR_NO_VALUE;
+    dp1->neutron_baseline_rms_mv                  = ERROR_NO_VALUE;
     dp1->max_neutron_pulse                        = 0;
+    dp1->max_neutron_pulse_time                   = 0;
     dp1->data_part2_offset                        = 0;
-    dp1->data_part2_length                        = sizeof(struct data_part2_s);
+    dp1->data_part2_length                        = DATA_PART2_LENGTH(dp1);
     dp1->data_part2_jpeg_buff_len                 = 0;
     dp1->data_part2_voltage_adc_data_valid        = false;
     dp1->data_part2_current_adc_data_valid        = false;
@@ -701,6 +717,14 @@ try_to_connect_again:
                   dp1->data_part2_length);
             goto connection_failed;
         }
+        if (dp1->max_neutron_pulse < 0 || dp1->max_neutron_pulse > MAX_NEUTRON_PULSE_WAVEFORM ||
+            dp1->max_neutron_pulse_time < 0 || dp1->max_neutron_pulse_time > MAX_NEUTRON_PULSE_TIME ||
+            dp1->data_part2_length != DATA_PART2_LENGTH(dp1)) 
+        {
+            ERROR("data_part2_length %d is invalid, max_neutron_pulse=%d jpeg_buff_len=%d\n", 
+                  dp1->data_part2_length, dp1->max_neutron_pulse, dp1->data_part2_jpeg_buff_len);
+            goto connection_failed;
+        }
 
         // read data part2 from server,
         // verify magic
@@ -721,13 +745,15 @@ try_to_connect_again:
 
         // if data part2 does not contain camera data then 
         // see if the camera data is being captured by this program, 
-        // and add it
+        // and add it; the jpeg buff is at the end of data part2
         if (dp1->data_part2_jpeg_buff_len == 0) {
             pthread_mutex_lock(&jpeg_mutex);
-            if (microsec_timer() - jpeg_buff_us < 1000000) {
-                memcpy(dp2->jpeg_buff, jpeg_buff, jpeg_buff_len);
+            if (microsec_timer() - jpeg_buff_us < 1000000 &&
+                DATA_PART2_LENGTH(dp1) + jpeg_buff_len <= MAX_DATA_PART2_LENGTH) 
+            {
+                memcpy(DATA_PART2_JPEG_BUFF(dp1,dp2), jpeg_buff, jpeg_buff_len);
                 dp1->data_part2_jpeg_buff_len = jpeg_buff_len;
-                dp1->data_part2_length = sizeof(struct data_part2_s) + jpeg_buff_len;
+                dp1->data_part2_length = DATA_PART2_LENGTH(dp1);
             }
             pthread_mutex_unlock(&jpeg_mutex);
         }
@@ -735,7 +761,7 @@ try_to_connect_again:
         // if opt_no_cam then disacard camera data
         if (opt_no_cam) {
             dp1->data_part2_jpeg_buff_len = 0;
-            dp1->data_part2_length = sizeof(struct data_part2_s);
+            dp1->data_part2_length = DATA_PART2_LENGTH(dp1);
         }
 
         // verify the time of received data is close to the time 
@@ -792,6 +818,16 @@ try_to_connect_again:
             __sync_synchronize();
         }
 
+        // if requested then send the flight recorder trigger command to the server
+        if (__atomic_exchange_n(&flight_trigger_req, false, __ATOMIC_RELAXED)) {
+            cmd_t cmd = { .magic = MAGIC_CMD, .cmd = CMD_FLIGHT_RECORDER_TRIGGER };
+            if (do_send(sfd, &cmd, sizeof(cmd)) != sizeof(cmd)) {
+                ERROR("send flight recorder trigger, %s\n", strerror(errno));
+                goto connection_failed;
+            }
+            INFO("sent flight recorder trigger\n");
+        }
+
 #ifdef JPEG_BUFF_SAMPLE_CREATE_ENABLE
         // write a sample jpeg buffer to jpeg_buff_sample file
         static bool sample_written = false;
@@ -800,10 +836,10 @@ try_to_connect_again:
             if (fd < 0) {
                 ERROR("open %s, %s\n", JPEG_BUFF_SAMPLE_FILENAME, strerror(errno));
             } else {
-                int32_t len = write(fd, dp2->jpeg_buff, dp2->jpeg_buff_len);
-                if (len != dp2->jpeg_buff_len) {
+                int32_t len = write(fd, DATA_PART2_JPEG_BUFF(dp1,dp2), dp1->data_part2_jpeg_buff_len);
+                if (len != dp1->data_part2_jpeg_buff_len) {
                     ERROR("write %s len exp=%d act=%d, %s\n",
-                        JPEG_BUFF_SAMPLE_FILENAME, dp2->jpeg_buff_len, len, strerror(errno));
+                        JPEG_BUFF_SAMPLE_FILENAME, dp1->data_part2_jpeg_buff_len, len, strerror(errno));
                 }
                 close(fd);
             }
@@ -1147,6 +1183,7 @@ static int32_t display_handler(void)
         sdl_event_register('<', SDL_EVENT_TYPE_KEY, NULL);
         sdl_event_register(',', SDL_EVENT_TYPE_KEY, NULL);
         sdl_event_register('.', SDL_EVENT_TYPE_KEY, NULL);
+        sdl_event_register('t', SDL_EVENT_TYPE_KEY, NULL);                           // flight recorder trigger
 
         // present the display
         sdl_display_present();
@@ -1277,6 +1314,11 @@ static int32_t display_handler(void)
                     playback_advance_us = microsec_timer() + 1000000 / playback_speed;
                 }
                 break;
+            case 't':
+                if (initial_mode == LIVE) {
+                    flight_trigger_req = true;
+                }
+                break;
             case '<': case ',':
                 if (mode == PLAYBACK && playback_speed > 0) {
                     playback_speed--;
@@ -1373,7 +1415,8 @@ static void draw_camera_image(rect_t * cam_pane, int32_t file_idx)
     // decode the jpeg buff contained in data_part2
     ret = jpeg_decode(0,  // cxid
                      JPEG_DECODE_MODE_YUY2,      
-                     data_part2->jpeg_buff, file_data_part1[file_idx].data_part2_jpeg_buff_len,
+                     DATA_PART2_JPEG_BUFF(&file_data_part1[file_idx], data_part2), 
+                     file_data_part1[file_idx].data_part2_jpeg_buff_len,
                      &pixel_buff, &pixel_buff_width, &pixel_buff_height);
     if (ret < 0) {
         ERROR("jpeg_decode ret %d\n", ret);
@@ -1475,9 +1518,19 @@ static void draw_data_values(rect_t * data_pane, int32_t file_idx)
             neutron_pht_mv);
     sdl_render_text(data_pane, 0, 0, 1, str, WHITE, BLACK);
 
-    sprintf(str, "%s   %s",
-            val2str(dp1->d2_pressure_mtorr, UNITS_D2_MT),
-            val2str(dp1->n2_pressure_mtorr, UNITS_N2_MT));
+    // the live time fraction and the samples lost are shown when the record 
+    // contains the neutron sample accounting
+    if (!IS_ERROR(dp1->neutron_samples_expected) && dp1->neutron_samples_expected > 0) {
+        sprintf(str, "%s   %s   LIVE=%0.1f%%   LOST=%d",
+                val2str(dp1->d2_pressure_mtorr, UNITS_D2_MT),
+                val2str(dp1->n2_pressure_mtorr, UNITS_N2_MT),
+                dp1->neutron_live_time_us / 10000.,
+                dp1->neutron_samples_expected - dp1->neutron_samples_received);
+    } else {
+        sprintf(str, "%s   %s",
+                val2str(dp1->d2_pressure_mtorr, UNITS_D2_MT),
+                val2str(dp1->n2_pressure_mtorr, UNITS_N2_MT));
+    }
     sdl_render_text(data_pane, 1, 0, 1, str, WHITE, BLACK);
 }
 
@@ -1621,12 +1674,15 @@ static void draw_adc_data_graph(rect_t * graph_pane, int32_t file_idx)
     switch (adc_data_graph_select) {
     case 0:
         if (dp2) {
+            int16_t * neutron_pulse_mv = DATA_PART2_NEUTRON_PULSE_MV(dp1,dp2);
+            int16_t (* neutron_adc_pulse_data)[MAX_NEUTRON_ADC_PULSE_DATA] = 
+                                         DATA_PART2_NEUTRON_ADC_PULSE_DATA(dp1,dp2);
             k = 0;
             for (i = 0; i < dp1->max_neutron_pulse; i++) {
-                if (dp1->neutron_pulse_mv[i] >= neutron_pht_mv) {
+                if (neutron_pulse_mv[i] >= neutron_pht_mv) {
                     // copy pulse data to adc_data array (to be plotted)
                     for (j = 0; j < MAX_NEUTRON_ADC_PULSE_DATA; j++) {
-                        adc_data[k++] = dp2->neutron_adc_pulse_data[i][j];
+                        adc_data[k++] = neutron_adc_pulse_data[i][j];
                         if (k == MAX_ADC_DATA) {
                             break;
                         }
@@ -1662,6 +1718,28 @@ static void draw_adc_data_graph(rect_t * graph_pane, int32_t file_idx)
         sprintf(title_str, "PRESSURE ADC");
         color = BLUE;
         break;
+    case 2:
+        if (dp2 && dp1->data_part2_voltage_adc_data_valid) {
+            for (i = 0; i < MAX_ADC_DATA; i++) {
+                adc_data[i] = dp2->voltage_adc_data[i];
+                sum += adc_data[i];
+                cnt++;
+            }
+        }
+        sprintf(title_str, "VOLTAGE ADC");
+        color = RED;
+        break;
+    case 3:
+        if (dp2 && dp1->data_part2_current_adc_data_valid) {
+            for (i = 0; i < MAX_ADC_DATA; i++) {
+                adc_data[i] = dp2->current_adc_data[i];
+                sum += adc_data[i];
+                cnt++;
+            }
+        }
+        sprintf(title_str, "CURRENT ADC");
+        color = GREEN;
+        break;
     default:
         FATAL("invalid adc_data_graph_select = %d\n", adc_data_graph_select);
         break;
@@ -1691,10 +1769,28 @@ static void draw_adc_data_graph(rect_t * graph_pane, int32_t file_idx)
 static void draw_adc_data_graph_control(char key)
 {
     static uint32_t  max_y_mv_tbl[] = {100, 200, 500, 1000, 2000, 5000, 10000};
+    struct data_part1_s * dp1;
+    int32_t i, select;
+    bool valid;
 
     switch (key) {
     case 's':
-        adc_data_graph_select = ((adc_data_graph_select + 1) % 2);
+        // select the next graph that has data in the file_idx_global record; 
+        // the neutron graph is always selectable
+        dp1 = (file_idx_global >= 0 && file_idx_global < file_hdr->max
+               ? &file_data_part1[file_idx_global] : NULL);
+        for (i = 1; i <= MAX_ADC_DATA_GRAPH_SELECT; i++) {
+            select = (adc_data_graph_select + i) % MAX_ADC_DATA_GRAPH_SELECT;
+            valid = (select == 0 ||
+                     (dp1 != NULL &&
+                      ((select == 1 && dp1->data_part2_pressure_adc_data_valid) ||
+                       (select == 2 && dp1->data_part2_voltage_adc_data_valid) ||
+                       (select == 3 && dp1->data_part2_current_adc_data_valid))));
+            if (valid) {
+                break;
+            }
+        }
+        adc_data_graph_select = select;
         break;
     case '1':
         REDUCE(adc_data_graph_max_y_mv, max_y_mv_tbl);
@@ -1963,14 +2059,24 @@ static int32_t generate_test_file(void)
         dp1->current_ma = 0;
         dp1->d2_pressure_mtorr = 10;
         dp1->n2_pressure_mtorr = 13;
+        dp1->neutron_pulse_count = 100;
+        dp1->neutron_pulse_count_corrected = 100;
+        dp1->neutron_pileup_count = 0;
+        dp1->neutron_live_time_us = 1000000 - 100 * 4;
+        dp1->neutron_samples_expected = 500000;
+        dp1->neutron_samples_received = 500000;
+        dp1->neutron_samples_discarded = 0;
+        dp1->neutron_restart_gap_us = 0;
+        dp1->max_neutron_pulse = 100;
+        dp1->max_neutron_pulse_time = 100;
+        bzero(dp1->neutron_pulse_hist, sizeof(dp1->neutron_pulse_hist));
         for (i = 0; i < 100; i++) {
-            dp1->neutron_pulse_mv[i] = 50 + 5 * i;   // pulse height in mv
+            dp1->neutron_pulse_hist[NEUTRON_PHT_BIN(50 + 5 * i)]++;
         }
-        dp1->max_neutron_pulse = 100;
 
         dp1->data_part2_offset = dp2_offset;
-        dp1->data_part2_length = sizeof(struct data_part2_s) + jpeg_buff_len;
         dp1->data_part2_jpeg_buff_len = jpeg_buff_len;
+        dp1->data_part2_length = DATA_PART2_LENGTH(dp1);
         dp1->data_part2_voltage_adc_data_valid = true;
         dp1->data_part2_current_adc_data_valid = true;
         dp1->data_part2_pressure_adc_data_valid = true;
@@ -1982,12 +2088,16 @@ static int32_t generate_test_file(void)
             dp2->current_adc_data[i]  =  5000 * i / MAX_ADC_DATA;
             dp2->pressure_adc_data[i] =  1000 * i / MAX_ADC_DATA;
         }
+        bzero(dp2->var_data, DATA_PART2_NEUTRON_PULSE_LEN(dp1));
         for (i = 0; i < dp1->max_neutron_pulse; i++) {
-            dp2->neutron_adc_pulse_data[i][MAX_NEUTRON_ADC_PULSE_DATA/2+0] = dp1->neutron_pulse_mv[i];
-            dp2->neutron_adc_pulse_data[i][MAX_NEUTRON_ADC_PULSE_DATA/2+1] = dp1->neutron_pulse_mv[i] / 2;
-            dp2->neutron_adc_pulse_data[i][MAX_NEUTRON_ADC_PULSE_DATA/2+2] = dp1->neutron_pulse_mv[i] / 4;
+            int16_t mv = 50 + 5 * i;   // pulse height in mv
+            DATA_PART2_NEUTRON_PULSE_TIME_NS(dp1,dp2)[i] = i * 10000000;
+            DATA_PART2_NEUTRON_PULSE_MV(dp1,dp2)[i] = mv;
+            DATA_PART2_NEUTRON_ADC_PULSE_DATA(dp1,dp2)[i][MAX_NEUTRON_ADC_PULSE_DATA/2+0] = mv;
+            DATA_PART2_NEUTRON_ADC_PULSE_DATA(dp1,dp2)[i][MAX_NEUTRON_ADC_PULSE_DATA/2+1] = mv / 2;
+            DATA_PART2_NEUTRON_ADC_PULSE_DATA(dp1,dp2)[i][MAX_NEUTRON_ADC_PULSE_DATA/2+2] = mv / 4;
         }
-        memcpy(dp2->jpeg_buff, jpeg_buff, jpeg_buff_len);
+        memcpy(DATA_PART2_JPEG_BUFF(dp1,dp2), jpeg_buff, jpeg_buff_len);
 
         len = pwrite(file_fd, dp2, dp1->data_part2_length, dp2_offset);
         if (len != dp1->data_part2_length) {
@@ -2171,13 +2281,22 @@ static float neutron_cpm(int32_t file_idx)
                     return ERROR_NO_VALUE;
                 }
 
+                // if get_data did not have the neutron data, for example because
+                // the mccdaq was not yet ready, then the average is not available
+                if (IS_ERROR(dp1->neutron_pulse_count)) {
+                    return ERROR_NO_VALUE;
+                }
+
                 // count the number of pulses which have height greater or
-                // equal to the pulse-height-threshold
+                // equal to the pulse-height-threshold, using the pulse height
+                // histogram, which includes all of the pulses; and apply
+                // the dead time correction that get_data computed for all pulses
                 cps = 0;
-                for (j = 0; j < dp1->max_neutron_pulse; j++) {
-                    if (dp1->neutron_pulse_mv[j] >= neutron_pht_mv) {
-                        cps++;
-                    }
+                for (j = NEUTRON_PHT_BIN(neutron_pht_mv); j < MAX_NEUTRON_PHT_BIN; j++) {
+                    cps += dp1->neutron_pulse_hist[j];
+                }
+                if (dp1->neutron_pulse_count > 0) {
+                    cps = (int64_t)cps * dp1->neutron_pulse_count_corrected / dp1->neutron_pulse_count;
                 }
 
                 // save the result in the neutron_cps_cache
@@ -34,16 +34,23 @@ SOFTWARE.
 #include <inttypes.h>
 #include <limits.h>
 
+#include <math.h>
 #include <pthread.h>
 #include <signal.h>
+#include <poll.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 
 #include "common.h"
 #include "util_dataq.h"
+#include "util_pulse_gen.h"
 #include "util_mccdaq.h"
 #include "util_owon_b35.h"
 #include "util_cam.h"
+#include "util_pulse.h"
+#include "util_filter.h"
+#include "util_pulse_trace.h"
+#include "util_raw_capture.h"
 #include "util_misc.h"
 
 //
@@ -51,12 +58,56 @@ SOFTWARE.
 //
 
 //#define CAM_ENABLE
-#define DEBUG_PRINT_PULSE_GRAPH
+#define ENABLE_PULSE_TRACE
 #define DEBUG_PRINT_INFO
 
 #define GAS_ID_D2 0
 #define GAS_ID_N2 1
 
+#define TUNE_PULSE_THRESHOLD  10
+
+#define DEFAULT_MAX_NEUTRON_WAVEFORM  1000
+
+#define MAX_FILTER_BUFF  65536
+
+#define MAX_DISCARD_RANGE  16
+
+#define SERVER_NEUTRON_WAIT_MS  250
+
+#define PULSE_TRACE_FILENAME       "pulse_trace.dat"
+#define PULSE_TRACE_MAX_FILE_SIZE  (64*1024*1024)
+#define PULSE_TRACE_MAX_FILES      4
+
+#define RAW_CAPTURE_MAX_FILE_SIZE  (1024*1024*1024)
+#define RAW_CAPTURE_MAX_FILES      16
+
+#define FLIGHT_INTVL_MS            100   // the triggers are evaluated at this interval
+#define FLIGHT_MAX_SECS            15    // max pre + post, the mccdaq ring holds 21 secs
+#define FLIGHT_RATE_AVG_SECS       10.   // time constant of the average pulse rate
+#define FLIGHT_RATE_MIN_PULSES     20    // min pulses in an interval for a rate trigger
+#define FLIGHT_CURRENT_AVG_SECS    2.    // time constant of the average current
+
+// devices, and their bring-up states
+#define DEVICE_DATAQ          0
+#define DEVICE_MCCDAQ         1
+#define DEVICE_VOLTAGE_METER  2
+#define DEVICE_CURRENT_METER  3
+#define MAX_DEVICE            4
+
+#define DEVICE_STATE_STARTING  0
+#define DEVICE_STATE_READY     1
+#define DEVICE_STATE_FAILED    2
+
+#define DEVICE_STATE_STR(x) \
+    ((x) == DEVICE_STATE_STARTING ? "STARTING" : \
+     (x) == DEVICE_STATE_READY    ? "READY"    : \
+     (x) == DEVICE_STATE_FAILED   ? "FAILED"     \
+                                  : "????")
+
+#if PULSE_WAVEFORM_LEN != MAX_NEUTRON_ADC_PULSE_DATA
+#error "PULSE_WAVEFORM_LEN must equal MAX_NEUTRON_ADC_PULSE_DATA"
+#endif
+
 #define ATOMIC_INCREMENT(x) \
     do { \
         __sync_fetch_and_add(x,1); \
@@ -71,6 +122,48 @@ SOFTWARE.
 // typedefs
 //
 
+typedef struct {
+    uint64_t time;                   // contains the pulses that start in second time-1
+    int32_t  samples;                // number of samples in the second, per the sample clock
+    int32_t  lost_samples;           // samples lost in the second, while the mccdaq scan was restarted
+    int32_t  samples_discarded;      // samples in the second that mccdaq discarded, because
+                                     //  the analysis stage had fallen behind
+    int32_t  baseline;               // pulse detector baseline, adc counts
+    float    baseline_rms;           // rms noise of the baseline, adc counts
+    uint64_t skipped_count;          // pulse detector counters, since start
+    uint64_t too_long_count;
+    uint64_t out_of_range_count;
+    int32_t  neutron_pulse_count;    // number of pulses detected, each peak of a pile-up is counted
+    int32_t  neutron_pulse_count_corrected;  // corrected for dead time
+    int32_t  neutron_pileup_count;   // number of pile-ups
+    int32_t  neutron_live_time_us;   // time the pulse detector was not in a pulse
+    uint16_t neutron_pulse_hist[MAX_NEUTRON_PHT_BIN];
+    int32_t  max_neutron_pulse_time; // number of pulse times stored, limited by MAX_NEUTRON_PULSE_TIME
+    int32_t  alloc_neutron_pulse_time;
+    uint32_t * neutron_pulse_time_ns;  // pulse time, ns since the start of second time-1
+    int32_t  max_neutron_pulse;      // number of pulses stored, limited by opt_max_neutron_waveform
+    int32_t  alloc_neutron_pulse;    // allocated size of the following arrays
+    int16_t  * neutron_pulse_mv;     // store pulse height for each pulse, in mv
+    int16_t (* neutron_adc_pulse_data)[MAX_NEUTRON_ADC_PULSE_DATA];   // mv
+} neutron_sec_t;
+
+typedef struct {
+    double   rate_factor;            // pulse rate exceeds its average by this factor, 0 disables
+    double   current_ma;             // current differs from its average by this much, 0 disables
+    double   pressure_mtorr;         // d2 pressure rises above this, 0 disables
+    double   pre_secs;               // samples saved preceding the trigger
+    double   post_secs;              // samples saved following the trigger
+    bool     compress;
+    char     dir[PATH_MAX];          // directory of the snapshot files
+} flight_cfg_t;
+
+typedef struct {
+    int32_t  triggers;
+    int32_t  snapshots;
+    int32_t  suppressed;             // triggers while a snapshot is pending
+    int32_t  errors;
+} flight_stats_t;
+
 //
 // variables
 //
@@ -78,6 +171,18 @@ SOFTWARE.
 static int32_t         active_thread_count;
 static bool            sigint_or_sigterm;
 
+// the devices are brought up concurrently; each device's values are NO_VALUE
+// in the data records until the device is ready
+static struct {
+    char   * name;
+    int32_t  state;                  // DEVICE_STATE_xxx
+} device[MAX_DEVICE] = { 
+    [DEVICE_DATAQ]         = { "dataq" },
+    [DEVICE_MCCDAQ]        = { "mccdaq" },
+    [DEVICE_VOLTAGE_METER] = { "voltage_meter" },
+    [DEVICE_CURRENT_METER] = { "current_meter" }, };
+static uint64_t        device_start_us;
+
 #ifdef CAM_ENABLE
 static uint8_t         jpeg_buff[1000000];
 static int32_t         jpeg_buff_len;
@@ -86,16 +191,56 @@ static pthread_mutex_t jpeg_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 static pthread_mutex_t neutron_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  neutron_cond = PTHREAD_COND_INITIALIZER;   // signalled when neutron_time changes
 static uint64_t        neutron_time;
-static int16_t         neutron_pulse_mv[MAX_NEUTRON_PULSE];  // store pulse height for each pulse, in mv
-static int16_t         neutron_adc_pulse_data[MAX_NEUTRON_PULSE][MAX_NEUTRON_ADC_PULSE_DATA];   // mv
-static int32_t         max_neutron_pulse;
+static neutron_sec_t   neutron_sec[2];
+static neutron_sec_t * neutron_pub = &neutron_sec[0];  // published, protected by neutron_mutex
+static neutron_sec_t * neutron_acc = &neutron_sec[1];  // being accumulated by mccdaq_callback
+static uint64_t        neutron_acc_start_idx;           // first sample of the second being accumulated
+static pulse_detect_t  neutron_pd;
+static uint32_t        neutron_pulses_published;        // neutron_pd.pulse_count, stored by mccdaq_callback
+static filter_t        neutron_filter;
+static uint16_t        neutron_filter_buff[MAX_FILTER_BUFF];
+
+// ranges of sample indexes discarded by mccdaq, not yet accounted to a published second
+static struct {
+    uint64_t start_idx;
+    uint64_t end_idx;
+} discard_range[MAX_DISCARD_RANGE];
+static int32_t         max_discard_range;
+
+static int32_t         opt_pulse_detect_mode = PULSE_DETECT_MODE_SIMD;
+static int32_t         opt_dead_time_model = PULSE_DEAD_TIME_MODEL_NONPARALYZABLE;
+static char          * opt_filter = "none";
+static int32_t         opt_max_neutron_waveform = DEFAULT_MAX_NEUTRON_WAVEFORM;
+static int32_t         opt_detect_threads = 1;
+static char          * opt_raw_capture_filename;
+static bool            opt_raw_capture_compress;
+static char          * opt_dataq_capture_filename;
+static char          * opt_replay_filename;
+static bool            opt_replay_realtime;
+#ifdef MCCDAQ_TEST
+static char          * opt_sim_spec;
+static char          * opt_sim_truth_filename;
+#endif
+
+static pthread_t       main_thread;
+static uint64_t        replay_start_us;
+static uint64_t        replay_end_us;     // time of the most recent mccdaq_callback, when replaying
+static int32_t         opt_drain_cpu = -1;
+static int32_t         opt_analysis_cpu = -1;
+
+static char          * opt_flight_spec;
+static flight_cfg_t    flight_cfg;
+static flight_stats_t  flight_stats;
+static bool            flight_manual_req;   // set by the display's trigger command, or SIGUSR1
 
 //
 // prototypes
 //
 
-static void init(void);
+static void init(int32_t argc, char ** argv);
+static void usage(void);
 static void server(void);
 #ifdef CAM_ENABLE
 static void * cam_thread(void * cx);
@@ -103,13 +248,24 @@ static void * cam_thread(void * cx);
 static void signal_handler(int sig);
 static void * server_thread(void * cx);
 static void init_data_struct(data_t * data, time_t time_now);
+static void * dataq_init_thread(void * cx);
+static void * device_monitor_thread(void * cx);
+static bool device_ready(int32_t id);
+static void device_set_state(int32_t id, int32_t state);
 static float get_fusor_voltage_kv(void);
 static float get_fusor_current_ma(void);
 static float convert_adc_pressure(float adc_volts, int32_t gas_id);
-static int32_t mccdaq_callback(uint16_t * data, int32_t max_data);
-#ifdef DEBUG_PRINT_PULSE_GRAPH
-static void print_plot_str(int32_t value, int32_t baseline);
-#endif
+static void * neutron_report_thread(void * cx);
+static bool replay_done(void);
+static int32_t mccdaq_callback(uint16_t * data, int32_t max_data, uint64_t sample_idx);
+static void neutron_pulse_callback(pulse_t * pulse, void * cx);
+static void discard_range_add(uint64_t start_idx, uint64_t end_idx);
+static int64_t discard_range_count(uint64_t start_idx, uint64_t end_idx);
+static void neutron_publish(void);
+static int32_t flight_recorder_parse(char * spec);
+static void * flight_recorder_thread(void * cx);
+static void flight_recorder_snapshot(char * reason, uint64_t start_idx, uint64_t end_idx, int64_t trig_ns);
+static void sigusr1_handler(int sig);
 
 // -----------------  MAIN & TOP LEVEL ROUTINES  -------------------------------------
 
@@ -118,7 +274,7 @@ int32_t main(int32_t argc, char **argv)
     int32_t wait_ms;
 
     // init
-    init();
+    init(argc, argv);
 
     // runtime
     server();
@@ -134,13 +290,126 @@ int32_t main(int32_t argc, char **argv)
     return 0;
 }
 
-static void init(void)
+static void init(int32_t argc, char ** argv)
 {
     struct rlimit rl;
     struct sigaction action;
+    pthread_t thread;
 
     // use line bufferring
     setlinebuf(stdout);
+    main_thread = pthread_self();
+
+    // parse options
+    // -h          : help
+    // -d mode     : pulse detector mode, simd (default) or scalar
+    // -a cpu,cpu  : pin the mccdaq drain and analysis threads to cpus, -1 is not pinned
+    // -w max      : max neutron pulse waveforms stored per second, default 1000
+    // -m model    : dead time model, nonparalyzable (default), paralyzable, or none
+    // -f filter   : filter applied ahead of the pulse detector, see util_filter.c,
+    //               none (default), ma,n  trap,k,m  matched,file  crrc,tau[,gain];
+    //               when a filter is used the stored pulse waveforms and the pulse trace
+    //               hold the filter output, which is offset to FILTER_AC_BASELINE (except
+    //               for ma), not the adc samples
+    // -j threads  : max threads used by the pulse detector when catching up, default 1
+    // -r filename : capture the raw neutron detector samples to filename
+    // -z          : compress the raw capture
+    // -R filename : replay a raw capture file, instead of acquiring from the mccdaq device;
+    //               get_data terminates when the replay is done
+    // -S          : replay at the sample rate, default is as fast as possible
+    // -g spec     : MCCDAQ_TEST only, the simulator's pulse generator, see util_pulse_gen.c
+    // -G filename : MCCDAQ_TEST only, write the generated pulses to filename
+    // -t spec     : enable the flight recorder, see flight_recorder_parse
+    // -D filename : capture the dataq scans, at the scan rate, to filename
+    while (true) {
+#ifndef MCCDAQ_TEST
+        char opt_char = getopt(argc, argv, "hd:a:w:m:f:j:r:zR:St:D:");
+#else
+        char opt_char = getopt(argc, argv, "hd:a:w:m:f:j:r:zR:St:D:g:G:");
+#endif
+        if (opt_char == -1) {
+            break;
+        }
+        switch (opt_char) {
+        case 'h':
+            usage();
+            exit(0);
+        case 'd':
+            if (strcmp(optarg, "simd") == 0) {
+                opt_pulse_detect_mode = PULSE_DETECT_MODE_SIMD;
+            } else if (strcmp(optarg, "scalar") == 0) {
+                opt_pulse_detect_mode = PULSE_DETECT_MODE_SCALAR;
+            } else {
+                ERROR("invalid '-d %s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'a':
+            if (sscanf(optarg, "%d,%d", &opt_drain_cpu, &opt_analysis_cpu) != 2) {
+                ERROR("invalid '-a %s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'w':
+            if (sscanf(optarg, "%d", &opt_max_neutron_waveform) != 1 ||
+                opt_max_neutron_waveform < 0 || 
+                opt_max_neutron_waveform > MAX_NEUTRON_PULSE_WAVEFORM) 
+            {
+                ERROR("invalid '-w %s', range is 0 - %d\n", optarg, MAX_NEUTRON_PULSE_WAVEFORM);
+                exit(1);
+            }
+            break;
+        case 'm':
+            if (strcmp(optarg, "nonparalyzable") == 0) {
+                opt_dead_time_model = PULSE_DEAD_TIME_MODEL_NONPARALYZABLE;
+            } else if (strcmp(optarg, "paralyzable") == 0) {
+                opt_dead_time_model = PULSE_DEAD_TIME_MODEL_PARALYZABLE;
+            } else if (strcmp(optarg, "none") == 0) {
+                opt_dead_time_model = PULSE_DEAD_TIME_MODEL_NONE;
+            } else {
+                ERROR("invalid '-m %s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'f':
+            opt_filter = optarg;
+            break;
+        case 'j':
+            if (sscanf(optarg, "%d", &opt_detect_threads) != 1 || opt_detect_threads < 1) {
+                ERROR("invalid '-j %s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            opt_raw_capture_filename = optarg;
+            break;
+        case 'z':
+            opt_raw_capture_compress = true;
+            break;
+        case 'R':
+            opt_replay_filename = optarg;
+            break;
+        case 'S':
+            opt_replay_realtime = true;
+            break;
+        case 't':
+            opt_flight_spec = optarg;
+            break;
+        case 'D':
+            opt_dataq_capture_filename = optarg;
+            break;
+#ifdef MCCDAQ_TEST
+        case 'g':
+            opt_sim_spec = optarg;
+            break;
+        case 'G':
+            opt_sim_truth_filename = optarg;
+            break;
+#endif
+        default:
+            exit(1);
+        }
+    }
 
     // allow core dump
     rl.rlim_cur = RLIM_INFINITY;
@@ -155,6 +424,17 @@ static void init(void)
               sizeof(data_t), sizeof(struct data_part1_s), sizeof(struct data_part2_s));
     }
 
+    // validate the largest data part2 fits in MAX_DATA_PART2_LENGTH
+#ifdef CAM_ENABLE
+    if (sizeof(struct data_part2_s) + 
+        (MAX_NEUTRON_PULSE_TIME * sizeof(uint32_t) +
+         MAX_NEUTRON_PULSE_WAVEFORM * (1 + MAX_NEUTRON_ADC_PULSE_DATA) * sizeof(int16_t) + 7) +
+        sizeof(jpeg_buff) > MAX_DATA_PART2_LENGTH)
+    {
+        FATAL("MAX_DATA_PART2_LENGTH %d is too small\n", MAX_DATA_PART2_LENGTH);
+    }
+#endif
+
     // register signal handler for SIGINT, and SIGTERM
     bzero(&action, sizeof(action));
     action.sa_handler = signal_handler;
@@ -164,9 +444,13 @@ static void init(void)
     action.sa_handler = signal_handler;
     sigaction(SIGTERM, &action, NULL);
 
+    // validate the flight recorder spec
+    if (opt_flight_spec != NULL && flight_recorder_parse(opt_flight_spec) < 0) {
+        FATAL("invalid flight recorder spec '%s'\n", opt_flight_spec);
+    }
+
 #ifdef CAM_ENABLE
     // init camera
-    pthread_t thread;
     if (cam_init(CAM_WIDTH, CAM_HEIGHT, FRAMES_PER_SEC) == 0) {
         if (pthread_create(&thread, NULL, cam_thread, NULL) != 0) {
             FATAL("pthread_create cam_thread, %s\n", strerror(errno));
@@ -174,16 +458,13 @@ static void init(void)
     }
 #endif
 
-    // init dataq device used to acquire chamber voltage, current and pressure readings
-    dataq_init(0.5,   // averaging duration in secs
-               1200,  // scan rate  (samples per second)
-               1,     // number of adc channels
-               DATAQ_ADC_CHAN_PRESSURE);
-
-    // init mccdaq device, used to acquire 500000 samples per second from the
-    // ludlum 2929 amplifier output
-    mccdaq_init();
-    mccdaq_start(mccdaq_callback);
+    // the devices are brought up concurrently, and init returns without waiting for
+    // them to be ready, so that the server can accept clients right away;
+    // - the owon_b35 meters are started first, their gatttool connections are slow
+    // - the dataq is initialized by dataq_init_thread
+    // - the mccdaq is initialized below, this is quick
+    // - device_monitor_thread reports when each device is ready
+    device_start_us = microsec_timer();
 
     // init owen_b35, used to acquire fusor voltage and current via bluetooth meter
     owon_b35_init(
@@ -193,6 +474,120 @@ static void init(void)
         OWON_B35_FUSOR_CURRENT_METER_ID, OWON_B35_FUSOR_CURRENT_METER_ADDR, 
               OWON_B35_VALUE_TYPE_DC_MILLIAMP, "current"
                         );
+
+    // init dataq device used to acquire chamber voltage, current and pressure readings
+    if (pthread_create(&thread, NULL, dataq_init_thread, NULL) != 0) {
+        FATAL("pthread_create dataq_init_thread, %s\n", strerror(errno));
+    }
+
+#ifdef ENABLE_PULSE_TRACE
+    // init the binary trace of the neutron pulses
+    pulse_trace_init(PULSE_TRACE_FILENAME, PULSE_TRACE_MAX_FILE_SIZE, PULSE_TRACE_MAX_FILES);
+#endif
+
+    // if requested, init the capture of the raw neutron detector samples
+    if (opt_raw_capture_filename != NULL) {
+        if (raw_capture_init(opt_raw_capture_filename, RAW_CAPTURE_MAX_FILE_SIZE, RAW_CAPTURE_MAX_FILES,
+                             opt_raw_capture_compress, mccdaq_sample_time_ns) < 0) 
+        {
+            FATAL("raw_capture_init failed\n");
+        }
+    }
+
+    // init mccdaq device, used to acquire 500000 samples per second from the
+    // ludlum 2929 amplifier output
+    if (filter_init(&neutron_filter, opt_filter) < 0) {
+        FATAL("invalid filter '%s'\n", opt_filter);
+    }
+    INFO("filter %s, delay %d samples\n", neutron_filter.desc, neutron_filter.delay);
+    pulse_detect_init(&neutron_pd, TUNE_PULSE_THRESHOLD, neutron_pulse_callback, NULL);
+    pulse_detect_set_mode(&neutron_pd, opt_pulse_detect_mode);
+    INFO("pulse detector mode %s, simd %s\n",
+         opt_pulse_detect_mode == PULSE_DETECT_MODE_SIMD ? "simd" : "scalar",
+         pulse_detect_simd_name());
+    INFO("dead time model %s\n",
+         opt_dead_time_model == PULSE_DEAD_TIME_MODEL_NONPARALYZABLE ? "nonparalyzable" :
+         opt_dead_time_model == PULSE_DEAD_TIME_MODEL_PARALYZABLE    ? "paralyzable"    :
+                                                                       "none");
+    if (opt_replay_filename != NULL) {
+        if (mccdaq_init_replay(opt_replay_filename, opt_replay_realtime) < 0) {
+            FATAL("mccdaq_init_replay failed\n");
+        }
+    } else {
+#ifdef MCCDAQ_TEST
+        if (opt_sim_spec != NULL && mccdaq_sim_config(opt_sim_spec, opt_sim_truth_filename) < 0) {
+            FATAL("invalid pulse generator spec '%s'\n", opt_sim_spec);
+        }
+#endif
+        if (mccdaq_init() < 0) {
+            device_set_state(DEVICE_MCCDAQ, DEVICE_STATE_FAILED);
+        }
+    }
+
+    // start the mccdaq acquisition, unless mccdaq_init failed; the failure has 
+    // been logged by mccdaq_init and device_set_state
+    if (device[DEVICE_MCCDAQ].state != DEVICE_STATE_FAILED) {
+        if (opt_drain_cpu != -1 || opt_analysis_cpu != -1) {
+            mccdaq_set_cpu_affinity(opt_drain_cpu, opt_analysis_cpu);
+        }
+        replay_start_us = microsec_timer();
+        mccdaq_start(mccdaq_callback);
+    }
+
+    // create thread to print the neutron data, and other values, once per second
+    if (pthread_create(&thread, NULL, neutron_report_thread, NULL) != 0) {
+        FATAL("pthread_create neutron_report_thread, %s\n", strerror(errno));
+    }
+
+    // create the flight recorder thread, and register SIGUSR1 as a manual trigger
+    if (opt_flight_spec != NULL) {
+        if (pthread_create(&thread, NULL, flight_recorder_thread, NULL) != 0) {
+            FATAL("pthread_create flight_recorder_thread, %s\n", strerror(errno));
+        }
+        bzero(&action, sizeof(action));
+        action.sa_handler = sigusr1_handler;
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &action, NULL);
+    }
+
+    // create the thread that monitors the device bring-up
+    if (pthread_create(&thread, NULL, device_monitor_thread, NULL) != 0) {
+        FATAL("pthread_create device_monitor_thread, %s\n", strerror(errno));
+    }
+}
+
+static void usage(void)
+{
+    printf("\n"
+           "usage: get_data [options]\n"
+           "\n"
+           "   where options include:\n"
+           "       -h          : help\n"
+           "       -d mode     : pulse detector mode, simd (default) or scalar\n"
+           "       -a cpu,cpu  : pin the mccdaq drain and analysis threads to cpus, -1 is not pinned\n"
+           "       -w max      : max neutron pulse waveforms stored per second, default %d\n"
+           "       -m model    : dead time model, nonparalyzable (default), paralyzable, or none\n"
+           "       -f filter   : filter applied ahead of the pulse detector, one of\n"
+           "                     none (default), ma,n  trap,k,m  matched,file  crrc,tau[,gain];\n"
+           "                     other than none, the pulse waveforms and trace hold the filter output\n"
+           "       -j threads  : max threads used by the pulse detector when catching up, default 1\n"
+           "       -r filename : capture the raw neutron detector samples to filename\n"
+           "       -z          : compress the raw capture\n"
+           "       -R filename : replay a raw capture file, instead of acquiring from the mccdaq device\n"
+           "       -S          : replay at the sample rate, default is as fast as possible\n"
+           "       -t spec     : enable the flight recorder, comma separated list of\n"
+           "                     rate=factor  current=ma  pressure=mtorr  pre=secs  post=secs\n"
+           "                     dir=path  compress=0|1,  or default\n"
+           "       -D filename : capture the dataq scans, at the scan rate, to filename\n"
+#ifdef MCCDAQ_TEST
+           "       -g spec     : simulator pulse generator, comma separated list of\n"
+           "                     rate=n  height=gauss:mean:sigma  shape=rise:fall  noise=mv\n"
+           "                     drift=mv:secs  ripple=mv:hz  sat=fraction  speed=n  seed=n\n"
+           "       -G filename : write the simulator's generated pulses to filename\n"
+#endif
+           "\n",
+           DEFAULT_MAX_NEUTRON_WAVEFORM
+                    );
 }
 
 static void server(void)
@@ -319,26 +714,45 @@ static void * server_thread(void * cx)
     time_t    time_now, time_last;
     ssize_t   len;
     data_t  * data;
+    struct timespec ts, deadline;
 
     ATOMIC_INCREMENT(&active_thread_count);
 
     INFO("accepted connection, sockfd=%d\n", sockfd);
 
     time_last = time(NULL);
-    data = malloc(sizeof(data_t) + 1000000);
+    data = malloc(sizeof(struct data_part1_s) + MAX_DATA_PART2_LENGTH);
+    if (data == NULL) {
+        FATAL("malloc\n");
+    }
 
     while (true) {
-        // wait for time_now to change (should be an increase by 1 second from time_last)
+        // wait for the next second (should be an increase by 1 second from time_last);
+        // this is when the analysis stage publishes the neutron data for the second, 
+        // or if the neutron data is late then SERVER_NEUTRON_WAIT_MS after the second
+        // begins on the realtime clock
+        deadline.tv_sec  = time_last + 1;
+        deadline.tv_nsec = SERVER_NEUTRON_WAIT_MS * 1000000L;
+        pthread_mutex_lock(&neutron_mutex);
         while (true) {
-            time_now = time(NULL);
-            if (time_now != time_last) {
-                break;
-            }
-            usleep(1000);  // 1 ms
             if (sigint_or_sigterm) {
+                pthread_mutex_unlock(&neutron_mutex);
                 goto exit_thread;
             }
+            if (neutron_time > time_last) {
+                time_now = neutron_time;
+                break;
+            }
+            clock_gettime(CLOCK_REALTIME, &ts);
+            if (ts.tv_sec > deadline.tv_sec || 
+                (ts.tv_sec == deadline.tv_sec && ts.tv_nsec >= deadline.tv_nsec)) 
+            {
+                time_now = ts.tv_sec;
+                break;
+            }
+            pthread_cond_timedwait(&neutron_cond, &neutron_mutex, &deadline);
         }
+        pthread_mutex_unlock(&neutron_mutex);
 
         // sanity check time_now, should be time_last+1
         if (time_now < time_last) {
@@ -353,8 +767,8 @@ static void * server_thread(void * cx)
         init_data_struct(data, time_now);
 
         // send data struct
-        len = do_send(sockfd, data, sizeof(data_t)+data->part1.data_part2_jpeg_buff_len);
-        if (len != sizeof(data_t)+data->part1.data_part2_jpeg_buff_len) {
+        len = do_send(sockfd, data, sizeof(struct data_part1_s)+data->part1.data_part2_length);
+        if (len != sizeof(struct data_part1_s)+data->part1.data_part2_length) {
             if (len == -1 && (errno == ECONNRESET || errno == EPIPE)) {
                 INFO("terminating connection\n");
             } else {
@@ -363,6 +777,24 @@ static void * server_thread(void * cx)
             break;
         }
 
+        // process the commands sent by the display program
+        while (true) {
+            struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+            cmd_t cmd;
+            if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN)) {
+                break;
+            }
+            if (do_recv(sockfd, &cmd, sizeof(cmd)) != sizeof(cmd) || cmd.magic != MAGIC_CMD) {
+                break;
+            }
+            if (cmd.cmd == CMD_FLIGHT_RECORDER_TRIGGER) {
+                INFO("flight recorder trigger requested by display\n");
+                flight_manual_req = true;
+            } else {
+                WARN("unknown command %d\n", cmd.cmd);
+            }
+        }
+
         // save time_last
         time_last = time_now;
     }
@@ -380,7 +812,7 @@ exit_thread:
 static void init_data_struct(data_t * data, time_t time_now)
 {
     int16_t mean_mv;
-    int32_t ret, wait_ms;
+    int32_t ret;
     static bool unavail_warn_printed = false;
 
     // zero data struct;  
@@ -393,9 +825,10 @@ static void init_data_struct(data_t * data, time_t time_now)
     data->part2.magic = MAGIC_DATA_PART2;
 
     // data part1 voltage_kv, and
-    // data part1 current_ma
-    data->part1.voltage_kv = get_fusor_voltage_kv();
-    data->part1.current_ma = get_fusor_current_ma();
+    // data part1 current_ma;
+    // each device's values are NO_VALUE until the device is ready
+    data->part1.voltage_kv = (device_ready(DEVICE_VOLTAGE_METER) ? get_fusor_voltage_kv() : ERROR_NO_VALUE);
+    data->part1.current_ma = (device_ready(DEVICE_CURRENT_METER) ? get_fusor_current_ma() : ERROR_NO_VALUE);
 
     // if we don't have either of the fusor voltage or current then 
     // print a warning
@@ -422,7 +855,9 @@ static void init_data_struct(data_t * data, time_t time_now)
     }
 
     // data part1 d2_pressure_mtorr and n2_pressure_mtorr
-    ret = dataq_get_adc(DATAQ_ADC_CHAN_PRESSURE, NULL, &mean_mv, NULL, NULL, NULL);
+    ret = (device_ready(DEVICE_DATAQ) 
+           ? dataq_get_adc(DATAQ_ADC_CHAN_PRESSURE, NULL, &mean_mv, NULL, NULL, NULL) 
+           : -1);
     if (ret == 0) {
         data->part1.d2_pressure_mtorr = convert_adc_pressure(mean_mv/1000., GAS_ID_D2);
         data->part1.n2_pressure_mtorr = convert_adc_pressure(mean_mv/1000., GAS_ID_N2);
@@ -432,37 +867,76 @@ static void init_data_struct(data_t * data, time_t time_now)
     }
 
     // data part2: voltage, current, and pressure adc_data
-    data->part1.data_part2_voltage_adc_data_valid  = false;
-    data->part1.data_part2_current_adc_data_valid  = false;
-    ret = dataq_get_adc_data(DATAQ_ADC_CHAN_PRESSURE, 
-                             data->part2.pressure_adc_data,
-                             MAX_ADC_DATA);
-    data->part1.data_part2_pressure_adc_data_valid = (ret == 0);
-
-    // wait for up to 250 ms for neutron data to be available for time_now;  
-    // if neutron data avail then copy it into data part1 and part2
-    for (wait_ms = 0; neutron_time != time_now && wait_ms < 250; wait_ms++) {
-        usleep(1000);
+    if (device_ready(DEVICE_DATAQ)) {
+        ret = dataq_get_adc_data(DATAQ_ADC_CHAN_VOLTAGE, 
+                                 data->part2.voltage_adc_data,
+                                 MAX_ADC_DATA);
+        data->part1.data_part2_voltage_adc_data_valid  = (ret == 0);
+        ret = dataq_get_adc_data(DATAQ_ADC_CHAN_CURRENT, 
+                                 data->part2.current_adc_data,
+                                 MAX_ADC_DATA);
+        data->part1.data_part2_current_adc_data_valid  = (ret == 0);
+        ret = dataq_get_adc_data(DATAQ_ADC_CHAN_PRESSURE, 
+                                 data->part2.pressure_adc_data,
+                                 MAX_ADC_DATA);
+        data->part1.data_part2_pressure_adc_data_valid = (ret == 0);
     }
+
+    // if the mccdaq is ready and neutron data avail for time_now then copy it into 
+    // data part1, and the data part2 neutron pulse section, which is sized to the 
+    // number of pulses stored; server_thread has waited for the neutron data to be 
+    // published; otherwise the neutron values are NO_VALUE, so that they are not 
+    // mistaken for a count of 0
     pthread_mutex_lock(&neutron_mutex);
-    if (neutron_time == time_now) {
-        memcpy(data->part1.neutron_pulse_mv, 
-               neutron_pulse_mv, 
-               max_neutron_pulse*sizeof(neutron_pulse_mv[0]));
-        memcpy(data->part2.neutron_adc_pulse_data, 
-               neutron_adc_pulse_data, 
-               max_neutron_pulse*sizeof(neutron_adc_pulse_data[0]));
-        data->part1.max_neutron_pulse = max_neutron_pulse;
+    if (device_ready(DEVICE_MCCDAQ) && neutron_time == time_now) {
+        data->part1.neutron_pulse_count = neutron_pub->neutron_pulse_count;
+        data->part1.neutron_pulse_count_corrected = neutron_pub->neutron_pulse_count_corrected;
+        data->part1.neutron_pileup_count = neutron_pub->neutron_pileup_count;
+        data->part1.neutron_live_time_us = neutron_pub->neutron_live_time_us;
+        data->part1.neutron_samples_expected = neutron_pub->samples + neutron_pub->lost_samples;
+        data->part1.neutron_samples_received = neutron_pub->samples - neutron_pub->samples_discarded;
+        data->part1.neutron_samples_discarded = neutron_pub->samples_discarded;
+        data->part1.neutron_restart_gap_us = 
+            (data->part1.neutron_samples_expected > 0
+             ? (int64_t)neutron_pub->lost_samples * 1000000 / data->part1.neutron_samples_expected
+             : 0);
+        data->part1.neutron_baseline_mv = (neutron_pub->baseline - 2048) * 10000. / 2048;
+        data->part1.neutron_baseline_rms_mv = neutron_pub->baseline_rms * 10000. / 2048;
+        memcpy(data->part1.neutron_pulse_hist,
+               neutron_pub->neutron_pulse_hist,
+               sizeof(data->part1.neutron_pulse_hist));
+        data->part1.max_neutron_pulse = neutron_pub->max_neutron_pulse;
+        data->part1.max_neutron_pulse_time = neutron_pub->max_neutron_pulse_time;
+        memcpy(DATA_PART2_NEUTRON_PULSE_TIME_NS(&data->part1, &data->part2),
+               neutron_pub->neutron_pulse_time_ns, 
+               neutron_pub->max_neutron_pulse_time*sizeof(neutron_pub->neutron_pulse_time_ns[0]));
+        memcpy(DATA_PART2_NEUTRON_PULSE_MV(&data->part1, &data->part2),
+               neutron_pub->neutron_pulse_mv, 
+               neutron_pub->max_neutron_pulse*sizeof(neutron_pub->neutron_pulse_mv[0]));
+        memcpy(DATA_PART2_NEUTRON_ADC_PULSE_DATA(&data->part1, &data->part2),
+               neutron_pub->neutron_adc_pulse_data, 
+               neutron_pub->max_neutron_pulse*sizeof(neutron_pub->neutron_adc_pulse_data[0]));
     } else {
+        data->part1.neutron_pulse_count = ERROR_NO_VALUE;
+        data->part1.neutron_pulse_count_corrected = ERROR_NO_VALUE;
+        data->part1.neutron_pileup_count = ERROR_NO_VALUE;
+        data->part1.neutron_live_time_us = ERROR_NO_VALUE;
+        data->part1.neutron_samples_expected = ERROR_NO_VALUE;
+        data->part1.neutron_samples_received = ERROR_NO_VALUE;
+        data->part1.neutron_samples_discarded = ERROR_NO_VALUE;
+        data->part1.neutron_restart_gap_us = ERROR_NO_VALUE;
+        data->part1.neutron_baseline_mv = ERROR_NO_VALUE;
+        data->part1.neutron_baseline_rms_mv = ERROR_NO_VALUE;
         data->part1.max_neutron_pulse = 0;
+        data->part1.max_neutron_pulse_time = 0;
     }
     pthread_mutex_unlock(&neutron_mutex);
 
 #ifdef CAM_ENABLE
-    // data part2: jpeg_buff
+    // data part2: jpeg_buff, following the neutron pulse section
     pthread_mutex_lock(&jpeg_mutex);
     if (microsec_timer() - jpeg_buff_us < 1000000) {
-        memcpy(data->part2.jpeg_buff, jpeg_buff, jpeg_buff_len);
+        memcpy(DATA_PART2_JPEG_BUFF(&data->part1, &data->part2), jpeg_buff, jpeg_buff_len);
         data->part1.data_part2_jpeg_buff_len = jpeg_buff_len;
     }
     pthread_mutex_unlock(&jpeg_mutex);
@@ -472,7 +946,93 @@ static void init_data_struct(data_t * data, time_t time_now)
 
     // data part1: data_part_offset, and data_part2_length
     data->part1.data_part2_offset  = 0;   // for use by the display pgm
-    data->part1.data_part2_length  = sizeof(struct data_part2_s) + data->part1.data_part2_jpeg_buff_len;
+    data->part1.data_part2_length  = DATA_PART2_LENGTH(&data->part1);
+}
+
+// -----------------  DEVICE BRING-UP  -----------------------------------------------
+
+// the dataq is initialized in this thread because dataq_init issues a series of
+// commands to the dataq, and waits for each response
+static void * dataq_init_thread(void * cx)
+{
+    // the dataq scans at its max rate, and each channel is decimated to MAX_ADC_DATA 
+    // values per second, for data part2
+    static dataq_chan_t dataq_chan[] = {
+        { DATAQ_ADC_CHAN_VOLTAGE,  MAX_ADC_DATA },
+        { DATAQ_ADC_CHAN_CURRENT,  MAX_ADC_DATA },
+        { DATAQ_ADC_CHAN_PRESSURE, MAX_ADC_DATA }, };
+    int32_t ret;
+
+    ret = dataq_init(0.5,   // averaging duration in secs
+                     sizeof(dataq_chan)/sizeof(dataq_chan[0]),
+                     dataq_chan);
+    if (ret < 0) {
+        device_set_state(DEVICE_DATAQ, DEVICE_STATE_FAILED);
+    }
+
+    // if requested, capture the dataq scans at the scan rate
+    if (opt_dataq_capture_filename != NULL) {
+        if (ret < 0 || dataq_capture_init(opt_dataq_capture_filename) < 0) {
+            FATAL("dataq capture failed\n");
+        }
+    }
+
+    return NULL;
+}
+
+// a device is ready when its values are first available; this thread terminates 
+// when all of the devices are either ready or have failed
+static void * device_monitor_thread(void * cx)
+{
+    int16_t mean_mv;
+    int32_t id, starting;
+
+    ATOMIC_INCREMENT(&active_thread_count);
+
+    while (!sigint_or_sigterm) {
+        if (dataq_get_adc(DATAQ_ADC_CHAN_PRESSURE, NULL, &mean_mv, NULL, NULL, NULL) == 0) {
+            device_set_state(DEVICE_DATAQ, DEVICE_STATE_READY);
+        }
+        if (__atomic_load_n(&neutron_time, __ATOMIC_RELAXED) != 0) {
+            device_set_state(DEVICE_MCCDAQ, DEVICE_STATE_READY);
+        }
+        if (get_fusor_voltage_kv() != ERROR_NO_VALUE) {
+            device_set_state(DEVICE_VOLTAGE_METER, DEVICE_STATE_READY);
+        }
+        if (get_fusor_current_ma() != ERROR_NO_VALUE) {
+            device_set_state(DEVICE_CURRENT_METER, DEVICE_STATE_READY);
+        }
+
+        for (starting = 0, id = 0; id < MAX_DEVICE; id++) {
+            if (device[id].state == DEVICE_STATE_STARTING) {
+                starting++;
+            }
+        }
+        if (starting == 0) {
+            break;
+        }
+        usleep(100000);
+    }
+
+    ATOMIC_DECREMENT(&active_thread_count);
+    return NULL;
+}
+
+// returns true if the device is ready; the data records contain the device's values
+// only when it is ready
+static bool device_ready(int32_t id)
+{
+    return __atomic_load_n(&device[id].state, __ATOMIC_ACQUIRE) == DEVICE_STATE_READY;
+}
+
+// sets the state of a device that is starting; the READY and FAILED states are final
+static void device_set_state(int32_t id, int32_t state)
+{
+    if (!__sync_bool_compare_and_swap(&device[id].state, DEVICE_STATE_STARTING, state)) {
+        return;
+    }
+    INFO("device %s is %s, %"PRId64" ms after start\n",
+         device[id].name, DEVICE_STATE_STR(state), (microsec_timer() - device_start_us) / 1000);
 }
 
 // -----------------  GET FUSOR VOLTAGE AND CURRENT  ---------------------------------
@@ -616,211 +1176,83 @@ static float convert_adc_pressure(float adc_volts, int32_t gas_id)
     }
 }    
 
-// -----------------  MCCDAQ CALLBACK - NEUTRON DETECTOR PULSES  ---------------------
-
-static int32_t mccdaq_callback(uint16_t * d, int32_t max_d)
-{
-    #define MAX_DATA 1000000
-
-    #define MAX_PC1SH 15000
-    static int16_t  data[MAX_DATA];
-    static int32_t  max_data;
-    static int32_t  idx;
-    static int32_t  baseline;
-    static int16_t  local_neutron_adc_pulse_data[MAX_NEUTRON_PULSE][MAX_NEUTRON_ADC_PULSE_DATA];
-    static int16_t  local_neutron_pulse_mv[MAX_NEUTRON_PULSE];
-    static int32_t  local_max_neutron_pulse;
-
-    #define TUNE_PULSE_THRESHOLD  10
-
-    #define RESET_FOR_NEXT_SEC \
-        do { \
-            max_data = 0; \
-            idx = 0; \
-            local_max_neutron_pulse = 0; \
-        } while (0)
-
-    // if max_data too big then 
-    //   print an error 
-    //   reset 
-    // endif
-    if (max_data + max_d > MAX_DATA) {
-        ERROR("max_data %d or max_d %d are too large\n", max_data, max_d);
-        RESET_FOR_NEXT_SEC;
-        return 0;
-    }
-
-    // copy caller supplied data to static data buffer
-    memcpy(data+max_data, d, max_d*sizeof(int16_t));
-    max_data += max_d;
-
-    // if we have too little data just return, 
-    // until additional data is received
-    if (max_data < 100) {
-        return 0;
-    }
+// -----------------  NEUTRON REPORT THREAD  ----------------------------------------
 
-    // search for pulses in the data
-    int32_t pulse_start_idx = -1;
-    int32_t pulse_end_idx   = -1;
-    while (true) {
-        // terminate this loop when 
-        // - not in-a-pulse and near the end of data OR
-        // - at the end of data
-        if ((pulse_start_idx == -1 && idx >= max_data-20) || 
-            (idx == max_data))
-        {
-            break;
-        }
+// The mccdaq analysis stage (mccdaq_callback) only runs the pulse detector and 
+// publishes each second of neutron data. This thread does the once per second
+// meter queries, pressure conversion, and printing, so that these do not
+// delay the analysis stage.
 
-        // print warning if data out of range
-        if (data[idx] > 4095) {
-            WARN("data[%d] = %u, is out of range\n", idx, data[idx]);
-            data[idx] = 2048;
-        }
-
-        // update baseline ...
-        // if data[idx] is close to baseline then
-        //   baseline is okay
-        // else if data[idx+10] is close to baseline then
-        //   baseline is okay
-        // else if data[idx] and the preceding 3 data values are almost the same then
-        //   set baseline to data[idx]
-        // endif
-        if (pulse_start_idx == -1) {
-            if (data[idx] >= baseline-1 && data[idx] <= baseline+1) {
-                ;  // okay
-            } else if (idx+10 < max_data && data[idx+10] >= baseline-1 && data[idx+10] <= baseline+1) {
-                ;  // okay
-            } else if ((idx >= 3) &&
-                       (data[idx-1] >= data[idx]-1 && data[idx-1] <= data[idx]+1) &&
-                       (data[idx-2] >= data[idx]-1 && data[idx-2] <= data[idx]+1) &&
-                       (data[idx-3] >= data[idx]-1 && data[idx-3] <= data[idx]+1))
-            {
-                baseline = data[idx];
-            }
-        }
-
-        // if baseline has not yet determined then continue
-        if (baseline == 0) {
-            idx++;
-            continue;
-        }
-
-        // determine the pulse_start_idx and pulse_end_idx
-        if (data[idx] >= (baseline + TUNE_PULSE_THRESHOLD) && pulse_start_idx == -1) {
-            pulse_start_idx = idx;
-        } else if (pulse_start_idx != -1) {
-            if (data[idx] < (baseline + TUNE_PULSE_THRESHOLD)) {
-                pulse_end_idx = idx - 1;
-            } else if (idx - pulse_start_idx >= 10) {
-                WARN("discarding a possible pulse because it's too long, pulse_start_idx=%d\n",
-                     pulse_start_idx);
-                pulse_start_idx = -1;
-                pulse_end_idx = -1;
-            }
-        }
-
-        // if a pulse has been located ...
-        // - determine the pulse_height, in mv
-        // - save the pulse height in local_neutron_pulse_mv[]
-        // - save pulse data in local_neutron_adc_pulse_data
-        // - print the pulse to the log file
-        // endif
-        if (pulse_end_idx != -1) {
-            int32_t pulse_height, i, k;
-            int32_t pulse_start_idx_extended, pulse_end_idx_extended;
-
-            // scan from start to end of pulse to determine pulse_height,
-            // where pulse_height is the height above the baseline
-            pulse_height = -1;
-            for (i = pulse_start_idx; i <= pulse_end_idx; i++) {
-                if (data[i] - baseline > pulse_height) {
-                    pulse_height = data[i] - baseline;
-                }
-            }
-            pulse_height = pulse_height * 10000 / 2048;  // convert to mv
-
-            // XXX consider adding code here to skip this pule if its height is below a limit
-
-            // if there is room to store another neutron pulse then
-            // - store the pulse height
-            // - store the pulse data
-            // endif
-            if (local_max_neutron_pulse < MAX_NEUTRON_PULSE) {
-                // store pulse height
-                local_neutron_pulse_mv[local_max_neutron_pulse] = pulse_height;
-
-                // store pulse data
-                pulse_start_idx_extended = pulse_start_idx - (MAX_NEUTRON_ADC_PULSE_DATA/2);
-                if (pulse_start_idx_extended < 0) {
-                    pulse_start_idx_extended = 0;
-                }
-                pulse_end_idx_extended = pulse_start_idx_extended + (MAX_NEUTRON_ADC_PULSE_DATA-1);
-                if (pulse_end_idx_extended >= max_data) {
-                    pulse_end_idx_extended = max_data - 1;
-                    pulse_start_idx_extended = pulse_end_idx_extended - (MAX_NEUTRON_ADC_PULSE_DATA-1);
-                }
-                for (k = 0, i = pulse_start_idx_extended; i <= pulse_end_idx_extended; i++) {
-                    local_neutron_adc_pulse_data[local_max_neutron_pulse][k++] =
-                        (data[i] - baseline) * 10000 / 2048;    // mv above baseline
-                }
-
-                // increment local_max_neutron_pulse
-                local_max_neutron_pulse++;
-            }
+static void * neutron_report_thread(void * cx)
+{
+    uint64_t        time_last = 0;
+    uint64_t        skipped_count_last = 0;
+    uint64_t        too_long_count_last = 0;
+    uint64_t        out_of_range_count_last = 0;
+    struct timespec ts;
+#ifdef DEBUG_PRINT_INFO
+    mccdaq_stats_t  stats, stats_last;
+    raw_capture_stats_t raw_stats, raw_stats_last;
+    dataq_stats_t   dataq_stats, dataq_stats_last;
 
-#ifdef DEBUG_PRINT_PULSE_GRAPH
-            // plot the pulse 
-            pulse_start_idx_extended = pulse_start_idx - 1;
-            pulse_end_idx_extended = pulse_end_idx + 4;
-            if (pulse_start_idx_extended < 0) {
-                pulse_start_idx_extended = 0;
-            }
-            if (pulse_end_idx_extended >= max_data) {
-                pulse_end_idx_extended = max_data-1;
-            }
-            printf("PULSE:  height_mv = %d   baseline_mv = %d   (%d,%d,%d)\n",
-                   pulse_height, (baseline-2048)*10000/2048,
-                   pulse_start_idx_extended, pulse_end_idx_extended, max_data);
-            for (i = pulse_start_idx_extended; i <= pulse_end_idx_extended; i++) {
-                print_plot_str((data[i]-2048)*10000/2048, (baseline-2048)*10000/2048); 
-            }
-            printf("\n");
+    bzero(&stats_last, sizeof(stats_last));
+    bzero(&raw_stats_last, sizeof(raw_stats_last));
+    bzero(&dataq_stats_last, sizeof(dataq_stats_last));
 #endif
 
-            // done with this pulse
-            pulse_start_idx = -1;
-            pulse_end_idx = -1;
-        }
-
-        // move to next data 
-        idx++;
-    }
+    ATOMIC_INCREMENT(&active_thread_count);
 
-    // if time has incremented then
-    //   - publish new neutron data
-    //   - print to log file
-    //   - reset variables for the next second 
-    // endif
-    uint64_t time_now = time(NULL);
-    if (time_now > neutron_time) {    
+    while (true) {
         char voltage_str[100], current_str[100], d2_pressure_str[100], n2_pressure_str[100];
         float current_ma, voltage_kv;
         int16_t mean_mv;
+        int32_t neutron_pulse_count, neutron_pulse_count_corrected, pileup_count, live_time_us;
+        int32_t samples, lost_samples, samples_discarded, baseline;
+        float baseline_rms;
+        uint64_t skipped_count, too_long_count, out_of_range_count;
 
-        // publish new neutron data
+        // wait for the analysis stage to publish the next second of neutron data,
+        // and copy the summary values
         pthread_mutex_lock(&neutron_mutex);
-        neutron_time = time_now;
-        memcpy(neutron_pulse_mv, 
-               local_neutron_pulse_mv, 
-               local_max_neutron_pulse*sizeof(neutron_pulse_mv[0]));
-        memcpy(neutron_adc_pulse_data, 
-               local_neutron_adc_pulse_data, 
-               local_max_neutron_pulse*sizeof(neutron_adc_pulse_data[0]));
-        max_neutron_pulse = local_max_neutron_pulse;
+        while (neutron_time == time_last && !sigint_or_sigterm && !replay_done()) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&neutron_cond, &neutron_mutex, &ts);
+        }
+        time_last          = neutron_time;
+        neutron_pulse_count = neutron_pub->neutron_pulse_count;
+        neutron_pulse_count_corrected = neutron_pub->neutron_pulse_count_corrected;
+        pileup_count       = neutron_pub->neutron_pileup_count;
+        live_time_us       = neutron_pub->neutron_live_time_us;
+        samples            = neutron_pub->samples;
+        lost_samples       = neutron_pub->lost_samples;
+        samples_discarded  = neutron_pub->samples_discarded;
+        baseline           = neutron_pub->baseline;
+        baseline_rms       = neutron_pub->baseline_rms;
+        skipped_count      = neutron_pub->skipped_count;
+        too_long_count     = neutron_pub->too_long_count;
+        out_of_range_count = neutron_pub->out_of_range_count;
         pthread_mutex_unlock(&neutron_mutex);
 
+        // if sigint_or_sigterm then exit thread
+        if (sigint_or_sigterm) {
+            break;
+        }
+
+        // if the replay of a raw capture file is done then print the replay 
+        // throughput, and terminate get_data
+        if (replay_done()) {
+            mccdaq_stats_t replay_stats;
+            double secs = (replay_end_us - replay_start_us) / 1000000.;
+            mccdaq_get_stats(&replay_stats);
+            printf("REPLAY:   samples=%"PRId64"   secs=%0.3f   msamples_per_sec=%0.2f   analysis_ns_per_sample=%0.2f   discarded=%"PRId64"\n",
+                   replay_stats.consumed, secs, replay_stats.consumed / secs / 1e6,
+                   replay_stats.consumed > 0 ? replay_stats.analysis_us * 1000. / replay_stats.consumed : 0,
+                   replay_stats.discarded);
+            pthread_kill(main_thread, SIGTERM);
+            break;
+        }
+
         // get voltage, current, and pressure values so they can be printed below
         voltage_kv = get_fusor_voltage_kv();
         if (voltage_kv != ERROR_NO_VALUE) {
@@ -859,67 +1291,586 @@ static int32_t mccdaq_callback(uint16_t * d, int32_t max_d)
 #ifdef DEBUG_PRINT_INFO
         // print info, and seperator line,
         // note that the seperator line is intended to mark the begining of the next second
-        printf("NEUTRON:  samples=%d   mccdaq_restarts=%d   baseline_mv=%d\n",
-               max_data, mccdaq_get_restart_count(), (baseline-2048)*10000/2048);
-        printf("SUMMARY:  neutron_pulse = %d /sec   voltage = %s   current = %s   d2_pressure = %s   n2_pressure = %s\n",
-               local_max_neutron_pulse, voltage_str, current_str, d2_pressure_str, n2_pressure_str);
+        mccdaq_get_stats(&stats);
+        printf("NEUTRON:  expected=%d   received=%d   lost=%d   discarded=%d   skipped=%"PRId64"   mccdaq_restarts=%d   baseline_mv=%d   noise_mv=%0.1f   pileups=%d   live_ms=%d\n",
+               samples+lost_samples, samples-samples_discarded, lost_samples, samples_discarded,
+               skipped_count - skipped_count_last,
+               mccdaq_get_restart_count(), (baseline-2048)*10000/2048, baseline_rms*10000/2048,
+               pileup_count, live_time_us/1000);
+        printf("DRAIN:    xfer_inflight=%d   busy_us=%"PRId64"\n",
+               stats.xfer_inflight, stats.drain_us - stats_last.drain_us);
+        printf("ANALYSIS: fill=%"PRId64"   fill_high_water=%"PRId64"   busy_us=%"PRId64"   max_us=%"PRId64"   calls=%"PRId64"\n",
+               stats.fill, stats.fill_high_water, 
+               stats.analysis_us - stats_last.analysis_us, stats.analysis_max_us,
+               stats.analysis_count - stats_last.analysis_count);
+        printf("MCCDAQ:   wakeups=%"PRId64"   discarded=%"PRId64"   lost=%"PRId64"   clock_drift_us=%"PRId64"   clock_corrections=%d\n",
+               stats.wakeup_count, stats.discarded, stats.lost_samples,
+               stats.clock_drift_ns / 1000, stats.clock_correction_count);
+#ifdef ENABLE_PULSE_TRACE
+        pulse_trace_stats_t trace_stats;
+        pulse_trace_get_stats(&trace_stats);
+        printf("TRACE:    added=%"PRId64"   written=%"PRId64"   dropped=%"PRId64"   write_errors=%"PRId64"   rotations=%d\n",
+               trace_stats.added, trace_stats.written, trace_stats.dropped, 
+               trace_stats.write_errors, trace_stats.rotations);
+#endif
+        if (opt_raw_capture_filename != NULL) {
+            raw_capture_get_stats(&raw_stats);
+            printf("RAW:      written_kb=%"PRId64"   ratio=%0.2f   ring=%d/%d   ring_high_water=%d   dropped=%"PRId64"   write_errors=%"PRId64"   rotations=%d\n",
+                   (raw_stats.bytes_written - raw_stats_last.bytes_written) / 1024,
+                   raw_stats.bytes_written > 0 ? (double)raw_stats.bytes_raw / raw_stats.bytes_written : 0,
+                   raw_stats.ring_blocks, raw_stats.ring_max, raw_stats.ring_high_water,
+                   raw_stats.samples_dropped, raw_stats.write_errors, raw_stats.rotations);
+            raw_stats_last = raw_stats;
+        }
+        if (dataq_get_stats(&dataq_stats) == 0) {
+            printf("DATAQ:    scans=%"PRId64"   reads=%"PRId64"   resyncs=%"PRId64"   resync_bytes_skipped=%"PRId64"   captured=%"PRId64"\n",
+                   dataq_stats.scan_count - dataq_stats_last.scan_count,
+                   dataq_stats.read_count - dataq_stats_last.read_count,
+                   dataq_stats.resync_count, dataq_stats.resync_bytes_skipped,
+                   dataq_stats.capture_scans);
+            dataq_stats_last = dataq_stats;
+        }
+        if (opt_flight_spec != NULL) {
+            printf("FLIGHT:   triggers=%d   snapshots=%d   suppressed=%d   errors=%d\n",
+                   flight_stats.triggers, flight_stats.snapshots, 
+                   flight_stats.suppressed, flight_stats.errors);
+        }
+#ifdef MCCDAQ_TEST
+        // totals since start, the generated pulses lead the detected pulses by the ring fill
+        pulse_gen_t * gen = mccdaq_sim_get_pulse_gen();
+        if (gen != NULL) {
+            printf("SIMGEN:   generated=%"PRId64"   pileups=%"PRId64"   saturated=%"PRId64"   detected=%"PRId64"   detected_pileups=%"PRId64"   out_of_range=%"PRId64"\n",
+                   gen->pulse_count, gen->pileup_count, gen->saturated_count,
+                   neutron_pd.pulse_count, neutron_pd.pileup_count, neutron_pd.out_of_range_count);
+        }
+#endif
+        printf("SUMMARY:  neutron_pulse = %d /sec (corrected %d)   voltage = %s   current = %s   d2_pressure = %s   n2_pressure = %s\n",
+               neutron_pulse_count, neutron_pulse_count_corrected, voltage_str, current_str, d2_pressure_str, n2_pressure_str);
         printf("\n");
         INFO("=========================================================================\n");
         printf("\n");
 #endif
 
-        // reset for the next second
-        RESET_FOR_NEXT_SEC;
+        // print warning if the detector discarded data
+        if (too_long_count != too_long_count_last ||
+            out_of_range_count != out_of_range_count_last)
+        {
+            WARN("discarded %"PRId64" possible pulses because too long, %"PRId64" samples out of range\n",
+                 too_long_count - too_long_count_last,
+                 out_of_range_count - out_of_range_count_last);
+            too_long_count_last = too_long_count;
+            out_of_range_count_last = out_of_range_count;
+        }
+        skipped_count_last = skipped_count;
+#ifdef DEBUG_PRINT_INFO
+        stats_last = stats;
+#endif
     }
 
-    // return 'continue-scanning' 
-    return 0;
+    ATOMIC_DECREMENT(&active_thread_count);
+    return NULL;
 }
 
-#ifdef DEBUG_PRINT_PULSE_GRAPH
-static void print_plot_str(int32_t value, int32_t baseline)
+// returns true when replaying a raw capture file, and all of its samples have been processed
+static bool replay_done(void)
 {
-    char    str[110];
-    int32_t idx, i;
+    mccdaq_stats_t stats;
 
-    // args are in mv units
+    if (opt_replay_filename == NULL) {
+        return false;
+    }
+    mccdaq_get_stats(&stats);
+    return stats.replay_done && stats.fill == 0;
+}
 
-    // value               : expected range 0 - 9995 mv
-    // baseline            : expected range 0 - 9995 mv
-    // idx = value / 100   : range  0 - 99            
+// -----------------  MCCDAQ CALLBACK - NEUTRON DETECTOR PULSES  ---------------------
 
-    if (value > 9995) {
-        printf("%5d: value is out of range\n", value);
-        return;
+// Each detected pulse is timestamped from its sample index, using the mccdaq
+// sample clock. A second of neutron data is the range of samples whose sample
+// clock time is in that second, which is FREQUENCY samples unless the mccdaq 
+// scan was restarted, or the sample clock was corrected for drift, during the
+// second. The pulses are attributed to the second in which they start; a second
+// of neutron data is published once the pulse detector has reported all of the
+// pulses that start in that second.
+
+static int32_t mccdaq_callback(uint16_t * d, int32_t max_d, uint64_t sample_idx)
+{
+    int64_t settled_idx;
+    int32_t i, len;
+
+    // if mccdaq discarded samples then the filter is reset, and the pulse detector
+    // is resynced to the index of the first sample being passed in
+    if (sample_idx != neutron_pd.sample_count) {
+        discard_range_add(neutron_pd.sample_count, sample_idx);
+        filter_reset(&neutron_filter);
+        pulse_detect_resync(&neutron_pd, sample_idx);
+    }
+
+    // copy the samples to the raw capture, if enabled
+    raw_capture_add(d, max_d, sample_idx);
+
+    // on the first call, init the second being accumulated
+    if (neutron_acc->time == 0) {
+        neutron_acc->time = mccdaq_sample_time_ns(sample_idx) / 1000000000 + 1;
+        neutron_acc_start_idx = sample_idx;
+    }
+
+    // run the pulse detector on the caller supplied data, or if a filter is
+    // configured then on the filtered data; the filter and detector state
+    // carries across calls, and detected pulses are passed to neutron_pulse_callback;
+    // note that with a filter the pulses' waveforms are the filter output, so the
+    // waveforms stored in data part2 and the pulse trace are filtered samples;
+    // when the analysis stage has fallen behind, the data can be large enough
+    // for the pulse detector to use multiple threads
+    if (neutron_filter.type == FILTER_TYPE_NONE) {
+        pulse_detect_process_parallel(&neutron_pd, d, max_d, opt_detect_threads);
+    } else {
+        for (i = 0; i < max_d; i += len) {
+            len = (max_d - i < MAX_FILTER_BUFF ? max_d - i : MAX_FILTER_BUFF);
+            filter_process(&neutron_filter, d+i, neutron_filter_buff, len);
+            pulse_detect_process(&neutron_pd, neutron_filter_buff, len);
+        }
+    }
+
+    // while the pulse detector has reported all pulses that start in the 
+    // second being accumulated, publish the second; the sample index is 
+    // adjusted for the filter delay
+    settled_idx = pulse_detect_settled_idx(&neutron_pd) - neutron_filter.delay;
+    while (settled_idx >= 0 &&
+           settled_idx >= mccdaq_time_to_sample_idx(neutron_acc->time * 1000000000L)) 
+    {
+        neutron_publish();
     }
-    if (baseline < 0 || baseline > 9995) {
-        printf("%5d: baseline is out of range\n", baseline);
+
+    // publish the pulse count for flight_recorder_thread; the counter is 32 bits so
+    // that the store and load are single instructions on the 32-bit Pi, and the
+    // flight recorder uses only differences, which are correct across wrap-around
+    __atomic_store_n(&neutron_pulses_published, (uint32_t)neutron_pd.pulse_count, __ATOMIC_RELAXED);
+
+    // when replaying, keep track of the time that the replayed samples have been processed
+    if (opt_replay_filename != NULL) {
+        replay_end_us = microsec_timer();
+    }
+
+    // return 'continue-scanning' 
+    return 0;
+}
+
+// the discarded sample ranges are saved until the seconds that contain them are
+// published; if there are too many then the last range is extended, which 
+// also counts the samples between the ranges as discarded
+static void discard_range_add(uint64_t start_idx, uint64_t end_idx)
+{
+    // the first call has no preceding samples, and so nothing was discarded
+    if (start_idx == 0 || end_idx <= start_idx) {
         return;
     }
 
-    if (value < 0) {
-        value = 0;
+    if (max_discard_range == MAX_DISCARD_RANGE) {
+        discard_range[MAX_DISCARD_RANGE-1].end_idx = end_idx;
+        return;
     }
+    discard_range[max_discard_range].start_idx = start_idx;
+    discard_range[max_discard_range].end_idx   = end_idx;
+    max_discard_range++;
+}
 
-    bzero(str, sizeof(str));
+// returns the number of discarded samples in the range start_idx to end_idx-1, 
+// and removes the discarded sample ranges that end before end_idx
+static int64_t discard_range_count(uint64_t start_idx, uint64_t end_idx)
+{
+    int64_t  count = 0;
+    uint64_t s, e;
+    int32_t  i, j;
+
+    for (i = 0, j = 0; i < max_discard_range; i++) {
+        s = (discard_range[i].start_idx > start_idx ? discard_range[i].start_idx : start_idx);
+        e = (discard_range[i].end_idx < end_idx ? discard_range[i].end_idx : end_idx);
+        if (e > s) {
+            count += e - s;
+        }
+        if (discard_range[i].end_idx > end_idx) {
+            discard_range[j++] = discard_range[i];
+        }
+    }
+    max_discard_range = j;
+    return count;
+}
 
-    idx = value / 100;
-    for (i = 0; i <= idx; i++) {
-        str[i] = '*';
+static void neutron_publish(void)
+{
+    neutron_sec_t * tmp;
+    uint64_t        time_next = neutron_acc->time + 1;
+    uint64_t        end_idx;
+    static uint64_t busy_count_last;
+    int64_t         expected, received, busy;
+    double          rate, tau;
+
+    // the second being published is the samples from neutron_acc_start_idx to end_idx-1
+    end_idx = mccdaq_time_to_sample_idx(neutron_acc->time * 1000000000L);
+    if (end_idx < neutron_acc_start_idx) {
+        end_idx = neutron_acc_start_idx;
+    }
+    neutron_acc->samples = end_idx - neutron_acc_start_idx;
+    neutron_acc->lost_samples = mccdaq_lost_samples(neutron_acc_start_idx, end_idx);
+    neutron_acc->samples_discarded = discard_range_count(neutron_acc_start_idx, end_idx);
+    neutron_acc_start_idx = end_idx;
+
+    // sample accounting for the second: the samples expected are those of the
+    // sample clock plus those lost while the scan was restarted; the samples
+    // received by the pulse detector exclude those discarded by mccdaq
+    expected = neutron_acc->samples + neutron_acc->lost_samples;
+    received = neutron_acc->samples - neutron_acc->samples_discarded;
+    if (received < 0) {
+        received = 0;
     }
 
-    idx = baseline / 100;
-    if (str[idx] == '*') {
-        str[idx] = '+';
+    // the detector's live time is the part of the second that samples were received
+    // and were not in a pulse; the pulse count is scaled to the rate over the samples
+    // received, and the dead time per counted pulse is used to correct that rate
+    busy = neutron_pd.busy_count - busy_count_last;
+    busy_count_last = neutron_pd.busy_count;
+    if (busy > received) {
+        busy = received;
+    }
+    if (received > 0 && expected > 0) {
+        rate = (double)neutron_acc->neutron_pulse_count * expected / received;
+        tau = (neutron_acc->neutron_pulse_count > 0
+               ? (double)busy / ((double)neutron_acc->neutron_pulse_count * expected)
+               : 0);
+        neutron_acc->neutron_live_time_us = (double)(received - busy) / expected * 1000000;
+        neutron_acc->neutron_pulse_count_corrected = 
+            pulse_rate_corrected(opt_dead_time_model, rate, tau) + 0.5;
     } else {
-        str[idx] = '|';
-        for (i = 0; i < idx; i++) {
-            if (str[i] == '\0') {
-                str[i] = ' ';
+        neutron_acc->neutron_live_time_us = 0;
+        neutron_acc->neutron_pulse_count_corrected = neutron_acc->neutron_pulse_count;
+    }
+
+    // publish new neutron data, by swapping the accumulated and published buffers,
+    // and wake neutron_report_thread
+    neutron_acc->baseline           = neutron_pd.baseline;
+    neutron_acc->baseline_rms       = pulse_detect_baseline_rms(&neutron_pd);
+    neutron_acc->skipped_count      = neutron_pd.skipped_count;
+    neutron_acc->too_long_count     = neutron_pd.too_long_count;
+    neutron_acc->out_of_range_count = neutron_pd.out_of_range_count + neutron_filter.out_of_range_count;
+    pthread_mutex_lock(&neutron_mutex);
+    tmp = neutron_pub;
+    neutron_pub = neutron_acc;
+    neutron_acc = tmp;
+    neutron_time = neutron_pub->time;
+    pthread_cond_broadcast(&neutron_cond);
+    pthread_mutex_unlock(&neutron_mutex);
+
+    // reset for the next second
+    neutron_acc->time = time_next;
+    neutron_acc->neutron_pulse_count = 0;
+    neutron_acc->neutron_pileup_count = 0;
+    neutron_acc->max_neutron_pulse = 0;
+    neutron_acc->max_neutron_pulse_time = 0;
+    bzero(neutron_acc->neutron_pulse_hist, sizeof(neutron_acc->neutron_pulse_hist));
+}
+
+static void neutron_pulse_callback(pulse_t * pulse, void * cx)
+{
+    neutron_sec_t * acc;
+    int32_t         n, bin, i;
+    uint64_t        idx;
+    int64_t         offset_ns;
+
+    // timestamp the pulse; if the pulse starts after the second being
+    // accumulated then publish that second
+    idx = (pulse->start_idx > neutron_filter.delay ? pulse->start_idx - neutron_filter.delay : 0);
+    pulse->time_ns = mccdaq_sample_time_ns(idx);
+    while (idx >= mccdaq_time_to_sample_idx(neutron_acc->time * 1000000000L)) {
+        neutron_publish();
+    }
+    acc = neutron_acc;
+
+    // store the pulse time, as ns since the start of the second
+    if (acc->max_neutron_pulse_time < MAX_NEUTRON_PULSE_TIME) {
+        n = acc->max_neutron_pulse_time;
+        if (n == acc->alloc_neutron_pulse_time) {
+            acc->alloc_neutron_pulse_time = (n == 0 ? 1024 : 2 * n);
+            acc->neutron_pulse_time_ns = realloc(acc->neutron_pulse_time_ns,
+                                            acc->alloc_neutron_pulse_time * sizeof(acc->neutron_pulse_time_ns[0]));
+            if (acc->neutron_pulse_time_ns == NULL) {
+                FATAL("realloc neutron pulse time array, alloc=%d\n", acc->alloc_neutron_pulse_time);
             }
         }
+        // a sample clock drift correction can move the time slightly outside the second
+        offset_ns = pulse->time_ns - (int64_t)(acc->time - 1) * 1000000000;
+        if (offset_ns < 0) {
+            offset_ns = 0;
+        } else if (offset_ns > 999999999) {
+            offset_ns = 999999999;
+        }
+        acc->neutron_pulse_time_ns[n] = offset_ns;
+        acc->max_neutron_pulse_time++;
     }
 
-    printf("%5d: %s\n", value, str);
-}
+    // count the pulse, and add it to the pulse height histogram; 
+    // a pile-up is split, each of its peaks is counted
+    for (i = 0; i < pulse->peaks; i++) {
+        acc->neutron_pulse_count++;
+        bin = NEUTRON_PHT_BIN(pulse->peak_mv[i]);
+        if (acc->neutron_pulse_hist[bin] < UINT16_MAX) {
+            acc->neutron_pulse_hist[bin]++;
+        }
+    }
+    if (pulse->peaks > 1) {
+        acc->neutron_pileup_count++;
+    }
+
+    // if the number of pulses stored is less than the waveform limit then
+    // - if needed, grow the pulse arrays; they are not freed, so this
+    //   only occurs while the pulse rate is increasing to a new high
+    // - store the pulse height
+    // - store the pulse data
+    // endif
+    if (acc->max_neutron_pulse < opt_max_neutron_waveform) {
+        n = acc->max_neutron_pulse;
+        if (n == acc->alloc_neutron_pulse) {
+            acc->alloc_neutron_pulse = (n == 0 ? 256 : 2 * n);
+            acc->neutron_pulse_mv = realloc(acc->neutron_pulse_mv,
+                                            acc->alloc_neutron_pulse * sizeof(acc->neutron_pulse_mv[0]));
+            acc->neutron_adc_pulse_data = realloc(acc->neutron_adc_pulse_data,
+                                            acc->alloc_neutron_pulse * sizeof(acc->neutron_adc_pulse_data[0]));
+            if (acc->neutron_pulse_mv == NULL || acc->neutron_adc_pulse_data == NULL) {
+                FATAL("realloc neutron pulse arrays, alloc=%d\n", acc->alloc_neutron_pulse);
+            }
+        }
+        acc->neutron_pulse_mv[n] = pulse->height_mv;
+        memcpy(acc->neutron_adc_pulse_data[n], 
+               pulse->waveform_mv, 
+               sizeof(acc->neutron_adc_pulse_data[n]));
+        acc->max_neutron_pulse++;
+    }
+
+#ifdef ENABLE_PULSE_TRACE
+    // add the pulse to the binary trace, which is written to a file by a 
+    // low priority thread; use support/pulse_trace/pulse_trace_print to plot the pulses
+    pulse_trace_add(pulse);
 #endif
+}
+
+// -----------------  FLIGHT RECORDER  -----------------------------------------------
+
+// The flight recorder saves the raw neutron detector samples surrounding an
+// event to a snapshot file, in the raw capture file format; so the samples can
+// be studied at full resolution, for example using 'get_data -R' or bench_pulse.
+// The samples are copied from the mccdaq ring, which holds about 21 seconds of
+// samples, after the post trigger samples have been acquired; this does not 
+// delay the mccdaq producer or the analysis. One snapshot is pending at a time,
+// triggers that occur while a snapshot is pending are counted as suppressed.
+//
+// The triggers are:
+// - rate: the pulse rate over FLIGHT_INTVL_MS exceeds rate_factor times its
+//         average, and at least FLIGHT_RATE_MIN_PULSES pulses
+// - current: the fusor current differs from its average by current_ma
+// - pressure: the d2 pressure rises above pressure_mtorr, or the pressure 
+//         sensor reports over pressure
+// - manual: the display program's trigger command (the 't' key), or SIGUSR1
+
+// the spec is a comma separated list of name=value, or "default"
+static int32_t flight_recorder_parse(char * spec)
+{
+    char   str[PATH_MAX+100], *saveptr, *tok, *value;
+    int32_t compress;
+
+    // defaults
+    flight_cfg.rate_factor    = 5;
+    flight_cfg.current_ma     = 2;
+    flight_cfg.pressure_mtorr = 100;
+    flight_cfg.pre_secs       = 5;
+    flight_cfg.post_secs      = 5;
+    flight_cfg.compress       = true;
+    strcpy(flight_cfg.dir, ".");
+    if (strcmp(spec, "default") == 0) {
+        return 0;
+    }
+
+    // parse the name=value pairs
+    snprintf(str, sizeof(str), "%s", spec);
+    for (tok = strtok_r(str, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        if ((value = strchr(tok, '=')) == NULL) {
+            ERROR("flight recorder spec '%s' expected name=value\n", tok);
+            return -1;
+        }
+        *value++ = '\0';
+
+        if (strcmp(tok, "rate") == 0 && sscanf(value, "%lf", &flight_cfg.rate_factor) == 1 && flight_cfg.rate_factor >= 0) {
+            // ok
+        } else if (strcmp(tok, "current") == 0 && sscanf(value, "%lf", &flight_cfg.current_ma) == 1 && flight_cfg.current_ma >= 0) {
+            // ok
+        } else if (strcmp(tok, "pressure") == 0 && sscanf(value, "%lf", &flight_cfg.pressure_mtorr) == 1 && flight_cfg.pressure_mtorr >= 0) {
+            // ok
+        } else if (strcmp(tok, "pre") == 0 && sscanf(value, "%lf", &flight_cfg.pre_secs) == 1 && flight_cfg.pre_secs >= 0) {
+            // ok
+        } else if (strcmp(tok, "post") == 0 && sscanf(value, "%lf", &flight_cfg.post_secs) == 1 && flight_cfg.post_secs >= 0) {
+            // ok
+        } else if (strcmp(tok, "compress") == 0 && sscanf(value, "%d", &compress) == 1) {
+            flight_cfg.compress = compress;
+        } else if (strcmp(tok, "dir") == 0 && strlen(value) > 0 && strlen(value) < sizeof(flight_cfg.dir)) {
+            strcpy(flight_cfg.dir, value);
+        } else {
+            ERROR("flight recorder spec '%s=%s' is invalid\n", tok, value);
+            return -1;
+        }
+    }
+
+    // validate the snapshot length
+    if (flight_cfg.pre_secs + flight_cfg.post_secs <= 0 || 
+        flight_cfg.pre_secs + flight_cfg.post_secs > FLIGHT_MAX_SECS) 
+    {
+        ERROR("flight recorder pre + post must be 0 to %d secs\n", FLIGHT_MAX_SECS);
+        return -1;
+    }
+    return 0;
+}
+
+static void * flight_recorder_thread(void * cx)
+{
+    struct timespec ts;
+    mccdaq_stats_t  stats;
+    int64_t         now_ns, trig_ns = 0;
+    uint32_t        pulses, pulses_last;
+    uint64_t        start_idx = 0, end_idx = 0;
+    double          intvl_secs, rate, rate_avg = -1, current_ma, current_avg = -1, pressure_mtorr;
+    int16_t         mean_mv;
+    bool            pending = false, over_pressure = false, over_pressure_last = false;
+    char          * reason, pending_reason[32] = "";
+
+    ATOMIC_INCREMENT(&active_thread_count);
+
+    INFO("flight recorder: rate=%g current=%g pressure=%g pre=%g post=%g compress=%d dir=%s\n",
+         flight_cfg.rate_factor, flight_cfg.current_ma, flight_cfg.pressure_mtorr,
+         flight_cfg.pre_secs, flight_cfg.post_secs, flight_cfg.compress, flight_cfg.dir);
+
+    intvl_secs = FLIGHT_INTVL_MS / 1000.;
+    pulses_last = __atomic_load_n(&neutron_pulses_published, __ATOMIC_RELAXED);
+
+    while (!sigint_or_sigterm) {
+        usleep(FLIGHT_INTVL_MS * 1000);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        now_ns = ts.tv_sec * 1000000000L + ts.tv_nsec;
+        reason = NULL;
+
+        // rate trigger; the average excludes the intervals that trigger, so that
+        // a burst does not raise the average
+        pulses = __atomic_load_n(&neutron_pulses_published, __ATOMIC_RELAXED);
+        rate = (pulses - pulses_last) / intvl_secs;
+        if (flight_cfg.rate_factor > 0 && rate_avg >= 0 &&
+            pulses - pulses_last >= FLIGHT_RATE_MIN_PULSES &&
+            rate > flight_cfg.rate_factor * rate_avg)
+        {
+            reason = "rate";
+        } else {
+            rate_avg = (rate_avg < 0 ? rate : rate_avg + (rate - rate_avg) * intvl_secs / FLIGHT_RATE_AVG_SECS);
+        }
+        pulses_last = pulses;
+
+        // current trigger
+        current_ma = get_fusor_current_ma();
+        if (current_ma != ERROR_NO_VALUE) {
+            if (flight_cfg.current_ma > 0 && current_avg >= 0 &&
+                fabs(current_ma - current_avg) > flight_cfg.current_ma)
+            {
+                reason = "current";
+            }
+            current_avg = (current_avg < 0 ? current_ma 
+                           : current_avg + (current_ma - current_avg) * intvl_secs / FLIGHT_CURRENT_AVG_SECS);
+        }
+
+        // pressure trigger, when the pressure rises above the limit
+        over_pressure = false;
+        if (flight_cfg.pressure_mtorr > 0 &&
+            dataq_get_adc(DATAQ_ADC_CHAN_PRESSURE, NULL, &mean_mv, NULL, NULL, NULL) == 0) 
+        {
+            pressure_mtorr = convert_adc_pressure(mean_mv/1000., GAS_ID_D2);
+            over_pressure = (pressure_mtorr == ERROR_OVER_PRESSURE ||
+                             (!IS_ERROR(pressure_mtorr) && pressure_mtorr > flight_cfg.pressure_mtorr));
+        }
+        if (over_pressure && !over_pressure_last) {
+            reason = "pressure";
+        }
+        over_pressure_last = over_pressure;
+
+        // manual trigger
+        if (__atomic_exchange_n(&flight_manual_req, false, __ATOMIC_RELAXED)) {
+            reason = "manual";
+        }
+
+        // if triggered then determine the range of samples of the snapshot
+        if (reason != NULL) {
+            flight_stats.triggers++;
+            if (pending) {
+                DEBUG("flight recorder %s trigger suppressed\n", reason);
+                flight_stats.suppressed++;
+            } else {
+                INFO("flight recorder %s trigger, pulse rate=%.0f average=%.0f\n",
+                     reason, rate, rate_avg);
+                pending   = true;
+                trig_ns   = now_ns;
+                start_idx = mccdaq_time_to_sample_idx(now_ns - flight_cfg.pre_secs * 1e9);
+                end_idx   = mccdaq_time_to_sample_idx(now_ns + flight_cfg.post_secs * 1e9);
+                snprintf(pending_reason, sizeof(pending_reason), "%s", reason);
+            }
+        }
+
+        // when the post trigger samples have been acquired, save the snapshot
+        if (pending) {
+            mccdaq_get_stats(&stats);
+            if (stats.produced >= end_idx) {
+                flight_recorder_snapshot(pending_reason, start_idx, end_idx, trig_ns);
+                pending = false;
+            }
+        }
+    }
+
+    ATOMIC_DECREMENT(&active_thread_count);
+    return NULL;
+}
+
+static void flight_recorder_snapshot(char * reason, uint64_t start_idx, uint64_t end_idx, int64_t trig_ns)
+{
+    char       filename[PATH_MAX+100], time_str[32];
+    uint16_t * buff;
+    uint64_t   idx = start_idx;
+    int64_t    n;
+    time_t     t = trig_ns / 1000000000;
+    struct tm  tm;
+
+    // copy the samples from the mccdaq ring
+    buff = malloc((end_idx - start_idx) * sizeof(uint16_t));
+    if (buff == NULL) {
+        FATAL("malloc snapshot buff, %"PRId64" samples\n", end_idx - start_idx);
+    }
+    n = mccdaq_copy_samples(&idx, buff, end_idx - start_idx);
+    if (n <= 0) {
+        ERROR("flight recorder %s snapshot, samples are no longer available\n", reason);
+        flight_stats.errors++;
+        free(buff);
+        return;
+    }
+    if (idx != start_idx) {
+        WARN("flight recorder %s snapshot, %"PRId64" pre trigger samples are no longer available\n",
+             reason, idx - start_idx);
+    }
+
+    // write the snapshot file, named by the trigger time and reason
+    strftime(time_str, sizeof(time_str), "%Y%m%d_%H%M%S", localtime_r(&t, &tm));
+    snprintf(filename, sizeof(filename), "%s/flight_%s_%03d_%s.raw", 
+             flight_cfg.dir, time_str, (int32_t)(trig_ns % 1000000000 / 1000000), reason);
+    if (raw_capture_write_file(filename, buff, n, idx, flight_cfg.compress, mccdaq_sample_time_ns) < 0) {
+        flight_stats.errors++;
+    } else {
+        INFO("flight recorder saved %s, %"PRId64" samples\n", filename, n);
+        flight_stats.snapshots++;
+    }
+    free(buff);
+}
+
+static void sigusr1_handler(int sig)
+{
+    flight_manual_req = true;
+}
@@ -0,0 +1,716 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+
+// benchmark the get_data neutron pulse detector, in isolation from the mccdaq 
+// device, on a synthetic sample stream from util_pulse_gen or on a recorded 
+// raw capture file; reports the processing cost, the allocations made by the 
+// detector, and the precision and recall of the detected pulses against the 
+// ground truth; when more than 1 thread is used, the per second values that 
+// get_data publishes are checked against those of a single thread run
+//
+// usage: bench_pulse [options]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+
+#include "util_pulse.h"
+#include "util_filter.h"
+#include "util_pulse_gen.h"
+#include "util_raw_capture.h"
+#include "util_misc.h"
+
+//
+// defines
+//
+
+#define SAMPLE_RATE            499999     // same as the mccdaq
+#define DEFAULT_SAMPLES        20000000
+#define DEFAULT_GEN_SPEC       "rate=5000"
+#define DEFAULT_THRESHOLD      10         // adc counts, same as get_data TUNE_PULSE_THRESHOLD
+#define DEFAULT_BLOCK_LEN      16384      // samples per call, about the size of a mccdaq callback
+#define DEFAULT_ITERATIONS     3
+#define DEFAULT_TOLERANCE      3          // samples
+#define MAX_FILTER_BUFF        16384
+
+//
+// typedefs
+//
+
+typedef struct {
+    int64_t start_idx;          // adjusted for the filter delay
+    int32_t length;
+    int32_t height_mv;
+    int32_t peaks;
+} det_t;
+
+// the detector values that get_data's neutron_publish reads, at the end of each second
+typedef struct {
+    int64_t  pulses;
+    uint64_t busy_count;
+    uint64_t skipped_count;
+    uint64_t too_long_count;
+    int32_t  baseline;
+    double   baseline_rms;
+} sec_t;
+
+//
+// variables
+//
+
+static char    * opt_gen_spec = DEFAULT_GEN_SPEC;
+static int64_t   opt_samples = DEFAULT_SAMPLES;
+static char    * opt_raw_filename;
+static char    * opt_truth_filename;
+static int32_t   opt_mode = PULSE_DETECT_MODE_SIMD;
+static char    * opt_filter = "none";
+static int32_t   opt_threads = 1;
+static int32_t   opt_block_len = DEFAULT_BLOCK_LEN;
+static int32_t   opt_iterations = DEFAULT_ITERATIONS;
+static int32_t   opt_tolerance = DEFAULT_TOLERANCE;
+static int32_t   opt_threshold = DEFAULT_THRESHOLD;
+static bool      opt_machine;
+
+static uint16_t          * data;
+static int64_t             max_data;
+static uint64_t            data_start_idx;    // sample index of data[0]
+static pulse_gen_truth_t * truth;
+static int64_t             max_truth;
+
+static det_t             * det;
+static int64_t             max_det;
+static int64_t             det_alloc;
+static int32_t             det_filter_delay;
+
+static sec_t             * sec;
+static int64_t             max_sec;
+static int64_t             sec_alloc;
+static int64_t             sec_end_idx;       // sample index of the end of the second
+static int64_t             sec_pulses;
+
+static uint64_t            alloc_count;       // allocations made by the detector and filter
+static uint64_t            alloc_bytes;
+static bool                alloc_counting;
+
+//
+// prototypes
+//
+
+static void usage(void);
+static void generate(void);
+static void read_raw(char * filename);
+static void read_truth(char * filename);
+static void run(pulse_detect_t * pd, filter_t * f, uint16_t * fbuff, int32_t threads);
+static void pulse_cb(pulse_t * pulse, void * cx);
+static void sec_publish(pulse_detect_t * pd);
+static int64_t sec_compare(sec_t * a, sec_t * b, int64_t n);
+static void score(int64_t * matched, int64_t * peaks, double * height_rms_mv);
+static int64_t timer_ns(void);
+
+// -----------------  MAIN  ------------------------------------------------
+
+int32_t main(int argc, char ** argv)
+{
+    pulse_detect_t pd;
+    filter_t       f;
+    uint16_t     * fbuff;
+    int64_t        start_ns, ns, best_ns = INT64_MAX, matched = 0, peaks = 0;
+    int64_t        sec_checked = 0, sec_differ = 0;
+    sec_t        * sec_par;
+    uint64_t       best_alloc_count = 0, best_alloc_bytes = 0;
+    double         height_rms_mv = 0, secs, precision, recall;
+    int32_t        iter;
+    char           input_str[300];
+
+    // parse options
+    // -h          : help
+    // -g spec     : generate the samples using util_pulse_gen, default "rate=5000"
+    // -n samples  : number of samples generated, default 20000000
+    // -R filename : read the samples from a raw capture file, instead of generating them
+    // -T filename : ground truth for the raw capture, written by util_pulse_gen
+    // -d mode     : pulse detector mode, simd (default) or scalar
+    // -f filter   : filter applied ahead of the pulse detector, see util_filter.c
+    // -j threads  : threads used by pulse_detect_process_parallel, default 1;
+    //               more than 1 requires '-f none'
+    // -b len      : samples passed to the detector per call, default 16384
+    // -i count    : iterations, the fastest is reported, default 3
+    // -w samples  : tolerance when matching detected to generated pulse start, default 3
+    // -t counts   : pulse detector threshold, default 10
+    // -m          : machine readable output, a single line of name=value, starting 
+    //               with "bench_pulse " to distinguish it from the log messages
+    while (true) {
+        char opt_char = getopt(argc, argv, "hg:n:R:T:d:f:j:b:i:w:t:m");
+        if (opt_char == -1) {
+            break;
+        }
+        switch (opt_char) {
+        case 'h':
+            usage();
+            return 0;
+        case 'g':
+            opt_gen_spec = optarg;
+            break;
+        case 'n':
+            if (sscanf(optarg, "%" SCNd64, &opt_samples) != 1 || opt_samples <= 0) {
+                ERROR("invalid '-n %s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'R':
+            opt_raw_filename = optarg;
+            break;
+        case 'T':
+            opt_truth_filename = optarg;
+            break;
+        case 'd':
+            if (strcmp(optarg, "simd") == 0) {
+                opt_mode = PULSE_DETECT_MODE_SIMD;
+            } else if (strcmp(optarg, "scalar") == 0) {
+                opt_mode = PULSE_DETECT_MODE_SCALAR;
+            } else {
+                ERROR("invalid '-d %s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            opt_filter = optarg;
+            break;
+        case 'j':
+            if (sscanf(optarg, "%d", &opt_threads) != 1 || opt_threads < 1) {
+                ERROR("invalid '-j %s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'b':
+            if (sscanf(optarg, "%d", &opt_block_len) != 1 || opt_block_len < 1) {
+                ERROR("invalid '-b %s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i':
+            if (sscanf(optarg, "%d", &opt_iterations) != 1 || opt_iterations < 1) {
+                ERROR("invalid '-i %s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'w':
+            if (sscanf(optarg, "%d", &opt_tolerance) != 1 || opt_tolerance < 0) {
+                ERROR("invalid '-w %s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            if (sscanf(optarg, "%d", &opt_threshold) != 1 || opt_threshold < 1) {
+                ERROR("invalid '-t %s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'm':
+            opt_machine = true;
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (optind != argc) {
+        usage();
+        return 1;
+    }
+
+    // the filtered samples are passed to pulse_detect_process, as get_data does, 
+    // so multiple threads are only used without a filter
+    if (opt_threads > 1 && strcmp(opt_filter, "none") != 0) {
+        ERROR("'-j %d' is not supported with '-f %s', the filtered path uses 1 thread\n",
+              opt_threads, opt_filter);
+        return 1;
+    }
+
+    // get the samples, and the ground truth if available
+    if (opt_raw_filename) {
+        read_raw(opt_raw_filename);
+        if (opt_truth_filename) {
+            read_truth(opt_truth_filename);
+        }
+        snprintf(input_str, sizeof(input_str), "raw:%s", opt_raw_filename);
+    } else {
+        generate();
+        snprintf(input_str, sizeof(input_str), "gen:%s", opt_gen_spec);
+    }
+
+    // allocate the filter buffer, and the per second values; these are allocated
+    // here so that they are not counted as allocations made by the detector
+    fbuff = malloc(MAX_FILTER_BUFF * sizeof(uint16_t));
+    sec_alloc = max_data / SAMPLE_RATE + 2;
+    sec = malloc(sec_alloc * sizeof(sec_t));
+    sec_par = malloc(sec_alloc * sizeof(sec_t));
+    if (fbuff == NULL || sec == NULL || sec_par == NULL) {
+        FATAL("malloc failed\n");
+    }
+
+    // run the detector on the samples, opt_iterations times; the fastest is reported
+    for (iter = 0; iter < opt_iterations; iter++) {
+        alloc_count = alloc_bytes = 0;
+        alloc_counting = true;
+        start_ns = timer_ns();
+        run(&pd, &f, fbuff, opt_threads);
+        ns = timer_ns() - start_ns;
+        alloc_counting = false;
+
+        if (ns < best_ns) {
+            best_ns = ns;
+            best_alloc_count = alloc_count;
+            best_alloc_bytes = alloc_bytes;
+        }
+    }
+
+    // when multiple threads are used, check that the per second values are
+    // the same as those of a single thread run
+    if (opt_threads > 1) {
+        int64_t max_sec_par = max_sec;
+        memcpy(sec_par, sec, max_sec * sizeof(sec_t));
+        run(&pd, &f, fbuff, 1);
+        sec_checked = (max_sec < max_sec_par ? max_sec : max_sec_par);
+        sec_differ = sec_compare(sec, sec_par, sec_checked) + labs(max_sec - max_sec_par);
+    }
+
+    // score the detected pulses against the ground truth
+    if (max_truth > 0) {
+        score(&matched, &peaks, &height_rms_mv);
+    }
+
+    // print results
+    secs = best_ns / 1e9;
+    precision = (peaks > 0 ? (double)matched / peaks : 0);
+    recall = (max_truth > 0 ? (double)matched / max_truth : 0);
+    if (opt_machine) {
+        printf("bench_pulse input=%s mode=%s simd=%s filter=%s threads=%d block_len=%d threshold=%d "
+               "samples=%" PRId64 " secs=%0.6f msamples_per_sec=%0.3f ns_per_sample=%0.3f "
+               "pulses=%" PRId64 " pulses_per_sec=%0.0f pileups=%" PRIu64 " allocs=%" PRIu64 " alloc_bytes=%" PRIu64 " "
+               "truth=%" PRId64 " matched=%" PRId64 " precision=%0.5f recall=%0.5f height_rms_mv=%0.2f "
+               "secs_checked=%" PRId64 " secs_differ=%" PRId64 "\n",
+               input_str, opt_mode == PULSE_DETECT_MODE_SIMD ? "simd" : "scalar", pulse_detect_simd_name(),
+               opt_filter, opt_threads, opt_block_len, opt_threshold,
+               max_data, secs, max_data / secs / 1e6, (double)best_ns / max_data,
+               max_det, max_det / secs, pd.pileup_count, best_alloc_count, best_alloc_bytes,
+               max_truth, matched, precision, recall, height_rms_mv, sec_checked, sec_differ);
+    } else {
+        printf("input          %s\n", input_str);
+        printf("detector       mode=%s simd=%s filter=%s threads=%d block_len=%d threshold=%d\n",
+               opt_mode == PULSE_DETECT_MODE_SIMD ? "simd" : "scalar", pulse_detect_simd_name(),
+               opt_filter, opt_threads, opt_block_len, opt_threshold);
+        printf("samples        %" PRId64 " (%0.1f secs at the sample rate)\n", 
+               max_data, (double)max_data / SAMPLE_RATE);
+        printf("time           %0.3f secs, fastest of %d\n", secs, opt_iterations);
+        printf("throughput     %0.2f Msamples/sec   %0.3f ns/sample   %0.1f x the sample rate\n",
+               max_data / secs / 1e6, (double)best_ns / max_data, max_data / secs / SAMPLE_RATE);
+        printf("pulses         %" PRId64 "   %0.0f /sec processed   pileups=%" PRIu64 "   too_long=%" PRIu64 "\n",
+               max_det, max_det / secs, pd.pileup_count, pd.too_long_count);
+        printf("allocations    %" PRIu64 "   %" PRIu64 " bytes\n", best_alloc_count, best_alloc_bytes);
+        if (max_truth > 0) {
+            printf("truth          %" PRId64 " pulses, %" PRId64 " detected peaks, %" PRId64 " matched within %d samples\n",
+                   max_truth, peaks, matched, opt_tolerance);
+            printf("accuracy       precision=%0.5f   recall=%0.5f   height_rms_mv=%0.2f\n",
+                   precision, recall, height_rms_mv);
+        } else {
+            printf("accuracy       no ground truth\n");
+        }
+        if (opt_threads > 1) {
+            printf("per second     %" PRId64 " secs checked against 1 thread, %" PRId64 " differ\n",
+                   sec_checked, sec_differ);
+        }
+    }
+
+    return 0;
+}
+
+static void usage(void)
+{
+    printf("\n"
+           "usage: bench_pulse [options]\n"
+           "\n"
+           "   where options include:\n"
+           "       -h          : help\n"
+           "       -g spec     : generate the samples using util_pulse_gen, default \"%s\"\n"
+           "       -n samples  : number of samples generated, default %d\n"
+           "       -R filename : read the samples from a raw capture file, instead of generating them\n"
+           "       -T filename : ground truth for the raw capture, written by get_data -G\n"
+           "       -d mode     : pulse detector mode, simd (default) or scalar\n"
+           "       -f filter   : filter applied ahead of the pulse detector, one of\n"
+           "                     none (default), ma,n  trap,k,m  matched,file  crrc,tau[,gain]\n"
+           "       -j threads  : threads used by the pulse detector, default 1,\n"
+           "                     more than 1 requires -f none\n"
+           "       -b len      : samples passed to the detector per call, default %d\n"
+           "       -i count    : iterations, the fastest is reported, default %d\n"
+           "       -w samples  : tolerance matching detected to generated pulse start, default %d\n"
+           "       -t counts   : pulse detector threshold, default %d\n"
+           "       -m          : machine readable output, a single line of name=value\n"
+           "\n",
+           DEFAULT_GEN_SPEC, DEFAULT_SAMPLES, DEFAULT_BLOCK_LEN, DEFAULT_ITERATIONS,
+           DEFAULT_TOLERANCE, DEFAULT_THRESHOLD);
+}
+
+// -----------------  INPUT  -----------------------------------------------
+
+static void generate(void)
+{
+    pulse_gen_t * g;
+
+    // allocate the samples, and the ground truth with room for 3 times the 
+    // expected number of pulses
+    g = calloc(1, sizeof(pulse_gen_t));
+    if (g == NULL) {
+        FATAL("calloc failed\n");
+    }
+    if (pulse_gen_init(g, opt_gen_spec, SAMPLE_RATE, NULL) < 0) {
+        FATAL("invalid pulse generator spec '%s'\n", opt_gen_spec);
+    }
+    max_data = opt_samples;
+    data = malloc(max_data * sizeof(uint16_t));
+    g->max_truth = 3 * g->rate * max_data / SAMPLE_RATE + 1000;
+    g->truth = malloc(g->max_truth * sizeof(pulse_gen_truth_t));
+    if (data == NULL || g->truth == NULL) {
+        FATAL("malloc failed\n");
+    }
+
+    // generate
+    pulse_gen_fill(g, data, max_data);
+    if (g->truth_count == g->max_truth) {
+        FATAL("ground truth overflow, %" PRId64 " pulses\n", g->truth_count);
+    }
+    truth = g->truth;
+    max_truth = g->truth_count;
+    data_start_idx = 0;
+}
+
+static void read_raw(char * filename)
+{
+    FILE              * fp;
+    raw_capture_hdr_t * hdr;
+    int64_t             alloc = 0, gap;
+    int32_t             n;
+
+    // open
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        FATAL("open %s, %s\n", filename, strerror(errno));
+    }
+    hdr = malloc(RAW_CAPTURE_BLOCK_LEN);
+    if (hdr == NULL) {
+        FATAL("malloc failed\n");
+    }
+
+    // read and decode the blocks, up to opt_samples; gaps in the sample index, 
+    // where the raw capture dropped samples, are filled with the preceding sample 
+    // so that data[] is indexed by sample index
+    while (max_data < opt_samples && fread(hdr, sizeof(raw_capture_hdr_t), 1, fp) == 1) {
+        if (hdr->magic != RAW_CAPTURE_MAGIC || 
+            hdr->block_len < sizeof(raw_capture_hdr_t) || hdr->block_len > RAW_CAPTURE_BLOCK_LEN ||
+            fread(hdr + 1, hdr->block_len - sizeof(raw_capture_hdr_t), 1, fp) != 1) 
+        {
+            FATAL("invalid or truncated raw capture block\n");
+        }
+        if (max_data == 0) {
+            data_start_idx = hdr->sample_idx;
+        }
+        gap = hdr->sample_idx - (data_start_idx + max_data);
+        if (gap < 0 || gap > 10*SAMPLE_RATE) {
+            FATAL("raw capture sample_idx %" PRIu64 " out of order\n", hdr->sample_idx);
+        }
+        if (max_data + gap + RAW_CAPTURE_MAX_SAMPLES > alloc) {
+            alloc = (alloc + gap + RAW_CAPTURE_MAX_SAMPLES) * 2;
+            data = realloc(data, alloc * sizeof(uint16_t));
+            if (data == NULL) {
+                FATAL("realloc failed\n");
+            }
+        }
+        if (gap > 0) {
+            WARN("raw capture gap of %" PRId64 " samples at sample_idx %" PRIu64 "\n", gap, hdr->sample_idx);
+            for (; gap > 0; gap--, max_data++) {
+                data[max_data] = (max_data > 0 ? data[max_data-1] : hdr->first_sample);
+            }
+        }
+        n = raw_capture_decode(hdr, data + max_data, RAW_CAPTURE_MAX_SAMPLES);
+        if (n < 0) {
+            FATAL("raw capture decode failed, sample_idx %" PRIu64 "\n", hdr->sample_idx);
+        }
+        max_data += n;
+    }
+    if (max_data > opt_samples) {
+        max_data = opt_samples;
+    }
+    if (max_data == 0) {
+        FATAL("no samples in %s\n", filename);
+    }
+
+    fclose(fp);
+    free(hdr);
+}
+
+// the ground truth file written by util_pulse_gen; only the pulses within the
+// range of samples read from the raw capture are kept
+static void read_truth(char * filename)
+{
+    FILE   * fp;
+    char     s[200];
+    uint64_t idx;
+    float    height;
+    int32_t  pileup, saturated;
+    int64_t  alloc = 0;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        FATAL("open %s, %s\n", filename, strerror(errno));
+    }
+    while (fgets(s, sizeof(s), fp) != NULL) {
+        if (s[0] == '#') {
+            continue;
+        }
+        if (sscanf(s, "%" SCNu64 " %f %d %d", &idx, &height, &pileup, &saturated) != 4) {
+            FATAL("invalid ground truth line '%s'\n", s);
+        }
+        if (idx < data_start_idx || idx >= data_start_idx + max_data) {
+            continue;
+        }
+        if (max_truth == alloc) {
+            alloc = (alloc + 1000) * 2;
+            truth = realloc(truth, alloc * sizeof(pulse_gen_truth_t));
+            if (truth == NULL) {
+                FATAL("realloc failed\n");
+            }
+        }
+        truth[max_truth].sample_idx = idx;
+        truth[max_truth].height_mv  = height;
+        truth[max_truth].pileup     = pileup;
+        truth[max_truth].saturated  = saturated;
+        max_truth++;
+    }
+    fclose(fp);
+}
+
+// -----------------  RUN THE DETECTOR  ------------------------------------
+
+// process the samples, in blocks of opt_block_len, as get_data's mccdaq_callback 
+// does; and record the per second values, as get_data's neutron_publish does
+static void run(pulse_detect_t * pd, filter_t * f, uint16_t * fbuff, int32_t threads)
+{
+    int64_t i, j, len, flen;
+
+    // init the filter and detector, and reset the detected pulses and per second values
+    if (filter_init(f, opt_filter) < 0) {
+        FATAL("invalid filter '%s'\n", opt_filter);
+    }
+    pulse_detect_init(pd, opt_threshold, pulse_cb, pd);
+    pulse_detect_set_mode(pd, opt_mode);
+    pulse_detect_resync(pd, data_start_idx);
+    det_filter_delay = f->delay;
+    max_det = 0;
+    max_sec = 0;
+    sec_end_idx = data_start_idx + SAMPLE_RATE;
+    sec_pulses = 0;
+
+    // process
+    for (i = 0; i < max_data; i += len) {
+        len = (max_data - i < opt_block_len ? max_data - i : opt_block_len);
+        if (f->type == FILTER_TYPE_NONE) {
+            pulse_detect_process_parallel(pd, data+i, len, threads);
+        } else {
+            for (j = 0; j < len; j += flen) {
+                flen = (len - j < MAX_FILTER_BUFF ? len - j : MAX_FILTER_BUFF);
+                filter_process(f, data+i+j, fbuff, flen);
+                pulse_detect_process(pd, fbuff, flen);
+            }
+        }
+        while (pulse_detect_settled_idx(pd) - det_filter_delay >= sec_end_idx) {
+            sec_publish(pd);
+        }
+    }
+}
+
+// -----------------  DETECTED PULSES  -------------------------------------
+
+static void pulse_cb(pulse_t * pulse, void * cx)
+{
+    pulse_detect_t * pd = cx;
+
+    // if the pulse starts after the second then publish the second
+    while (pulse->start_idx - det_filter_delay >= sec_end_idx) {
+        sec_publish(pd);
+    }
+    sec_pulses++;
+
+    // the pulses array is grown outside of the allocation counting, so that 
+    // only the detector's allocations are counted
+    if (max_det == det_alloc) {
+        bool counting = alloc_counting;
+        alloc_counting = false;
+        det_alloc = (det_alloc + 100000) * 2;
+        det = realloc(det, det_alloc * sizeof(det_t));
+        if (det == NULL) {
+            FATAL("realloc failed\n");
+        }
+        alloc_counting = counting;
+    }
+
+    det[max_det].start_idx = pulse->start_idx - det_filter_delay;
+    det[max_det].length    = pulse->length;
+    det[max_det].height_mv = pulse->height_mv;
+    det[max_det].peaks     = pulse->peaks;
+    max_det++;
+}
+
+// records the values at the end of the second, from the detector's state
+static void sec_publish(pulse_detect_t * pd)
+{
+    if (max_sec < sec_alloc) {
+        sec[max_sec].pulses         = sec_pulses;
+        sec[max_sec].busy_count     = pd->busy_count;
+        sec[max_sec].skipped_count  = pd->skipped_count;
+        sec[max_sec].too_long_count = pd->too_long_count;
+        sec[max_sec].baseline       = pd->baseline;
+        sec[max_sec].baseline_rms   = pulse_detect_baseline_rms(pd);
+        max_sec++;
+    }
+    sec_end_idx += SAMPLE_RATE;
+    sec_pulses = 0;
+}
+
+// returns the number of seconds whose values differ
+static int64_t sec_compare(sec_t * a, sec_t * b, int64_t n)
+{
+    int64_t i, differ = 0;
+
+    for (i = 0; i < n; i++) {
+        if (a[i].pulses != b[i].pulses ||
+            a[i].busy_count != b[i].busy_count ||
+            a[i].skipped_count != b[i].skipped_count ||
+            a[i].too_long_count != b[i].too_long_count ||
+            a[i].baseline != b[i].baseline ||
+            a[i].baseline_rms != b[i].baseline_rms)
+        {
+            if (differ == 0) {
+                WARN("second %" PRId64 " differs: pulses %" PRId64 "/%" PRId64 " busy %" PRIu64 "/%" PRIu64 
+                     " skipped %" PRIu64 "/%" PRIu64 " baseline %d/%d\n",
+                     i, a[i].pulses, b[i].pulses, a[i].busy_count, b[i].busy_count,
+                     a[i].skipped_count, b[i].skipped_count, a[i].baseline, b[i].baseline);
+            }
+            differ++;
+        }
+    }
+    return differ;
+}
+
+// each detected pulse matches up to peaks generated pulses that start within
+// its samples, allowing for the tolerance; the precision is the fraction of 
+// the detected peaks that match a generated pulse, and the recall is the fraction
+// of the generated pulses that are matched; the height error is for the matched
+// pulses that are not pile-ups and do not saturate
+static void score(int64_t * matched_arg, int64_t * peaks_arg, double * height_rms_mv)
+{
+    int64_t i, t = 0, k, lo, hi, matched = 0, peaks = 0, height_cnt = 0;
+    double  height_sum_sq = 0, err;
+
+    for (i = 0; i < max_det; i++) {
+        det_t * d = &det[i];
+        lo = d->start_idx - opt_tolerance;
+        hi = d->start_idx + (d->peaks > 1 ? d->length : 0) + opt_tolerance;
+        peaks += d->peaks;
+
+        // skip generated pulses that start before this detected pulse
+        while (t < max_truth && (int64_t)truth[t].sample_idx < lo) {
+            t++;
+        }
+
+        // match
+        for (k = 0; k < d->peaks && t < max_truth && (int64_t)truth[t].sample_idx <= hi; k++, t++) {
+            matched++;
+            if (d->peaks == 1 && !truth[t].pileup && !truth[t].saturated &&
+                (t+1 == max_truth || truth[t+1].sample_idx - truth[t].sample_idx > d->length))
+            {
+                err = d->height_mv - truth[t].height_mv;
+                height_sum_sq += err * err;
+                height_cnt++;
+            }
+        }
+    }
+
+    *matched_arg = matched;
+    *peaks_arg = peaks;
+    *height_rms_mv = (height_cnt > 0 ? sqrt(height_sum_sq / height_cnt) : 0);
+}
+
+// -----------------  ALLOCATION COUNTING  ---------------------------------
+
+// the link wraps malloc, calloc, and realloc (see Makefile); the allocations 
+// made while the detector is running are counted
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t nmemb, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+
+void * __wrap_malloc(size_t size)
+{
+    if (alloc_counting) {
+        __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+    }
+    return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t nmemb, size_t size)
+{
+    if (alloc_counting) {
+        __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&alloc_bytes, nmemb * size, __ATOMIC_RELAXED);
+    }
+    return __real_calloc(nmemb, size);
+}
+
+void * __wrap_realloc(void * ptr, size_t size)
+{
+    if (alloc_counting) {
+        __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+    }
+    return __real_realloc(ptr, size);
+}
+
+// -----------------  MISC  ------------------------------------------------
+
+static int64_t timer_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
@@ -0,0 +1 @@
+../../util_filter.c
\ No newline at end of file
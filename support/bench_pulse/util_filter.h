@@ -0,0 +1 @@
+../../util_filter.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../util_misc.c
\ No newline at end of file
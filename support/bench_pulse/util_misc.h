@@ -0,0 +1 @@
+../../util_misc.h
\ No newline at end of file
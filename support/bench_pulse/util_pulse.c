@@ -0,0 +1 @@
+../../util_pulse.c
\ No newline at end of file
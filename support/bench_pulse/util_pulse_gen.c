@@ -0,0 +1 @@
+../../util_pulse_gen.c
\ No newline at end of file
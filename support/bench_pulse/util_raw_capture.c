@@ -0,0 +1 @@
+../../util_raw_capture.c
\ No newline at end of file
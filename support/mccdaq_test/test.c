@@ -43,6 +43,7 @@ SOFTWARE.
 #include <readline/readline.h>
 #include <readline/history.h>
 
+#include "util_pulse_gen.h"
 #include "util_mccdaq.h"
 #include "util_misc.h"
 
@@ -77,7 +78,7 @@ static uint64_t  pulse_time_start;
 
 static void * monitor_thread(void * cx);
 static void sigint_handler(int sig);
-static int32_t mccdaq_callback(uint16_t * data, int32_t max_data);
+static int32_t mccdaq_callback(uint16_t * data, int32_t max_data, uint64_t sample_idx);
 static void print_plot_str(uint16_t value, uint16_t pulse_threshold);
 
 // -----------------  MAIN  ------------------------------------------------
@@ -221,7 +222,7 @@ static void sigint_handler(int sig)
 
 // -----------------  MCCDAQ CALLBACK  -----------------------------------------------
 
-static int32_t mccdaq_callback(uint16_t * d, int32_t max_d)
+static int32_t mccdaq_callback(uint16_t * d, int32_t max_d, uint64_t sample_idx)
 {
     #define MAX_DATA 1000000
 
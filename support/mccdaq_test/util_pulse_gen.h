@@ -0,0 +1 @@
+../../util_pulse_gen.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../util_raw_capture.h
\ No newline at end of file
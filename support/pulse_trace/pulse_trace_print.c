@@ -0,0 +1,328 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+// render the pulses recorded in a get_data binary pulse trace file as ascii plots,
+// or print the distribution of the time between pulses, or print the average 
+// pulse shape as a template for the get_data matched filter
+//
+// usage: pulse_trace_print [-m min_height_mv] [-i] [-t len] file ...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include "util_pulse.h"
+#include "util_pulse_trace.h"
+#include "util_misc.h"
+
+//
+// variables
+//
+
+static int32_t min_height_mv = INT32_MIN;
+static bool    interarrival;
+
+static int64_t ia_last_time_ns = -1;
+static int64_t ia_hist[64];        // bin n: interarrival time 2^(n-1) .. 2^n-1 us
+static int64_t ia_count;
+
+static int32_t template_len;
+static double  template_sum[PULSE_RAW_LEN];
+static int64_t template_count;
+
+//
+// prototypes
+//
+
+static void usage(void);
+static int32_t print_file(char * filename);
+static void print_pulse(pulse_trace_rec_t * rec);
+static void print_plot_str(int32_t value, int32_t baseline);
+static void interarrival_add(pulse_trace_rec_t * rec);
+static void interarrival_print(void);
+static void template_add(pulse_trace_rec_t * rec);
+static void template_print(void);
+
+// -----------------  MAIN  ------------------------------------------------
+
+int32_t main(int argc, char ** argv)
+{
+    int32_t i, errors = 0;
+
+    // parse options
+    // -h          : help
+    // -m mv       : only print pulses at least this height
+    // -i          : print the interarrival time distribution, instead of the pulses
+    // -t len      : print the average pulse shape, len samples starting 1 sample before 
+    //               the pulse start, instead of the pulses
+    while (true) {
+        char opt_char = getopt(argc, argv, "hm:it:");
+        if (opt_char == -1) {
+            break;
+        }
+        switch (opt_char) {
+        case 'h':
+            usage();
+            return 0;
+        case 'm':
+            if (sscanf(optarg, "%d", &min_height_mv) != 1) {
+                ERROR("invalid '-m %s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i':
+            interarrival = true;
+            break;
+        case 't':
+            if (sscanf(optarg, "%d", &template_len) != 1 || 
+                template_len < 2 || template_len > PULSE_RAW_LEN - PULSE_WAVEFORM_LEN/2 + 1) 
+            {
+                ERROR("invalid '-t %s', range is 2 - %d\n", optarg, PULSE_RAW_LEN - PULSE_WAVEFORM_LEN/2 + 1);
+                return 1;
+            }
+            break;
+        default:
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        usage();
+        return 1;
+    }
+
+    // print the pulses in each file
+    for (i = optind; i < argc; i++) {
+        if (print_file(argv[i]) < 0) {
+            errors++;
+        }
+    }
+
+    // if interarrival option then print the distribution of the time between pulses
+    if (interarrival) {
+        interarrival_print();
+    }
+
+    // if template option then print the average pulse shape
+    if (template_len) {
+        template_print();
+    }
+    return errors ? 1 : 0;
+}
+
+static void usage(void)
+{
+    printf("\n"
+           "usage: pulse_trace_print [options] file ...\n"
+           "\n"
+           "   where options include:\n"
+           "       -h          : help\n"
+           "       -m mv       : only print pulses at least this height\n"
+           "       -i          : print the interarrival time distribution\n"
+           "       -t len      : print the average pulse shape, as a get_data matched filter template\n"
+           "\n"
+                    );
+}
+
+// -----------------  PRINT  -----------------------------------------------
+
+static int32_t print_file(char * filename)
+{
+    FILE            * fp;
+    pulse_trace_rec_t rec;
+    int64_t           cnt = 0;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        ERROR("open %s, %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        if (rec.magic != PULSE_TRACE_MAGIC || rec.raw_len != PULSE_RAW_LEN) {
+            ERROR("%s: invalid record %"PRId64", magic=0x%x raw_len=%d\n",
+                  filename, cnt, rec.magic, rec.raw_len);
+            fclose(fp);
+            return -1;
+        }
+        if (rec.height_mv >= min_height_mv) {
+            if (interarrival) {
+                interarrival_add(&rec);
+            } else if (template_len) {
+                template_add(&rec);
+            } else {
+                print_pulse(&rec);
+            }
+        }
+        cnt++;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+static void print_pulse(pulse_trace_rec_t * rec)
+{
+    int32_t i, first, last, baseline_mv;
+    char    time_str[100];
+
+    // plot the pulse, from 1 sample before the start to 4 samples after the end;
+    // pulses that are too long to fit in the raw data are truncated
+    first = PULSE_WAVEFORM_LEN/2 - 1;
+    last  = PULSE_WAVEFORM_LEN/2 + rec->length + 3;
+    if (last >= PULSE_RAW_LEN) {
+        last = PULSE_RAW_LEN - 1;
+    }
+    baseline_mv = (rec->baseline-2048)*10000/2048;
+    printf("PULSE:  %s   height_mv = %d   baseline_mv = %d   (%"PRId64",%d)\n",
+           time2str(time_str, rec->time_ns/1000, false, true, true),
+           rec->height_mv, baseline_mv, rec->start_idx, rec->length);
+    for (i = first; i <= last; i++) {
+        print_plot_str((rec->raw[i]-2048)*10000/2048, baseline_mv); 
+    }
+    printf("\n");
+}
+
+static void print_plot_str(int32_t value, int32_t baseline)
+{
+    char    str[110];
+    int32_t idx, i;
+
+    // args are in mv units
+
+    // value               : expected range 0 - 9995 mv
+    // baseline            : expected range 0 - 9995 mv
+    // idx = value / 100   : range  0 - 99            
+
+    if (value > 9995) {
+        printf("%5d: value is out of range\n", value);
+        return;
+    }
+    if (baseline < 0 || baseline > 9995) {
+        printf("%5d: baseline is out of range\n", baseline);
+        return;
+    }
+
+    if (value < 0) {
+        value = 0;
+    }
+
+    bzero(str, sizeof(str));
+
+    idx = value / 100;
+    for (i = 0; i <= idx; i++) {
+        str[i] = '*';
+    }
+
+    idx = baseline / 100;
+    if (str[idx] == '*') {
+        str[idx] = '+';
+    } else {
+        str[idx] = '|';
+        for (i = 0; i < idx; i++) {
+            if (str[i] == '\0') {
+                str[i] = ' ';
+            }
+        }
+    }
+
+    printf("%5d: %s\n", value, str);
+}
+
+// -----------------  INTERARRIVAL  ----------------------------------------
+
+// the pulse timestamps are derived from the sample index, so the time between
+// pulses is accurate to the 2 us sample period; files must be specified 
+// oldest first, a negative time between pulses is counted in bin 0
+
+static void interarrival_add(pulse_trace_rec_t * rec)
+{
+    int64_t us;
+    int32_t bin;
+
+    if (ia_last_time_ns != -1) {
+        us = (rec->time_ns - ia_last_time_ns) / 1000;
+        bin = (us <= 0 ? 0 : 64 - __builtin_clzll(us));
+        ia_hist[bin]++;
+        ia_count++;
+    }
+    ia_last_time_ns = rec->time_ns;
+}
+
+static void interarrival_print(void)
+{
+    int32_t bin, max_bin = 0;
+
+    for (bin = 0; bin < 64; bin++) {
+        if (ia_hist[bin]) {
+            max_bin = bin;
+        }
+    }
+
+    printf("INTERARRIVAL: %"PRId64" intervals\n", ia_count);
+    for (bin = 0; bin <= max_bin; bin++) {
+        printf("  %12"PRId64" - %12"PRId64" us : %10"PRId64"  %5.1f%%\n",
+               bin == 0 ? 0 : (1L << (bin-1)), 
+               bin == 0 ? 0 : (1L << bin) - 1,
+               ia_hist[bin],
+               ia_count ? 100. * ia_hist[bin] / ia_count : 0.);
+    }
+}
+
+// -----------------  TEMPLATE  --------------------------------------------
+
+// the average of the raw samples, less the baseline, of the pulses; the pulses
+// are aligned at their start; the output is used by the get_data '-f matched,file' 
+// filter option
+
+static void template_add(pulse_trace_rec_t * rec)
+{
+    int32_t i;
+
+    for (i = 0; i < template_len; i++) {
+        template_sum[i] += rec->raw[PULSE_WAVEFORM_LEN/2-1+i] - rec->baseline;
+    }
+    template_count++;
+}
+
+static void template_print(void)
+{
+    int32_t i;
+
+    if (template_count == 0) {
+        ERROR("no pulses\n");
+        return;
+    }
+
+    printf("# average of %"PRId64" pulses, adc counts above baseline\n", template_count);
+    for (i = 0; i < template_len; i++) {
+        printf("%0.2f\n", template_sum[i] / template_count);
+    }
+}
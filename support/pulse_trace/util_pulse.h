@@ -0,0 +1 @@
+../../util_pulse.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../util_pulse_trace.h
\ No newline at end of file
@@ -24,7 +24,6 @@ SOFTWARE.
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <stdarg.h>
 #include <stddef.h>
 #include <unistd.h>
 #include <string.h>
@@ -34,6 +33,7 @@ SOFTWARE.
 
 #include <termios.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <math.h>
 
@@ -47,20 +47,72 @@ SOFTWARE.
 //#define ENABLE_TEST_THREAD
 
 #define DATAQ_DEVICE   "/dev/serial/by-id/usb-0683_1490-if00"
-#define STTY_SETTINGS  "4:0:14b2:0:3:1c:7f:15:1:0:1:0:11:13:1a:0:12:f:17:16:0:0:0:0:0:0:0:0:0:0:0:0:0:0:0:0"
 #define MAX_RESP       100
+#define RESP_TIMEOUT_MS  1000
 #define MAX_ADC_CHAN   9            // channels 1 .. 8
 #define MAX_VAL        10000
+#define MAX_SCAN_RATE  10000        // adc values per second, summed over the channels scanned
+#define SRATE_CLOCK    750000       // the srate cmd divides this to set the scan rate
+
+// polyphase decimator, from the scan rate to each channel's rate; the low pass 
+// cutoff and transition band are fractions of the channel's rate, the transition
+// band sets the number of taps for the blackman window
+#define DECIMATE_CUTOFF      0.35
+#define DECIMATE_TRANSITION  0.30
+#define DECIMATE_MAX_L       64
+#define DECIMATE_MAX_TAPS    256    // per phase
+
+// the dataq scans at up to 10000 adc values per second, 2 bytes each; the 
+// receive ring holds about 0.8 secs of data, and each read is limited to 
+// about 100 ms of data so that the values are processed promptly
+#define MAX_RECV_BUFF  16384        // must be a power of 2
+#define MAX_RECV_READ  2048
+#define RECV_IDX(i)    ((i) & (MAX_RECV_BUFF-1))
+
+// number of consecutive scans with a valid sync pattern that are needed to resync
+#define RESYNC_SCANS   3
 
 //
 // typedefs
 //
 
+// sliding window min or max of the saved adc values; the deque contains the
+// counts of the saved values that can become the window's min (or max), in 
+// order, so the min (or max) is the value at the head
+typedef struct {
+    int64_t * n;
+    int64_t   head;
+    int64_t   tail;
+} mono_deque_t;
+
+// rational polyphase decimator, the output rate is the scan rate * l / m; this
+// is equivalent to upsampling by l, low pass filtering, and downsampling by m, 
+// but only the output values are computed, using one of the l phases of the filter
+typedef struct {
+    int32_t   l, m;
+    int32_t   taps;                // taps per phase
+    float   * coef;                // coef[p*taps+j] multiplies the j'th most recent scanned value
+    float   * hist;                // the most recent scanned values, twice, so they are contiguous
+    int32_t   hist_idx;            // index of the most recent scanned value in hist
+    int32_t   phase;
+} decimator_t;
+
+// sum, sum_squares, min and max are published to the readers using the seq count,
+// which is odd while they are being updated
 typedef struct {
     int16_t * val;   // millivolts
     int64_t   sum;
     int64_t   sum_squares;
+    int16_t   min;
+    int16_t   max;
+    uint32_t  seq;
     int32_t   idx;
+    int64_t   count;               // number of values saved
+    mono_deque_t min_dq;
+    mono_deque_t max_dq;
+    int32_t   rate_hz;             // rate of the values saved in val
+    int32_t   max_averaging_val;   // number of saved values in the averaging_duration
+    decimator_t dec;               // decimates the scanned values to rate_hz
 } adc_t;
 
 //
@@ -69,10 +121,18 @@ typedef struct {
 
 static int      dataq_fd = -1;
 static adc_t    adc[MAX_ADC_CHAN];
-static int32_t  max_averaging_val;
 static int64_t  scan_count;
+static int64_t  resync_count;
+static int64_t  resync_bytes_skipped;
+static int64_t  read_count;
+static bool     initialized;        // set when dataq_init has succeeded
 static bool     scan_okay;
+static bool     scan_checked;       // set when dataq_monitor_thread has first checked the scan rate
 static int32_t  scan_hz;
+static FILE   * capture_fp;
+static bool     capture_busy;       // dataq_recv_data_thread is using capture_fp
+static int64_t  capture_scans;
+static bool     capture_error;
 static int32_t  max_slist_idx; 
 static int32_t  slist_idx_to_adc_chan[8];
 static bool     exitting;
@@ -82,113 +142,95 @@ static bool     exitting;
 //
 
 static void dataq_exit_handler(void);
+static int32_t dataq_set_termios(int fd);
+static int32_t dataq_read_resp(char * buff, int32_t max_buff, char * suffix, int32_t timeout_ms);
 static int32_t dataq_issue_cmd(char * cmd, char * resp);
 static void * dataq_recv_data_thread(void * cx);
+static bool dataq_scan_synced(uint8_t * buff, uint32_t idx, int32_t scan_len);
 static void dataq_process_adc_raw(int32_t slist_idx, int32_t new_val);
+static int32_t dataq_decimator_init(decimator_t * d, int32_t srate_div, int32_t rate_hz);
+static bool dataq_decimator_process(decimator_t * d, float x, float * y);
+static int16_t dataq_mono_deque_add(mono_deque_t * dq, int16_t * val, int64_t n, int32_t window, int32_t sign);
 static void * dataq_monitor_thread(void * cx);
 
 // -----------------  DATAQ API ROUTINES  -----------------------------------------------
 
-int32_t dataq_init(float averaging_duration_sec, int32_t scan_hz_arg, int32_t max_adc_chan, ...)
+int32_t dataq_init(float averaging_duration_sec, int32_t max_chan, dataq_chan_t * chan)
 {
     char      cmd_str[500];
     char      resp[MAX_RESP];
-    int32_t   i, cnt, len, total_len, duration, ret, best_scan_hz;
-    char      adc_channels_str[100];
+    int32_t   i, cnt, len, srate_div;
+    char      adc_channels_str[500];
     char    * p;
-    char      stop_buff[10000];
+    char      stop_buff[1000];
     pthread_t thread_id;
-    va_list   ap;
 
-    // scan valist for adc channel numbers
-    max_slist_idx = max_adc_chan;
-    va_start(ap, max_adc_chan);
-    for (i = 0; i < max_slist_idx; i++) {
-        slist_idx_to_adc_chan[i] = va_arg(ap, int32_t);
+    // validate the number of channels, and the adc channel numbers and rates
+    if (max_chan < 1 || max_chan > 8) {
+        ERROR("max_chan %d is invalid\n", max_chan);
+        goto error;
     }
-    va_end(ap);
-
-    // validate adc channel numbers
+    max_slist_idx = max_chan;
     for (i = 0; i < max_slist_idx; i++) {
-        int32_t adc_chan = slist_idx_to_adc_chan[i];
-        if (adc_chan < 1 || adc_chan >= MAX_ADC_CHAN) {
+        int32_t adc_chan = chan[i].adc_chan;
+        if (adc_chan < 1 || adc_chan >= MAX_ADC_CHAN || adc[adc_chan].rate_hz != 0) {
             ERROR("adc_chan %d is invalid\n", adc_chan);
             goto error;
         }
+        if (chan[i].rate_hz <= 0) {
+            ERROR("adc_chan %d rate_hz %d is invalid\n", adc_chan, chan[i].rate_hz);
+            goto error;
+        }
+        slist_idx_to_adc_chan[i] = adc_chan;
+        adc[adc_chan].rate_hz = chan[i].rate_hz;
     }
 
-    // determine the best adc scan rate and 
-    // verify the requested rate is less <= best
-    best_scan_hz = 10000 / max_slist_idx;
-    if (scan_hz_arg > best_scan_hz) {   
-        ERROR("scan_hz_arg %d is too big, max is %d\n", scan_hz_arg, best_scan_hz);
-        goto error;
+    // determine the scan rate; this is the dataq's MAX_SCAN_RATE, divided among the
+    // channels; the scan rate is SRATE_CLOCK / srate_div
+    srate_div = (SRATE_CLOCK * max_slist_idx + MAX_SCAN_RATE - 1) / MAX_SCAN_RATE;
+    scan_hz = SRATE_CLOCK / srate_div;
+
+    // init the decimators, from the scan rate to each channel's rate
+    for (i = 0; i < max_slist_idx; i++) {
+        if (dataq_decimator_init(&adc[chan[i].adc_chan].dec, srate_div, chan[i].rate_hz) < 0) {
+            ERROR("adc_chan %d rate_hz %d is not supported, scan_hz=%d\n", 
+                  chan[i].adc_chan, chan[i].rate_hz, scan_hz);
+            goto error;
+        }
     }
-    scan_hz = scan_hz_arg;
 
     // debug print args
     p = adc_channels_str;
     for (i = 0; i < max_slist_idx; i++) {
-        cnt = sprintf(p, "%d ",  slist_idx_to_adc_chan[i]);
+        decimator_t * d = &adc[chan[i].adc_chan].dec;
+        cnt = sprintf(p, "%d:%d(%d/%d,%d) ",  
+                      chan[i].adc_chan, chan[i].rate_hz, d->l, d->m, d->taps);
         p += cnt;
     }
     INFO("averaging_duration_sec=%4.2f channels=%s scan_hz=%d\n",
-         averaging_duration_sec, adc_channels_str, scan_hz_arg);
-
-    // setup serial port
-    // - LATER perhaps use termios tcsetattr instead
-    // - I first ran this program on Fedora20, and had no problem
-    //   communicating to the dataq. When first run on RaspberryPi the
-    //   comm to dataq failed. To resolve this I captured the stty settings
-    //   on Fedora (stty -g) and apply them here.
-    sprintf(cmd_str, "stty -F %s %s\n", DATAQ_DEVICE, STTY_SETTINGS);
-    system(cmd_str);
-
-    // open the dataq virtual com port
-    dataq_fd = open(DATAQ_DEVICE, O_RDWR);
+         averaging_duration_sec, adc_channels_str, scan_hz);
+
+    // open the dataq virtual com port, and configure the serial port
+    dataq_fd = open(DATAQ_DEVICE, O_RDWR | O_NOCTTY);
     if (dataq_fd < 0) {
         ERROR("failed to open %s, %s\n", DATAQ_DEVICE, strerror(errno));
         goto error;
     }
+    if (dataq_set_termios(dataq_fd) < 0) {
+        goto error;
+    }
 
     // cleanup from prior run:
     // - issue 'stop' scanning command
-    // - set non blocking
-    // - read until get the response to the stop command
-    // - clear non blocking
+    // - read until get the response to the stop command, this discards the
+    //   scan data that may be received ahead of the response
     len = write(dataq_fd, "stop\r", 5);
     if (len != 5) {
         ERROR("failed to write stop cmd, %s\n", strerror(errno));
         goto error;
     }
-
-    ret = fcntl(dataq_fd, F_SETFL, O_NONBLOCK);
-    if (ret < 0) {
-        ERROR("failed to set non blocking, %s\n", strerror(errno));
-        goto error;
-    }
-
-    total_len = 0;
-    duration = 0;
-    while (true) {
-        usleep(100000);
-        len = read(dataq_fd, stop_buff+total_len, sizeof(stop_buff)-total_len);
-        if (len > 0) {
-            total_len += len;
-            if (total_len >= 5 && strcmp(&stop_buff[total_len-5], "stop\r") == 0) {
-                break;
-            }
-        }
-        duration += 100000;
-        if (duration >= 1000000) {
-            ERROR("did not receive response to stop scanning cmd");
-            goto error;
-        }
-    }        
-
-    ret = fcntl(dataq_fd, F_SETFL, 0);
-    if (ret < 0) {
-        ERROR("failed to clear non blocking, %s\n", strerror(errno));
+    if (dataq_read_resp(stop_buff, sizeof(stop_buff), "stop\r", RESP_TIMEOUT_MS) < 0) {
+        ERROR("did not receive response to stop scanning cmd\n");
         goto error;
     }
 
@@ -210,24 +252,30 @@ int32_t dataq_init(float averaging_duration_sec, int32_t scan_hz_arg, int32_t ma
     }
 
     // set the scan rate; 
-    sprintf(cmd_str, "srate x%4.4x", 750000 / scan_hz);
+    sprintf(cmd_str, "srate x%4.4x", srate_div);
     if (dataq_issue_cmd(cmd_str, resp) < 0) {
         goto error;
     }
 
-    // determine the number of adc values that are needed for the averaging_duration,
-    max_averaging_val = scan_hz * averaging_duration_sec;
-    INFO("MAX_VAL=%d  max_averaging_val=%d\n", MAX_VAL, max_averaging_val);
-    if (max_averaging_val > MAX_VAL) {
-        ERROR("averaging_duration_sec %.3f is too large\n", averaging_duration_sec);
-        goto error;
+    // determine the number of saved adc values that are needed for the averaging_duration,
+    for (i = 0; i < max_slist_idx; i++) {
+        adc_t * x = &adc[slist_idx_to_adc_chan[i]];
+        x->max_averaging_val = x->rate_hz * averaging_duration_sec;
+        INFO("adc_chan=%d MAX_VAL=%d  max_averaging_val=%d\n", 
+             slist_idx_to_adc_chan[i], MAX_VAL, x->max_averaging_val);
+        if (x->max_averaging_val < 1 || x->max_averaging_val > MAX_VAL) {
+            ERROR("averaging_duration_sec %.3f is invalid\n", averaging_duration_sec);
+            goto error;
+        }
     }
 
     // allocate memory for adc values
     for (i = 0; i < max_slist_idx; i++) {
         int32_t adc_chan = slist_idx_to_adc_chan[i];
         adc[adc_chan].val = calloc(MAX_VAL, sizeof(int16_t));
-        if (adc[adc_chan].val == NULL) {
+        adc[adc_chan].min_dq.n = calloc(MAX_VAL, sizeof(int64_t));
+        adc[adc_chan].max_dq.n = calloc(MAX_VAL, sizeof(int64_t));
+        if (adc[adc_chan].val == NULL || adc[adc_chan].min_dq.n == NULL || adc[adc_chan].max_dq.n == NULL) {
             FATAL("alloc adc[%d].val failed, MAX_VAL=%d\n", adc_chan, MAX_VAL);
         }
     }
@@ -249,8 +297,10 @@ int32_t dataq_init(float averaging_duration_sec, int32_t scan_hz_arg, int32_t ma
     pthread_create(&thread_id, NULL, dataq_recv_data_thread, NULL);
     pthread_create(&thread_id, NULL, dataq_monitor_thread, NULL);
 
-    // delay to allow adc data to be available
-    usleep(averaging_duration_sec*1000000 + 250000);
+    // the adc values are available, from dataq_get_adc and dataq_get_adc_data,
+    // once the averaging_duration of values have been received and the scan 
+    // rate has been checked; the caller does not wait for this
+    __atomic_store_n(&initialized, true, __ATOMIC_RELEASE);
 
     // return success,
     INFO("success\n");
@@ -270,10 +320,13 @@ int32_t dataq_get_adc(int32_t adc_chan,
                       int16_t * mean_mv, int16_t * sdev_mv,
                       int16_t * min_mv, int16_t * max_mv)
 {
-    adc_t * x;
+    adc_t  * x;
+    int64_t  sum, sum_squares;
+    int16_t  min, max;
+    uint32_t seq;
 
     // if not inititialized then return error
-    if (dataq_fd < 0) {
+    if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE)) {
         return -1;
     }
 
@@ -284,64 +337,118 @@ int32_t dataq_get_adc(int32_t adc_chan,
     }
     x = &adc[adc_chan];
 
+    // if the adc values are not yet available then return error
+    if (!scan_checked || __atomic_load_n(&x->count, __ATOMIC_RELAXED) < x->max_averaging_val) {
+        return -1;
+    }
+
     // if dataq scan is not working then return error
     if (!scan_okay) {
         ERROR("adc data not available\n");
         return -1;
     }
 
+    // get a consistent snapshot of the sums, and min and max; retry if the
+    // dataq_recv_data_thread updated them during the copy
+    do {
+        seq = __atomic_load_n(&x->seq, __ATOMIC_ACQUIRE);
+        sum         = __atomic_load_n(&x->sum, __ATOMIC_RELAXED);
+        sum_squares = __atomic_load_n(&x->sum_squares, __ATOMIC_RELAXED);
+        min         = __atomic_load_n(&x->min, __ATOMIC_RELAXED);
+        max         = __atomic_load_n(&x->max, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&x->seq, __ATOMIC_RELAXED));
+
     // calculate rms 
     if (rms_mv) {
-        *rms_mv = sqrtf((float)x->sum_squares / max_averaging_val);
+        *rms_mv = sqrtf((float)sum_squares / x->max_averaging_val);
     }
 
     // calculate mean voltage
     if (mean_mv) {
-        *mean_mv = x->sum / max_averaging_val;
+        *mean_mv = sum / x->max_averaging_val;
     }
 
     // calculate standad deviation voltage
     if (sdev_mv) {
-        float u = (float)x->sum / max_averaging_val;
-        *sdev_mv = sqrtf(((float)x->sum_squares / max_averaging_val) - (u * u));
-    }
-
-    // calculate min and max voltages
-    // note - idx refers to invalid/oldest entry in circ buffer
-    if (min_mv || max_mv) {
-        int32_t i, j;
-        int16_t min = +32767;
-        int16_t max = -32767;
-
-        i = x->idx - max_averaging_val;
-        if (i < 0) i += MAX_VAL;
-        for (j = 0; j < max_averaging_val; j++) {
-            if (x->val[i] < min) min = x->val[i];
-            if (x->val[i] > max) max = x->val[i];
-            if (++i == MAX_VAL) {
-                i = 0;
-            }
-        }
+        float u = (float)sum / x->max_averaging_val;
+        *sdev_mv = sqrtf(((float)sum_squares / x->max_averaging_val) - (u * u));
+    }
 
-        if (min_mv) {
-            *min_mv = min;
-        }
-        if (max_mv) {
-            *max_mv = max;
-        }
+    // return min and max voltages
+    if (min_mv) {
+        *min_mv = min;
+    }
+    if (max_mv) {
+        *max_mv = max;
     }
 
     // return success
     return 0;
 }
 
+int32_t dataq_capture_init(char * filename)
+{
+    dataq_capture_hdr_t hdr;
+    FILE * fp;
+    int32_t i;
+
+    // if not inititialized then return error
+    if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE)) {
+        ERROR("not initialized\n");
+        return -1;
+    }
+
+    // create the capture file, and write the header
+    fp = fopen(filename, "w");
+    if (fp == NULL) {
+        ERROR("failed to create %s, %s\n", filename, strerror(errno));
+        return -1;
+    }
+    setvbuf(fp, NULL, _IOFBF, 256*1024);
+    bzero(&hdr, sizeof(hdr));
+    hdr.magic = DATAQ_CAPTURE_MAGIC;
+    hdr.max_chan = max_slist_idx;
+    for (i = 0; i < max_slist_idx; i++) {
+        hdr.adc_chan[i] = slist_idx_to_adc_chan[i];
+    }
+    hdr.scan_hz = scan_hz;
+    hdr.start_time_us = get_real_time_us();
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        ERROR("failed to write %s, %s\n", filename, strerror(errno));
+        fclose(fp);
+        return -1;
+    }
+
+    // enable the capture, in dataq_recv_data_thread
+    __atomic_store_n(&capture_fp, fp, __ATOMIC_RELEASE);
+    INFO("capturing the dataq scans to %s\n", filename);
+    return 0;
+}
+
+int32_t dataq_get_stats(dataq_stats_t * stats)
+{
+    // if not inititialized then return error
+    if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    // return the receive statistics, since dataq_init
+    stats->scan_count           = scan_count;
+    stats->resync_count         = resync_count;
+    stats->resync_bytes_skipped = resync_bytes_skipped;
+    stats->read_count           = read_count;
+    stats->capture_scans        = capture_scans;
+    return 0;
+}
+
 int32_t dataq_get_adc_data(int32_t adc_chan, int16_t * samples_mv, int32_t count)
 {
     adc_t * x;
     int32_t i, j;
 
     // if not inititialized then return error
-    if (dataq_fd < 0) {
+    if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE)) {
         return -1;
     }
 
@@ -352,20 +459,26 @@ int32_t dataq_get_adc_data(int32_t adc_chan, int16_t * samples_mv, int32_t count
     }
     x = &adc[adc_chan];
 
-    // if dataq scan is not working then return error
-    if (!scan_okay) {
-        ERROR("adc data not available\n");
-        return -1;
-    }
-
     // if count is invalid then return error
     if (count <= 0 || count > MAX_VAL-5) {
         ERROR("count %d too big, max count is %d\n", count, MAX_VAL-5);
         return -1;
     }
 
-    // fill samples_mv return buffer
-    i = x->idx - count;
+    // if the adc values are not yet available then return error
+    if (!scan_checked || __atomic_load_n(&x->count, __ATOMIC_RELAXED) < count) {
+        return -1;
+    }
+
+    // if dataq scan is not working then return error
+    if (!scan_okay) {
+        ERROR("adc data not available\n");
+        return -1;
+    }
+
+    // fill samples_mv return buffer; the values preceding idx are not 
+    // overwritten until the ring wraps, which takes many seconds
+    i = __atomic_load_n(&x->idx, __ATOMIC_ACQUIRE) - count;
     if (i < 0) i += MAX_VAL;
     for (j = 0; j < count; j++) {
         samples_mv[j] = x->val[i];
@@ -382,7 +495,8 @@ int32_t dataq_get_adc_data(int32_t adc_chan, int16_t * samples_mv, int32_t count
 
 static void dataq_exit_handler()
 {
-    int32_t len;
+    int32_t len, i;
+    FILE  * fp;
 
     // if not inititialized then return 
     if (dataq_fd < 0) {
@@ -402,16 +516,100 @@ static void dataq_exit_handler()
     // the threads to exit
     usleep(100000);
 
+    // disable the capture, and wait for dataq_recv_data_thread to finish writing
+    // the scan that it may be capturing; then flush and close the capture file
+    fp = __atomic_exchange_n(&capture_fp, NULL, __ATOMIC_SEQ_CST);
+    if (fp != NULL) {
+        for (i = 0; i < 1000 && __atomic_load_n(&capture_busy, __ATOMIC_SEQ_CST); i++) {
+            usleep(1000);
+        }
+        if (i < 1000) {
+            fclose(fp);
+        } else {
+            WARN("dataq capture still being written, not closed\n");
+        }
+    }
+
     // close
     close(dataq_fd);
 }
 
+// configures the serial port for raw 8 bit data at 115200 baud; these are the settings
+// that were originally applied with 'stty -F <dev> 4:0:14b2:0:3:1c:7f:15:1:0:1:0:...', 
+// captured on Fedora (stty -g), because the RaspberryPi defaults did not work
+static int32_t dataq_set_termios(int fd)
+{
+    struct termios t;
+
+    if (tcgetattr(fd, &t) < 0) {
+        ERROR("tcgetattr failed, %s\n", strerror(errno));
+        return -1;
+    }
+    t.c_iflag = IGNPAR;
+    t.c_oflag = 0;
+    t.c_cflag = CS8 | CREAD | HUPCL;
+    t.c_lflag = 0;
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    cfsetispeed(&t, B115200);
+    cfsetospeed(&t, B115200);
+    if (tcsetattr(fd, TCSANOW, &t) < 0) {
+        ERROR("tcsetattr failed, %s\n", strerror(errno));
+        return -1;
+    }
+    tcflush(fd, TCIFLUSH);
+    return 0;
+}
+
+// reads from the dataq until the data received ends with suffix, waiting up to
+// timeout_ms; when buff is full the older data is discarded; returns the length 
+// of the data in buff, or -1 on error or timeout
+static int32_t dataq_read_resp(char * buff, int32_t max_buff, char * suffix, int32_t timeout_ms)
+{
+    int32_t       len, total_len = 0, suffix_len = strlen(suffix), ret;
+    uint64_t      end_us = microsec_timer() + timeout_ms * 1000L, now_us;
+    struct pollfd pfd;
+
+    while (true) {
+        // wait for data to be available to read
+        now_us = microsec_timer();
+        if (now_us >= end_us) {
+            return -1;
+        }
+        pfd.fd = dataq_fd;
+        pfd.events = POLLIN;
+        ret = poll(&pfd, 1, (end_us - now_us + 999) / 1000);
+        if (ret < 0 && errno != EINTR) {
+            ERROR("poll failed, %s\n", strerror(errno));
+            return -1;
+        }
+        if (ret <= 0) {
+            continue;
+        }
+
+        // read the available data; if buff is full then keep only its end
+        if (total_len == max_buff) {
+            memmove(buff, buff+max_buff-suffix_len, suffix_len);
+            total_len = suffix_len;
+        }
+        len = read(dataq_fd, buff+total_len, max_buff-total_len);
+        if (len <= 0) {
+            ERROR("failed read, len=%d, %s\n", len, strerror(errno));
+            return -1;
+        }
+        total_len += len;
+
+        // if the data received ends with suffix then return
+        if (total_len >= suffix_len && memcmp(buff+total_len-suffix_len, suffix, suffix_len) == 0) {
+            return total_len;
+        }
+    }
+}
+
 static int32_t dataq_issue_cmd(char * cmd, char * resp)
 {
     char cmd2[100];
-    int32_t len, ret, total_len, i;
-    char *p;
-    bool resp_recvd;
+    int32_t len;
 
     // terminate command with <cr>
     strcpy(cmd2, cmd);
@@ -424,51 +622,13 @@ static int32_t dataq_issue_cmd(char * cmd, char * resp)
         return -1;
     }
 
-    // set non blocking
-    ret = fcntl(dataq_fd, F_SETFL, O_NONBLOCK);
-    if (ret < 0) {
-        ERROR("failed to set non blocking, %s\n", strerror(errno));
-        return -1;
-    }
-
     // read response, must terminate with <cr>, with 1 sec tout
-    p = resp;
-    total_len = 0;
-    resp_recvd = false;
-    for (i = 0; i < 200; i++) {
-        len = read(dataq_fd, p, MAX_RESP-total_len);
-        if (len > 0) {
-            total_len += len;
-            p += len;
-            if (resp[total_len-1] == '\r') {
-                resp[total_len-1] = '\0';   // remove <cr>, and null term
-                total_len--;
-                resp_recvd = true;
-                break;
-            }
-        } else if (len == -1 && errno == EWOULDBLOCK) {
-            // nothing to do here
-        } else if (len == 0) {
-            // nothing to do here
-        } else {
-            ERROR("failed read, len=%d, %s\n", len, strerror(errno));
-            return -1;
-        }
-        usleep(5000);
-    }
-
-    // clear non blocking
-    ret = fcntl(dataq_fd, F_SETFL, 0);
-    if (ret < 0) {
-        ERROR("failed to clear non blocking, %s\n", strerror(errno));
-        return -1;
-    }
-
-    // check for failure to read response
-    if (!resp_recvd) {
+    len = dataq_read_resp(resp, MAX_RESP-1, "\r", RESP_TIMEOUT_MS);
+    if (len < 0) {
         ERROR("response to cmd '%s' was not received\n", cmd);
         return -1;
     }
+    resp[len-1] = '\0';   // remove <cr>, and null term
 
     // check that response received was correct, it should match the cmd
     if (strncmp(cmd, resp, strlen(cmd)) != 0) {
@@ -481,67 +641,142 @@ static int32_t dataq_issue_cmd(char * cmd, char * resp)
     return 0;
 }
 
+// The binary scan data is a sequence of scans, each has 2 bytes per adc channel in
+// the scan list. Bit 0 of the first byte of a scan is 0, and bit 0 of all other 
+// bytes is 1; this is the sync pattern. The data is read into a ring buffer, and 
+// is parsed in place, using the rd_idx and wr_idx cursors, which are not wrapped.
+// If the sync pattern is not found then bytes are skipped until RESYNC_SCANS 
+// consecutive scans have the sync pattern. The scan data is preceded by the
+// response to the start command; if this is not received then the thread 
+// starts by resyncing.
 static void * dataq_recv_data_thread(void * cx)
 {
-    uint8_t buff[1000];
-    uint8_t *p;
-    int32_t len, buff_len, slist_idx; 
+    static uint8_t buff[MAX_RECV_BUFF];
+    uint32_t rd_idx, wr_idx, avail, i;
+    int32_t  len, scan_len, slist_idx, skipped;
+    bool     synced, start_resp_checked;
+    int16_t  scan_mv[8];
+    FILE   * fp;
 
     // init
-    bzero(buff, sizeof(buff));
-    buff_len = 0;
-
-    // verify start response received
-    len = read(dataq_fd, buff, 6);
-    if (len != 6 || memcmp(buff, "start\r", 6) != 0) {
-        ERROR("failed receive response to start, len=%d, %s\n", len, strerror(errno));
-        return NULL;
-    }
+    scan_len = max_slist_idx * 2;
+    rd_idx = wr_idx = 0;
+    synced = true;
+    start_resp_checked = false;
+    skipped = 0;
 
     // loop, read and process adc data
     while (true) {
-        // read adc data from dataq device into buff
-        len = read(dataq_fd, buff+buff_len, sizeof(buff)-buff_len);
+        // read adc data from dataq device into the ring buff; the read is limited
+        // to the contiguous free space at wr_idx
+        len = MAX_RECV_BUFF - (wr_idx - rd_idx);
+        if (len > MAX_RECV_BUFF - RECV_IDX(wr_idx)) {
+            len = MAX_RECV_BUFF - RECV_IDX(wr_idx);
+        }
+        if (len > MAX_RECV_READ) {
+            len = MAX_RECV_READ;
+        }
+        len = read(dataq_fd, buff+RECV_IDX(wr_idx), len);
         if (len < 0) {
             ERROR("failed to read adc data, %s\n", strerror(errno));
             return NULL;
         }
-        buff_len += len;
+        wr_idx += len;
+        read_count++;
 
         // if program is exitting then terminate this thread
         if (exitting) {
             return NULL;
         }
 
-        // while there is enough data read for all sensors being scanned,
-        // and to validate sync then extract adc values
-        while (buff_len >= max_slist_idx*2+1) {
-            // if not sychronized then abort for now
-            // LATER improve this to resync, if needed
-            if (((buff[0] & 1) != 0) || ((buff[max_slist_idx*2] & 1) != 0)) {
-                ERROR("not synced\n");
-                return NULL;
+        while (true) {
+            avail = wr_idx - rd_idx;
+
+            // the first bytes received should be the response to the start command, 
+            // which may arrive over several reads; if they are not then resync;
+            // rd_idx is 0, so the response is contiguous in buff
+            if (!start_resp_checked) {
+                if (avail < 6) {
+                    break;
+                }
+                if (memcmp(buff, "start\r", 6) == 0) {
+                    rd_idx += 6;
+                } else {
+                    WARN("response to start not received, resyncing\n");
+                    synced = false;
+                }
+                start_resp_checked = true;
+                continue;
+            }
+
+            // if not synchronized then skip bytes until RESYNC_SCANS consecutive scans,
+            // and the start of the following scan, have the sync pattern
+            if (!synced) {
+                if (avail < RESYNC_SCANS*scan_len+1) {
+                    break;
+                }
+                for (i = 0; i < RESYNC_SCANS; i++) {
+                    if (!dataq_scan_synced(buff, rd_idx+i*scan_len, scan_len)) {
+                        break;
+                    }
+                }
+                if (i < RESYNC_SCANS) {
+                    rd_idx++;
+                    skipped++;
+                    continue;
+                }
+                synced = true;
+                resync_count++;
+                resync_bytes_skipped += skipped;
+                INFO("resynced, skipped %d bytes, resync_count=%"PRId64"\n", skipped, resync_count);
+                skipped = 0;
+            }
+
+            // there must be enough data for all adc channels being scanned, and
+            // the start of the next scan, to validate sync
+            if (avail < scan_len+1) {
+                break;
+            }
+            if (!dataq_scan_synced(buff, rd_idx, scan_len)) {
+                WARN("not synced, resyncing\n");
+                synced = false;
+                continue;
             }
 
             // extract adc values from buff
-            p = buff;
             for (slist_idx = 0; slist_idx < max_slist_idx; slist_idx++) {
+                uint8_t b0 = buff[RECV_IDX(rd_idx)];
+                uint8_t b1 = buff[RECV_IDX(rd_idx+1)];
                 int32_t new_val;
     
-                new_val = ((p[1] & 0xfe) << 4) | (p[0] >> 3);
+                new_val = ((b1 & 0xfe) << 4) | (b0 >> 3);
                 new_val ^= 0x800;
                 if (new_val & 0x800) {
                     new_val |= 0xfffff000;
                 }
 
                 dataq_process_adc_raw(slist_idx, new_val);
+                scan_mv[slist_idx] = new_val * 10000 / 2048;
 
-                p += 2;
+                rd_idx += 2;
             }
 
-            // shift buff, and adjust buff_len
-            memmove(buff, buff+(max_slist_idx*2), buff_len-(max_slist_idx*2));
-            buff_len -= (max_slist_idx*2);
+            // if enabled, capture the scan's adc values; the capture stops on error;
+            // capture_busy is set while fp is in use, so that dataq_exit_handler,
+            // which clears capture_fp, does not close the file during the fwrite
+            if (!capture_error) {
+                __atomic_store_n(&capture_busy, true, __ATOMIC_SEQ_CST);
+                fp = __atomic_load_n(&capture_fp, __ATOMIC_SEQ_CST);
+                if (fp != NULL) {
+                    if (fwrite(scan_mv, sizeof(int16_t), max_slist_idx, fp) != max_slist_idx) {
+                        ERROR("failed to write dataq capture, %s\n", strerror(errno));
+                        capture_error = true;
+                    } else {
+                        capture_scans++;
+                    }
+                }
+                __atomic_store_n(&capture_busy, false, __ATOMIC_RELEASE);
+            }
 
             // bump up scan_count, which is used by the dataq_monitor_thread to
             // determine if scanning is working 
@@ -552,30 +787,180 @@ static void * dataq_recv_data_thread(void * cx)
     return NULL;
 }
 
+// returns true if the scan at idx, and the first byte of the next scan, have the sync pattern
+static bool dataq_scan_synced(uint8_t * buff, uint32_t idx, int32_t scan_len)
+{
+    int32_t i;
+
+    if ((buff[RECV_IDX(idx)] & 1) != 0 || (buff[RECV_IDX(idx+scan_len)] & 1) != 0) {
+        return false;
+    }
+    for (i = 1; i < scan_len; i++) {
+        if ((buff[RECV_IDX(idx+i)] & 1) != 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void dataq_process_adc_raw(int32_t slist_idx, int32_t new_val)
 {
     int32_t new_mv, old_mv;
     int32_t adc_chan = slist_idx_to_adc_chan[slist_idx];
     int32_t tmp;
     adc_t * x = &adc[adc_chan];
+    float   y;
+
+    // low pass filter and decimate the scanned values to the channel's rate,
+    // return if there is no value to save
+    if (!dataq_decimator_process(&x->dec, new_val, &y)) {
+        return;
+    }
     
-    // convert new_val from raw to new_mv
+    // convert the decimated value from raw to new_mv
     // note: a raw value of 2048 is equivalent to 10 v or 10000 mv
-    new_mv = new_val * 10000 / 2048;
+    new_mv = lrintf(y * (10000.f / 2048));
 
     // save adc value in circular buffer
-    tmp = x->idx - max_averaging_val;
+    tmp = x->idx - x->max_averaging_val;
     if (tmp < 0) {
         tmp += MAX_VAL;
     }
     old_mv = x->val[tmp];
     x->val[x->idx] = new_mv;
-    x->idx = (x->idx + 1) % MAX_VAL;
+    __atomic_store_n(&x->idx, (x->idx + 1) % MAX_VAL, __ATOMIC_RELEASE);
+
+    // update the sum of saved values, the sum^2 of saved values, and the min
+    // and max of the saved values in the averaging window; these are 
+    // updated while the seq count is odd
+    __atomic_store_n(&x->seq, x->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&x->sum, x->sum + (new_mv - old_mv), __ATOMIC_RELAXED);
+    __atomic_store_n(&x->sum_squares, x->sum_squares + (new_mv*new_mv - old_mv*old_mv), __ATOMIC_RELAXED);
+    __atomic_store_n(&x->min, 
+                     dataq_mono_deque_add(&x->min_dq, x->val, x->count, x->max_averaging_val, -1),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&x->max,
+                     dataq_mono_deque_add(&x->max_dq, x->val, x->count, x->max_averaging_val, +1),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&x->seq, x->seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&x->count, x->count + 1, __ATOMIC_RELAXED);
+}
+
+// adds saved value n to the deque, and returns the max (sign=+1) or min (sign=-1)
+// of the values in the window that ends with value n; each value is added and 
+// removed once, so the cost is constant when averaged over the values
+static int16_t dataq_mono_deque_add(mono_deque_t * dq, int16_t * val, int64_t n, int32_t window, int32_t sign)
+{
+    int32_t new_mv = val[n % MAX_VAL];
+
+    // remove the value at the head if it is no longer in the window; this is
+    // done before value n is added, so that the deque holds at most window 
+    // values, and window can be as large as MAX_VAL
+    if (dq->tail > dq->head && dq->n[dq->head % MAX_VAL] <= n - window) {
+        dq->head++;
+    }
+
+    // remove values from the tail that can no longer be the max (or min) of the
+    // window, because value n is at least as large (or as small) and is newer
+    while (dq->tail > dq->head && 
+           sign * (val[dq->n[(dq->tail-1) % MAX_VAL] % MAX_VAL] - new_mv) <= 0) 
+    {
+        dq->tail--;
+    }
+    dq->n[dq->tail % MAX_VAL] = n;
+    dq->tail++;
+
+    // the value at the head is the max (or min)
+    return val[dq->n[dq->head % MAX_VAL] % MAX_VAL];
+}
+
+// inits the decimator from the scan rate, SRATE_CLOCK / srate_div, to rate_hz; 
+// the prototype low pass filter is a blackman windowed sinc at the upsampled rate,
+// its length is the number of phases (l) times the taps per phase
+static int32_t dataq_decimator_init(decimator_t * d, int32_t srate_div, int32_t rate_hz)
+{
+    int64_t a, b, tmp;
+    int32_t n, i, p, j;
+    double  fc, t, w, sum, * h;
+
+    // the output rate is SRATE_CLOCK / srate_div * l / m, reduce l / m
+    a = (int64_t)rate_hz * srate_div;
+    b = SRATE_CLOCK;
+    while (b != 0) {
+        tmp = a % b;
+        a = b;
+        b = tmp;
+    }
+    d->l = (int64_t)rate_hz * srate_div / a;
+    d->m = SRATE_CLOCK / a;
+    if (d->l > d->m || d->l > DECIMATE_MAX_L) {
+        return -1;
+    }
 
-    // update the sum of saved values, and
-    // the sum^2 of saved values
-    x->sum += (new_mv - old_mv);
-    x->sum_squares += (new_mv*new_mv - old_mv*old_mv);
+    // the transition band, as a fraction of the scan rate, is
+    //   DECIMATE_TRANSITION * l / m; and is about 5.5 / taps for the blackman window
+    d->taps = ceil(5.5 * d->m / (DECIMATE_TRANSITION * d->l));
+    if (d->taps > DECIMATE_MAX_TAPS) {
+        return -1;
+    }
+
+    // design the prototype filter, with cutoff fc as a fraction of the upsampled rate,
+    // and scale for unity gain at dc of each phase
+    n = d->l * d->taps;
+    fc = DECIMATE_CUTOFF / d->m;
+    h = calloc(n, sizeof(double));
+    d->coef = calloc(n, sizeof(float));
+    d->hist = calloc(2 * d->taps, sizeof(float));
+    if (h == NULL || d->coef == NULL || d->hist == NULL) {
+        FATAL("alloc decimator failed, n=%d\n", n);
+    }
+    sum = 0;
+    for (i = 0; i < n; i++) {
+        t = i - (n - 1) / 2.;
+        w = 0.42 - 0.5 * cos(2 * M_PI * i / (n - 1)) + 0.08 * cos(4 * M_PI * i / (n - 1));
+        h[i] = (t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t)) * w;
+        sum += h[i];
+    }
+    for (p = 0; p < d->l; p++) {
+        for (j = 0; j < d->taps; j++) {
+            d->coef[p * d->taps + j] = h[p + j * d->l] * d->l / sum;
+        }
+    }
+    free(h);
+
+    d->hist_idx = 0;
+    d->phase = 0;
+    return 0;
+}
+
+// adds scanned value x to the decimator; returns true when an output value, y, 
+// is produced; because l <= m there is at most one output for each input
+static bool dataq_decimator_process(decimator_t * d, float x, float * y)
+{
+    float * coef, * hist, sum;
+    int32_t j;
+    bool    ret = false;
+
+    // save x in the history, the most recent values are at hist_idx in newest first order
+    d->hist_idx = (d->hist_idx == 0 ? d->taps - 1 : d->hist_idx - 1);
+    d->hist[d->hist_idx] = x;
+    d->hist[d->hist_idx + d->taps] = x;
+
+    // the output values that fall in this input's interval use the filter phase
+    if (d->phase < d->l) {
+        coef = d->coef + d->phase * d->taps;
+        hist = d->hist + d->hist_idx;
+        sum = 0;
+        for (j = 0; j < d->taps; j++) {
+            sum += coef[j] * hist[j];
+        }
+        *y = sum;
+        ret = true;
+        d->phase += d->m;
+    }
+    d->phase -= d->l;
+    return ret;
 }
 
 static void * dataq_monitor_thread(void * cx)
@@ -619,6 +1004,7 @@ static void * dataq_monitor_thread(void * cx)
             }
             scan_okay = false;
         }
+        scan_checked = true;
     }
 
     return NULL;
@@ -23,7 +23,35 @@ SOFTWARE.
 #ifndef __UTIL_DATAQ_H__
 #define __UTIL_DATAQ_H__
 
-int32_t dataq_init(float averaging_duration_sec, int32_t scan_hz, int32_t max_adc_chan, ...);
+typedef struct {
+    int64_t scan_count;            // scans received
+    int64_t resync_count;          // times the scan data was resynchronized
+    int64_t resync_bytes_skipped;  // bytes skipped while resynchronizing
+    int64_t read_count;            // reads of the dataq device
+    int64_t capture_scans;         // scans written to the capture file
+} dataq_stats_t;
+
+// the capture file is this header, followed by the scans at the scan rate; 
+// each scan is an int16_t value in mv for each channel, in adc_chan order
+#define DATAQ_CAPTURE_MAGIC  0x31514144   // "DAQ1"
+
+typedef struct {
+    uint32_t magic;
+    int32_t  max_chan;
+    int32_t  adc_chan[8];
+    int32_t  scan_hz;
+    int32_t  reserved;
+    uint64_t start_time_us;        // realtime when the capture started
+} dataq_capture_hdr_t;
+
+typedef struct {
+    int32_t adc_chan;              // 1 .. 8
+    int32_t rate_hz;               // rate of the values saved for the channel
+} dataq_chan_t;
+
+// the channels are scanned at the highest rate supported by the dataq, and each
+// channel's scanned values are low pass filtered and decimated to the channel's rate
+int32_t dataq_init(float averaging_duration_sec, int32_t max_chan, dataq_chan_t * chan);
 
 int32_t dataq_get_adc(int32_t adc_chan,
                       int16_t * rms_mv,
@@ -32,4 +60,8 @@ int32_t dataq_get_adc(int32_t adc_chan,
 
 int32_t dataq_get_adc_data(int32_t adc_chan, int16_t * samples_mv, int32_t count);
 
+int32_t dataq_get_stats(dataq_stats_t * stats);
+
+int32_t dataq_capture_init(char * filename);
+
 #endif
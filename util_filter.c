@@ -0,0 +1,314 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+
+#include "util_filter.h"
+#include "util_misc.h"
+
+// NOTES:
+//
+// The filter spec is one of:
+// - none
+// - ma,n            : moving average of n samples
+// - trap,k,m        : trapezoidal shaper, rise k samples, flat top m samples
+// - matched,file    : matched filter, the file contains the pulse template; this
+//                     is the pulse samples with the baseline subtracted, separated
+//                     by white space, lines starting with '#' are ignored;
+//                     support/pulse_trace/pulse_trace_print -t creates a template
+//                     from the pulses recorded in a pulse trace file
+// - crrc,tau[,gain] : CR-RC shaper, time constant tau samples, default gain e,
+//                     which preserves the amplitude of a step
+//
+// Input values greater than 4095 are out of range; these are replaced by 2048,
+// and counted, as is done by the pulse detector.
+
+//
+// defines
+//
+
+#define MAX_ADC_VAL  4095
+
+//
+// prototypes
+//
+
+static int32_t filter_read_template(char * filename, float * t, int32_t max_t);
+static void filter_fir_block(filter_t * f, uint16_t * in, uint16_t * out, int32_t cnt);
+static void filter_crrc(filter_t * f, uint16_t * in, uint16_t * out, int32_t cnt);
+
+// -----------------  API  ---------------------------------------------------------
+
+int32_t filter_init(filter_t * f, char * spec)
+{
+    int32_t n, k, m, i, len, max_idx;
+    float   t[FILTER_MAX_TAPS], tau, gain, mean, sum_sq, max;
+    char    filename[PATH_MAX];
+
+    bzero(f, sizeof(filter_t));
+    snprintf(f->desc, sizeof(f->desc), "%s", spec);
+
+    if (strcmp(spec, "none") == 0) {
+        f->type = FILTER_TYPE_NONE;
+    } else if (sscanf(spec, "ma,%d", &n) == 1) {
+        if (n < 1 || n > FILTER_MAX_TAPS) {
+            ERROR("filter '%s': n must be 1 - %d\n", spec, FILTER_MAX_TAPS);
+            return -1;
+        }
+        f->type = FILTER_TYPE_MA;
+        f->taps = n;
+        for (i = 0; i < n; i++) {
+            f->coef[i] = 1.0 / n;
+        }
+        f->offset = 0;
+        f->delay = (n - 1) / 2;
+    } else if (sscanf(spec, "trap,%d,%d", &k, &m) == 2) {
+        if (k < 1 || m < 0 || 2 * k + m > FILTER_MAX_TAPS) {
+            ERROR("filter '%s': k must be >= 1, m >= 0, and 2k+m <= %d\n", spec, FILTER_MAX_TAPS);
+            return -1;
+        }
+        f->type = FILTER_TYPE_TRAP;
+        f->taps = 2 * k + m;
+        for (i = 0; i < k; i++) {
+            f->coef[i] = 1.0 / k;
+            f->coef[k+m+i] = -1.0 / k;
+        }
+        f->offset = FILTER_AC_BASELINE;
+        f->delay = (k - 1) / 2;
+    } else if (strncmp(spec, "matched,", strlen("matched,")) == 0) {
+        if (strlen(spec + strlen("matched,")) == 0 || 
+            strlen(spec + strlen("matched,")) >= sizeof(filename)) 
+        {
+            ERROR("filter '%s': template filename is empty or too long\n", spec);
+            return -1;
+        }
+        strcpy(filename, spec + strlen("matched,"));
+        if ((len = filter_read_template(filename, t, FILTER_MAX_TAPS)) < 0) {
+            return -1;
+        }
+        mean = 0;
+        max = t[0];
+        max_idx = 0;
+        for (i = 0; i < len; i++) {
+            mean += t[i] / len;
+            if (t[i] > max) {
+                max = t[i];
+                max_idx = i;
+            }
+        }
+        sum_sq = 0;
+        for (i = 0; i < len; i++) {
+            sum_sq += (t[i] - mean) * (t[i] - mean);
+        }
+        if (len < 2 || max <= 0 || sum_sq == 0) {
+            ERROR("filter '%s': template is not valid\n", spec);
+            return -1;
+        }
+        f->type = FILTER_TYPE_MATCHED;
+        f->taps = len;
+        for (i = 0; i < len; i++) {
+            f->coef[len-1-i] = (t[i] - mean) * max / sum_sq;
+        }
+        f->offset = FILTER_AC_BASELINE;
+        f->delay = len - 1 - max_idx;
+    } else if ((n = sscanf(spec, "crrc,%f,%f", &tau, &gain)) >= 1) {
+        if (n == 1) {
+            gain = M_E;
+        }
+        if (tau <= 0 || gain <= 0) {
+            ERROR("filter '%s': tau and gain must be > 0\n", spec);
+            return -1;
+        }
+        f->type = FILTER_TYPE_CRRC;
+        f->crrc_a = tau / (tau + 1);
+        f->crrc_b = 1 / (tau + 1);
+        f->crrc_gain = gain;
+        f->offset = FILTER_AC_BASELINE;
+        f->delay = tau;
+    } else {
+        ERROR("filter '%s' is not valid\n", spec);
+        return -1;
+    }
+
+    filter_reset(f);
+    return 0;
+}
+
+// the next sample processed does not follow the prior sample, so the filter 
+// state is reinitialized from the next sample
+void filter_reset(filter_t * f)
+{
+    f->primed = false;
+}
+
+void filter_process(filter_t * f, uint16_t * in, uint16_t * out, int32_t cnt)
+{
+    int32_t i, len;
+
+    switch (f->type) {
+    case FILTER_TYPE_MA: case FILTER_TYPE_TRAP: case FILTER_TYPE_MATCHED:
+        for (i = 0; i < cnt; i += len) {
+            len = (cnt - i < FILTER_BLOCK_LEN ? cnt - i : FILTER_BLOCK_LEN);
+            filter_fir_block(f, in+i, out+i, len);
+        }
+        break;
+    case FILTER_TYPE_CRRC:
+        filter_crrc(f, in, out, cnt);
+        break;
+    default:
+        if (out != in) {
+            memcpy(out, in, cnt * sizeof(uint16_t));
+        }
+        break;
+    }
+}
+
+// -----------------  PRIVATE  -----------------------------------------------------
+
+static int32_t filter_read_template(char * filename, float * t, int32_t max_t)
+{
+    FILE  * fp;
+    char    s[1000], * p, * end;
+    int32_t len = 0;
+    float   val;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        ERROR("open %s, %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(s, sizeof(s), fp) != NULL) {
+        if (s[0] == '#') {
+            continue;
+        }
+        p = s;
+        while (true) {
+            val = strtof(p, &end);
+            if (end == p) {
+                break;
+            }
+            if (len == max_t) {
+                ERROR("%s: template has more than %d values\n", filename, max_t);
+                fclose(fp);
+                return -1;
+            }
+            t[len++] = val;
+            p = end;
+        }
+    }
+
+    fclose(fp);
+    return len;
+}
+
+static void filter_fir_block(filter_t * f, uint16_t * in, uint16_t * out, int32_t cnt)
+{
+    int32_t h = f->taps - 1;
+    float * x = f->x;
+    float   y[FILTER_BLOCK_LEN];
+    int32_t n, k, v;
+
+    // convert the block to float, following the h history samples;
+    // if not primed then the history is set to the first sample
+    for (n = 0; n < cnt; n++) {
+        if (in[n] > MAX_ADC_VAL) {
+            f->out_of_range_count++;
+            x[h+n] = 2048;
+        } else {
+            x[h+n] = in[n];
+        }
+    }
+    if (!f->primed) {
+        for (n = 0; n < h; n++) {
+            x[n] = x[h];
+        }
+        f->primed = true;
+    }
+
+    // y[n] = offset + sum over k of coef[k] * x[n-k]; the inner loop
+    // is over the samples, and has a constant trip count so that it is 
+    // vectorized at -O2; when cnt is less than FILTER_BLOCK_LEN the 
+    // excess results are not used
+    for (n = 0; n < FILTER_BLOCK_LEN; n++) {
+        y[n] = f->offset;
+    }
+    for (k = 0; k < f->taps; k++) {
+        float   c  = f->coef[k];
+        float * xk = x + h - k;
+        for (n = 0; n < FILTER_BLOCK_LEN; n++) {
+            y[n] += c * xk[n];
+        }
+    }
+
+    // round and clamp the output to the adc range
+    for (n = 0; n < cnt; n++) {
+        v = y[n] + 0.5f;
+        out[n] = (v < 0 ? 0 : v > MAX_ADC_VAL ? MAX_ADC_VAL : v);
+    }
+
+    // save the last h samples as the history for the next block
+    memmove(x, x + cnt, h * sizeof(float));
+}
+
+static void filter_crrc(filter_t * f, uint16_t * in, uint16_t * out, int32_t cnt)
+{
+    float   x, x_prior = f->crrc_x, hp = f->crrc_hp, lp = f->crrc_lp;
+    int32_t n, v;
+
+    if (!f->primed && cnt > 0) {
+        x_prior = (in[0] > MAX_ADC_VAL ? 2048 : in[0]);
+        hp = lp = 0;
+        f->primed = true;
+    }
+
+    // CR (high pass) followed by RC (low pass)
+    for (n = 0; n < cnt; n++) {
+        if (in[n] > MAX_ADC_VAL) {
+            f->out_of_range_count++;
+            x = 2048;
+        } else {
+            x = in[n];
+        }
+        hp = f->crrc_a * (hp + x - x_prior);
+        lp = lp + f->crrc_b * (hp - lp);
+        x_prior = x;
+        v = f->offset + f->crrc_gain * lp + 0.5f;
+        out[n] = (v < 0 ? 0 : v > MAX_ADC_VAL ? MAX_ADC_VAL : v);
+    }
+
+    f->crrc_x  = x_prior;
+    f->crrc_hp = hp;
+    f->crrc_lp = lp;
+}
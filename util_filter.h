@@ -0,0 +1,75 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef __UTIL_FILTER_H__
+#define __UTIL_FILTER_H__
+
+// streaming shaping filter, applied to the neutron detector samples ahead of 
+// the pulse detector; the output is adc counts, like the input
+
+#define FILTER_MAX_TAPS       64
+#define FILTER_BLOCK_LEN      256     // samples processed per block
+#define FILTER_AC_BASELINE    2048    // output baseline of the filters that remove the input baseline
+
+// filter types
+// - FILTER_TYPE_NONE: output equals input
+// - FILTER_TYPE_MA: moving average of n samples, the input baseline is kept
+// - FILTER_TYPE_TRAP: trapezoidal shaper, rise k samples and flat top m samples;
+//   the difference of two moving sums of k samples, separated by m samples
+// - FILTER_TYPE_MATCHED: matched filter, the correlation with a pulse template
+//   that is read from a file; the template is made zero mean so that the input
+//   baseline is removed, and is scaled so that a pulse that matches the template 
+//   has its height preserved
+// - FILTER_TYPE_CRRC: CR-RC shaper, time constant tau samples, IIR
+// The FIR filters (MA, TRAP, MATCHED) are evaluated a block at a time, in a form
+// that the compiler vectorizes.
+#define FILTER_TYPE_NONE     0
+#define FILTER_TYPE_MA       1
+#define FILTER_TYPE_TRAP     2
+#define FILTER_TYPE_MATCHED  3
+#define FILTER_TYPE_CRRC     4
+
+typedef struct {
+    // configuration
+    int32_t type;                           // FILTER_TYPE_xxx
+    char    desc[100];                      // filter spec, for logging
+    int32_t delay;                          // approximate filter delay, samples
+    int32_t taps;                           // FIR: number of coefficients
+    float   coef[FILTER_MAX_TAPS];          // FIR: coef[k] multiplies x[n-k]
+    float   offset;                         // added to the output
+    float   crrc_a, crrc_b, crrc_gain;      // CRRC
+
+    // state
+    float   x[FILTER_MAX_TAPS-1+FILTER_BLOCK_LEN];   // FIR: taps-1 history samples, and the block
+    bool    primed;                         // FIR: history is valid
+    float   crrc_x, crrc_hp, crrc_lp;       // CRRC
+
+    // counters
+    uint64_t out_of_range_count;            // input samples > 4095
+} filter_t;
+
+int32_t filter_init(filter_t * f, char * spec);
+void filter_reset(filter_t * f);
+void filter_process(filter_t * f, uint16_t * in, uint16_t * out, int32_t cnt);
+
+#endif
@@ -22,6 +22,8 @@ SOFTWARE.
 
 //#define MCCDAQ_TEST
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -37,8 +39,14 @@ SOFTWARE.
 #include <termios.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <sys/mman.h>
 
+#include "util_pulse_gen.h"
 #include "util_mccdaq.h"
+#include "util_raw_capture.h"
 #include "util_misc.h"
 
 #ifndef MCCDAQ_TEST
@@ -57,6 +65,26 @@ int libusb_init (void ** cx);
 int libusb_bulk_transfer (struct libusb_device_handle *dev_handle, unsigned char endpoint, 
        unsigned char *data, int length, int *transferred, unsigned int timeout);
 int libusb_clear_halt (libusb_device_handle *dev, unsigned char endpoint);
+enum libusb_transfer_status {
+  LIBUSB_TRANSFER_COMPLETED, LIBUSB_TRANSFER_ERROR, LIBUSB_TRANSFER_TIMED_OUT, LIBUSB_TRANSFER_CANCELLED,
+  LIBUSB_TRANSFER_STALL, LIBUSB_TRANSFER_NO_DEVICE, LIBUSB_TRANSFER_OVERFLOW };
+struct libusb_transfer;
+typedef void (*libusb_transfer_cb_fn)(struct libusb_transfer *transfer);
+struct libusb_transfer {
+  libusb_device_handle *dev_handle; uint8_t flags; unsigned char endpoint; unsigned char type;
+  unsigned int timeout; enum libusb_transfer_status status; int length; int actual_length;
+  libusb_transfer_cb_fn callback; void *user_data; unsigned char *buffer; int num_iso_packets; };
+struct libusb_transfer * libusb_alloc_transfer(int iso_packets);
+void libusb_free_transfer(struct libusb_transfer *transfer);
+int libusb_submit_transfer(struct libusb_transfer *transfer);
+int libusb_cancel_transfer(struct libusb_transfer *transfer);
+int libusb_handle_events_timeout(void *ctx, struct timeval *tv);
+static inline void libusb_fill_bulk_transfer(struct libusb_transfer *transfer,
+       libusb_device_handle *dev_handle, unsigned char endpoint, unsigned char *buffer, int length,
+       libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout) {
+  transfer->dev_handle = dev_handle; transfer->endpoint = endpoint; transfer->timeout = timeout;
+  transfer->buffer = buffer; transfer->length = length; transfer->user_data = user_data;
+  transfer->callback = callback; }
 // from mccdaq library ...
 #define NCHAN_USB20X      8  // max number of A/D channels in the device
 #define USB204_PID   (0x0114)
@@ -80,7 +108,29 @@ void usbAInScanClearFIFO_USB20X(libusb_device_handle *udev);
 
 #define CHANNEL    0
 #define FREQUENCY  499999         // samples per second
-#define MAX_DATA   (20*500000)    // 20 secs of data
+#define MAX_DATA   (10*1024*1024) // 21 secs of data, multiple of the 2MB hugepage size
+
+#define ENABLE_HUGEPAGES           // use hugepages for the ring, when available
+
+#define CONSUMER_WAIT_TOUT_MS  100  // consumer checks for STOPPING at this interval
+
+// the consumer discards data only when the ring is about to be overrun, that is when
+// the unconsumed data, the history preceding it, and the transfers in flight no longer fit
+#define MAX_FILL   (MAX_DATA - MCCDAQ_MAX_HISTORY - MAX_XFER*MAX_XFER_LEN/2)
+
+#define OPTIONS          0
+#define MAX_XFER         32         // max number of bulk transfers in flight
+#define MAX_XFER_LEN     65536      // max bulk transfer length, in bytes
+#define DEFAULT_MAX_XFER 8
+#define DEFAULT_XFER_LEN 16384      // 8192 samples, 16 ms
+
+// the realtime of a sample is derived from its index, relative to an anchor; an anchor 
+// is added when the scan is started or restarted, and when the sample clock has drifted 
+// from the realtime clock by more than CLOCK_DRIFT_TOLERANCE_NS
+#define MAX_ANCHOR                 64
+#define CLOCK_CHECK_INTVL_NS       1000000000L   // drift is checked at this interval
+#define CLOCK_DRIFT_TOLERANCE_NS   1000000L      // 1 ms
+#define CLOCK_MAX_CORRECTION_NS    100000L       // 100 us per check, 100 ppm
 
 #define STATE_CHANGE(new_state) \
     do { \
@@ -100,6 +150,17 @@ void usbAInScanClearFIFO_USB20X(libusb_device_handle *udev);
 
 enum state { NOT_INITIALIZED, STOPPED, RUNNING, STOPPING };
 
+typedef struct {
+    struct libusb_transfer * transfer;
+    bool                     done;     // set by the transfer completion callback
+} xfer_t;
+
+typedef struct {
+    uint64_t sample_idx;   // first sample that this anchor applies to
+    int64_t  time_ns;      // realtime of that sample
+    int64_t  lost;         // samples lost preceding that sample, when the scan was restarted
+} anchor_t;
+
 //
 // variables
 //
@@ -107,21 +168,64 @@ enum state { NOT_INITIALIZED, STOPPED, RUNNING, STOPPING };
 static libusb_device_handle * g_udev;
 static float                  g_cal_tbl[NCHAN_USB20X][2];
 static uint16_t             * g_data;
-static uint64_t               g_produced;
+static uint64_t               g_produced;   // written by producer (release), read by consumer (acquire)
+static uint64_t               g_consumed;   // written by consumer (release), read by mccdaq_get_stats
+static int                    g_event_fd;   // producer signals consumer that data is available
+static uint64_t               g_discarded;
+static uint64_t               g_wakeup_count;
+static int64_t                g_fill_high_water;
 static mccdaq_callback_t      g_cb;
 static enum state             g_state;
 static bool                   g_producer_thread_running;
 static bool                   g_consumer_thread_running;
 static int32_t                g_restart_count;
 static int32_t                g_usb_max_packet_size;
+static xfer_t                 g_xfer[MAX_XFER];
+static int32_t                g_max_xfer = DEFAULT_MAX_XFER;
+static int32_t                g_xfer_len = DEFAULT_XFER_LEN;
+static int32_t                g_xfer_tout_ms;
+static int32_t                g_xfer_inflight;
+static uint64_t               g_drain_us;
+static uint64_t               g_analysis_us;
+static uint64_t               g_analysis_max_us;
+static uint64_t               g_analysis_count;
+static int32_t                g_drain_cpu = -1;
+static int32_t                g_analysis_cpu = -1;
+static anchor_t               g_anchor[MAX_ANCHOR];
+static uint64_t               g_anchor_count;   // written by producer (release), read by consumer (acquire)
+static int64_t                g_lost_samples;
+static int64_t                g_clock_drift_ns;
+static int32_t                g_clock_correction_count;
+static int64_t                g_clock_check_ns;
+static int64_t                g_clock_min_err_ns;
+static FILE                 * g_replay_fp;      // not NULL when replaying a raw capture file
+static bool                   g_replay_realtime;
+static bool                   g_replay_done;
+static bool                   g_sample_clock_only;  // sample clock is not compared with the realtime clock
 
 //
 // protoytpes
 //
 
+static void mccdaq_init_common(void);
 static void mccdaq_exit(void);
+static uint16_t * mccdaq_alloc_ring(size_t size);
+static uint16_t * mccdaq_map_ring(size_t size, bool hugepages);
+static void mccdaq_wake_consumer(void);
+static void mccdaq_set_thread_cpu(char * name, int32_t cpu);
 static void * mccdaq_producer_thread(void * cx);
+static void mccdaq_xfer_callback(struct libusb_transfer * transfer);
+static void mccdaq_submit_xfers(int32_t head, int32_t * inflight, uint64_t * submitted);
+static void mccdaq_cancel_xfers(int32_t head, int32_t * inflight);
+static void mccdaq_restart_scan(struct libusb_transfer * t);
+static void mccdaq_publish(int32_t count);
+static void mccdaq_add_anchor(uint64_t sample_idx, int64_t time_ns, int64_t lost);
+static anchor_t * mccdaq_find_anchor(uint64_t sample_idx);
+static void mccdaq_check_clock(void);
+static int64_t realtime_ns(void);
 static void * mccdaq_consumer_thread(void * cx);
+static void * mccdaq_replay_thread(void * cx);
+static int32_t mccdaq_replay_read_block(raw_capture_hdr_t * hdr);
 
 // -----------------  PUBLIC ROUTINES  ----------------------------------
 
@@ -160,21 +264,109 @@ int32_t mccdaq_init(void)
     INFO("Calibration Table %d: Slope=%f  Offset=%f\n", 
          idx, g_cal_tbl[idx][0], g_cal_tbl[idx][1]);
 
+    // allocate the ring, and init state
+    mccdaq_init_common();
+
+    // return success
+    INFO("success\n");
+    return 0;
+}
+
+// the samples are read from a raw capture file, written by util_raw_capture, 
+// instead of being acquired from the MCC-USB-204; the samples are replayed at
+// the sample rate if realtime is set, otherwise as fast as the consumer 
+// processes them; the sample times are shifted so that the replay begins at 
+// the time mccdaq_start is called
+int32_t mccdaq_init_replay(char * filename, bool realtime)
+{
+    // open the raw capture file
+    g_replay_fp = fopen(filename, "r");
+    if (g_replay_fp == NULL) {
+        ERROR("open %s, %s\n", filename, strerror(errno));
+        return -1;
+    }
+    g_replay_realtime = realtime;
+    g_sample_clock_only = true;
+    g_usb_max_packet_size = 64;
+
+    // allocate the ring, and init state
+    mccdaq_init_common();
+
+    // return success
+    INFO("success, replaying %s %s\n", filename, realtime ? "at the sample rate" : "as fast as possible");
+    return 0;
+}
+
+static void mccdaq_init_common(void)
+{
     // allocate memory for producer
-    g_data = calloc(MAX_DATA, sizeof(uint16_t));
+    g_data = mccdaq_alloc_ring(MAX_DATA*sizeof(uint16_t));
     if (g_data == NULL) {
-        FATAL("calloc size %zd", MAX_DATA*sizeof(uint16_t));
+        FATAL("mccdaq_alloc_ring size %zd", MAX_DATA*sizeof(uint16_t));
     }
     g_produced = 0;
 
+    // create the eventfd used by the producer to wake the consumer
+    g_event_fd = eventfd(0, EFD_NONBLOCK);
+    if (g_event_fd < 0) {
+        FATAL("eventfd, %s\n", strerror(errno));
+    }
+
     // set state to stopped
     STATE_CHANGE(STOPPED);
 
     // register exit handler
     atexit(mccdaq_exit);
+}
 
-    // return success
-    INFO("success\n");
+int32_t mccdaq_set_xfer_params(int32_t max_xfer, int32_t xfer_len)
+{
+    // the transfer parameters can only be changed when stopped
+    if (g_state != STOPPED) {
+        ERROR("state must be STOPPED, state is %s\n", STATE_STRING(g_state));
+        return -1;
+    }
+
+    // validate params; xfer_len must be a multiple of the usb packet size,
+    // so that the device does not send a packet that overflows the transfer
+    if (max_xfer < 1 || max_xfer > MAX_XFER) {
+        ERROR("max_xfer %d is invalid, range is 1 - %d\n", max_xfer, MAX_XFER);
+        return -1;
+    }
+    if (xfer_len <= 0 || xfer_len > MAX_XFER_LEN || (xfer_len % g_usb_max_packet_size) != 0) {
+        ERROR("xfer_len %d is invalid, must be a multiple of %d and <= %d\n", 
+              xfer_len, g_usb_max_packet_size, MAX_XFER_LEN);
+        return -1;
+    }
+
+    // save params
+    INFO("max_xfer=%d xfer_len=%d\n", max_xfer, xfer_len);
+    g_max_xfer = max_xfer;
+    g_xfer_len = xfer_len;
+    return 0;
+}
+
+int32_t mccdaq_set_cpu_affinity(int32_t drain_cpu, int32_t analysis_cpu)
+{
+    int32_t ncpu = sysconf(_SC_NPROCESSORS_CONF);
+
+    // the cpu affinity can only be changed when stopped
+    if (g_state != STOPPED) {
+        ERROR("state must be STOPPED, state is %s\n", STATE_STRING(g_state));
+        return -1;
+    }
+
+    // validate params, -1 means not pinned
+    if (drain_cpu < -1 || drain_cpu >= ncpu || analysis_cpu < -1 || analysis_cpu >= ncpu) {
+        ERROR("drain_cpu %d or analysis_cpu %d is invalid, range is -1 - %d\n", 
+              drain_cpu, analysis_cpu, ncpu-1);
+        return -1;
+    }
+
+    // save params, these are applied when the threads are started
+    INFO("drain_cpu=%d analysis_cpu=%d\n", drain_cpu, analysis_cpu);
+    g_drain_cpu = drain_cpu;
+    g_analysis_cpu = analysis_cpu;
     return 0;
 }
 
@@ -207,18 +399,39 @@ int32_t  mccdaq_start(mccdaq_callback_t cb)
         FATAL("state should be STOPPED, but is %d\n", g_state);
     }
 
-    // clear data
+    // clear data and statistics
     memset(g_data, -1, MAX_DATA*sizeof(uint16_t));
     g_produced = 0;
+    g_consumed = 0;
+    g_discarded = 0;
+    g_wakeup_count = 0;
+    g_fill_high_water = 0;
+    g_xfer_inflight = 0;
+    g_drain_us = 0;
+    g_analysis_us = 0;
+    g_analysis_max_us = 0;
+    g_analysis_count = 0;
+    g_anchor_count = 0;
+    g_lost_samples = 0;
+    g_clock_drift_ns = 0;
+    g_clock_correction_count = 0;
+    g_replay_done = false;
 
     // store callback
     g_cb = cb;
 
+    // the transfer timeout allows for all of the transfers in flight
+    // to complete, plus 250 ms
+    g_xfer_tout_ms = (int64_t)g_max_xfer * (g_xfer_len / 2) * 1000 / FREQUENCY + 250;
+
     // set state
     STATE_CHANGE(RUNNING);
 
-    // create threads
-    if (pthread_create(&thread, NULL, mccdaq_producer_thread, NULL) != 0) {
+    // create threads; when replaying, the producer thread reads the raw capture file
+    if (pthread_create(&thread, NULL, 
+                       g_replay_fp ? mccdaq_replay_thread : mccdaq_producer_thread, 
+                       NULL) != 0) 
+    {
         FATAL("pthread_create mccdaq_producer_thread, %s\n", strerror(errno));
     }
     if (pthread_create(&thread, NULL, mccdaq_consumer_thread, NULL) != 0) {
@@ -237,8 +450,9 @@ int32_t mccdaq_stop(void)
         return -1;
     }
 
-    // set state to STOPPING
+    // set state to STOPPING, and wake the consumer so that it sees the new state
     STATE_CHANGE(STOPPING);
+    mccdaq_wake_consumer();
 
     // wait for threads to be not running
     while (g_producer_thread_running || g_consumer_thread_running) {
@@ -259,39 +473,414 @@ int32_t mccdaq_get_restart_count(void)
     return val;
 }
 
+int32_t mccdaq_get_stats(mccdaq_stats_t * stats)
+{
+    // if not initialized then return error
+    if (g_state == NOT_INITIALIZED) {
+        ERROR("not initialized\n");
+        return -1;
+    }
+
+    // return a snapshot of the ring statistics;
+    // the consumed count is read first so that fill can not be negative
+    stats->consumed        = __atomic_load_n(&g_consumed, __ATOMIC_ACQUIRE);
+    stats->produced        = __atomic_load_n(&g_produced, __ATOMIC_ACQUIRE);
+    stats->discarded       = __atomic_load_n(&g_discarded, __ATOMIC_RELAXED);
+    stats->fill            = stats->produced - stats->consumed;
+    stats->fill_high_water = __atomic_load_n(&g_fill_high_water, __ATOMIC_RELAXED);
+    stats->wakeup_count    = __atomic_load_n(&g_wakeup_count, __ATOMIC_RELAXED);
+    stats->xfer_inflight   = __atomic_load_n(&g_xfer_inflight, __ATOMIC_RELAXED);
+    stats->drain_us        = __atomic_load_n(&g_drain_us, __ATOMIC_RELAXED);
+    stats->analysis_us     = __atomic_load_n(&g_analysis_us, __ATOMIC_RELAXED);
+    stats->analysis_max_us = __atomic_load_n(&g_analysis_max_us, __ATOMIC_RELAXED);
+    stats->analysis_count  = __atomic_load_n(&g_analysis_count, __ATOMIC_RELAXED);
+    stats->lost_samples    = __atomic_load_n(&g_lost_samples, __ATOMIC_RELAXED);
+    stats->clock_drift_ns  = __atomic_load_n(&g_clock_drift_ns, __ATOMIC_RELAXED);
+    stats->clock_correction_count = __atomic_load_n(&g_clock_correction_count, __ATOMIC_RELAXED);
+    stats->replay_done     = __atomic_load_n(&g_replay_done, __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+// -----------------  MCCDAQ SAMPLE CLOCK  ------------------------------
+
+// Samples are timestamped by counting: the realtime of a sample is the time of the 
+// most recent anchor preceding it, plus the number of samples since that anchor
+// divided by FREQUENCY. So, between anchors, each second of realtime contains 
+// exactly FREQUENCY samples. 
+//
+// The anchors are added by the producer thread, before the samples they apply 
+// to are published:
+// - when the scan is started
+// - when the scan is restarted; the samples that would have been acquired while 
+//   the device was being restarted are counted as lost
+// - when the realtime at which the transfers complete shows that the sample clock 
+//   has drifted from the realtime clock; the correction is limited to 
+//   CLOCK_MAX_CORRECTION_NS, so that a second contains at most 50 samples more 
+//   or less than FREQUENCY
+
+// returns the realtime, in ns, at which the sample was acquired
+int64_t mccdaq_sample_time_ns(uint64_t sample_idx)
+{
+    anchor_t * a = mccdaq_find_anchor(sample_idx);
+    uint64_t   n;
+
+    if (a == NULL) {
+        return 0;
+    }
+    n = sample_idx - a->sample_idx;
+    return a->time_ns +
+           (int64_t)(n / FREQUENCY) * 1000000000L +
+           (int64_t)(n % FREQUENCY) * 1000000000L / FREQUENCY;
+}
+
+// returns the index of the first sample acquired at or after time_ns
+uint64_t mccdaq_time_to_sample_idx(int64_t time_ns)
+{
+    uint64_t count = __atomic_load_n(&g_anchor_count, __ATOMIC_ACQUIRE);
+    uint64_t i, first, sample_idx;
+    anchor_t * a, * next;
+    int64_t  d;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    // find the most recent anchor whose time is at or before time_ns, 
+    // and the anchor that follows it
+    first = (count > MAX_ANCHOR ? count - MAX_ANCHOR : 0);
+    for (i = count - 1; i > first; i--) {
+        if (g_anchor[i % MAX_ANCHOR].time_ns <= time_ns) {
+            break;
+        }
+    }
+    a = &g_anchor[i % MAX_ANCHOR];
+    next = (i + 1 < count ? &g_anchor[(i + 1) % MAX_ANCHOR] : NULL);
+    if (time_ns <= a->time_ns) {
+        return a->sample_idx;
+    }
+
+    // count the samples from the anchor, rounding up; the result can not be 
+    // beyond the next anchor, which is the case when time_ns is in a restart gap
+    d = time_ns - a->time_ns;
+    sample_idx = a->sample_idx +
+                 (d / 1000000000L) * FREQUENCY +
+                 ((d % 1000000000L) * FREQUENCY + 999999999L) / 1000000000L;
+    if (next && sample_idx > next->sample_idx) {
+        sample_idx = next->sample_idx;
+    }
+    return sample_idx;
+}
+
+// returns the number of samples lost, due to scan restarts, in the 
+// range of samples from sample_idx_start to sample_idx_end-1
+int64_t mccdaq_lost_samples(uint64_t sample_idx_start, uint64_t sample_idx_end)
+{
+    uint64_t count = __atomic_load_n(&g_anchor_count, __ATOMIC_ACQUIRE);
+    uint64_t i, first;
+    int64_t  lost = 0;
+
+    first = (count > MAX_ANCHOR ? count - MAX_ANCHOR : 0);
+    for (i = first; i < count; i++) {
+        anchor_t * a = &g_anchor[i % MAX_ANCHOR];
+        if (a->sample_idx >= sample_idx_start && a->sample_idx < sample_idx_end) {
+            lost += a->lost;
+        }
+    }
+    return lost;
+}
+
+// copies the samples that are still in the ring, starting at *sample_idx, to buff;
+// this can be called from any thread, and does not delay the producer or consumer;
+// if the samples at *sample_idx have already been overwritten then *sample_idx is
+// advanced to the oldest sample that can be copied; returns the number of samples
+// copied, which is limited to those produced, or -1 if the samples were overwritten 
+// during the copy
+int64_t mccdaq_copy_samples(uint64_t * sample_idx, uint16_t * buff, int64_t max_buff)
+{
+    uint64_t produced, oldest;
+    int64_t  count;
+
+    // the oldest sample that can be copied allows for the bulk transfers in flight,
+    // which are written ahead of g_produced, and a margin of 1 second for the copy
+    produced = __atomic_load_n(&g_produced, __ATOMIC_ACQUIRE);
+    oldest = produced + MAX_XFER*MAX_XFER_LEN/2 + FREQUENCY;
+    oldest = (oldest > MAX_DATA ? oldest - MAX_DATA : 0);
+    if (*sample_idx < oldest) {
+        *sample_idx = oldest;
+    }
+    if (*sample_idx >= produced) {
+        return 0;
+    }
+
+    // copy, the samples are contiguous because of the ring mirror mapping
+    count = produced - *sample_idx;
+    if (count > max_buff) {
+        count = max_buff;
+    }
+    memcpy(buff, g_data + (*sample_idx % MAX_DATA), count * sizeof(uint16_t));
+
+    // verify the samples were not overwritten during the copy
+    produced = __atomic_load_n(&g_produced, __ATOMIC_ACQUIRE);
+    if (produced + MAX_XFER*MAX_XFER_LEN/2 > *sample_idx + MAX_DATA) {
+        return -1;
+    }
+    return count;
+}
+
+static void mccdaq_add_anchor(uint64_t sample_idx, int64_t time_ns, int64_t lost)
+{
+    anchor_t * a = &g_anchor[g_anchor_count % MAX_ANCHOR];
+
+    // the anchor is made available to the consumer thread before the samples it applies to
+    a->sample_idx = sample_idx;
+    a->time_ns    = time_ns;
+    a->lost       = lost;
+    __atomic_store_n(&g_anchor_count, g_anchor_count + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_lost_samples, g_lost_samples + lost, __ATOMIC_RELAXED);
+
+    // restart the drift measurement
+    g_clock_min_err_ns = INT64_MAX;
+    g_clock_check_ns = time_ns + CLOCK_CHECK_INTVL_NS;
+}
+
+static anchor_t * mccdaq_find_anchor(uint64_t sample_idx)
+{
+    uint64_t count = __atomic_load_n(&g_anchor_count, __ATOMIC_ACQUIRE);
+    uint64_t i, first;
+
+    // the samples being timestamped are usually after the most recent anchor
+    if (count == 0) {
+        return NULL;
+    }
+    first = (count > MAX_ANCHOR ? count - MAX_ANCHOR : 0);
+    for (i = count - 1; i > first; i--) {
+        if (g_anchor[i % MAX_ANCHOR].sample_idx <= sample_idx) {
+            break;
+        }
+    }
+    return &g_anchor[i % MAX_ANCHOR];
+}
+
+static void mccdaq_check_clock(void)
+{
+    int64_t now_ns, err_ns, corr_ns;
+
+    // the error is the realtime at which the transfer completed less the 
+    // sample time of the sample following the transfer; the minimum error
+    // over the check interval excludes most of the transfer latency 
+    now_ns = realtime_ns();
+    err_ns = now_ns - mccdaq_sample_time_ns(g_produced);
+    if (err_ns < g_clock_min_err_ns) {
+        g_clock_min_err_ns = err_ns;
+    }
+    if (now_ns < g_clock_check_ns) {
+        return;
+    }
+    __atomic_store_n(&g_clock_drift_ns, g_clock_min_err_ns, __ATOMIC_RELAXED);
+
+    // if the sample clock is ahead of the realtime clock, or behind it by more 
+    // than the tolerance, then add an anchor to correct the sample clock
+    if (g_clock_min_err_ns < 0 || g_clock_min_err_ns > CLOCK_DRIFT_TOLERANCE_NS) {
+        corr_ns = g_clock_min_err_ns;
+        if (corr_ns > CLOCK_MAX_CORRECTION_NS) {
+            corr_ns = CLOCK_MAX_CORRECTION_NS;
+        } else if (corr_ns < -CLOCK_MAX_CORRECTION_NS) {
+            corr_ns = -CLOCK_MAX_CORRECTION_NS;
+        }
+        DEBUG("sample clock drift %"PRId64" ns, correction %"PRId64" ns\n", g_clock_min_err_ns, corr_ns);
+        mccdaq_add_anchor(g_produced, mccdaq_sample_time_ns(g_produced) + corr_ns, 0);
+        __atomic_store_n(&g_clock_correction_count, g_clock_correction_count + 1, __ATOMIC_RELAXED);
+    }
+
+    g_clock_min_err_ns = INT64_MAX;
+    g_clock_check_ns = now_ns + CLOCK_CHECK_INTVL_NS;
+}
+
+static int64_t realtime_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
 // -----------------  MCCDAQ EXIT HANDLER -------------------------------
 
 static void mccdaq_exit(void)
 {
     // stop, and call cleanup 
     mccdaq_stop();
-    cleanup_USB20X(g_udev);
+    if (g_udev) {
+        cleanup_USB20X(g_udev);
+    }
+}
+
+// -----------------  MCCDAQ RING ALLOCATION  --------------------------
+
+// The g_data ring is a memfd that is mapped twice, back to back. Data that
+// wraps the end of the ring is therefore contiguous in the address space, 
+// which allows the producer to transfer, and the consumer to pass to the 
+// callback, a single contiguous range without regard to the ring wrap.
+
+static uint16_t * mccdaq_alloc_ring(size_t size)
+{
+    uint16_t * ring;
+
+#ifdef ENABLE_HUGEPAGES
+    // try to map the ring using hugepages; this fails if no hugepages
+    // are configured, in which case normal pages are used
+    ring = mccdaq_map_ring(size, true);
+    if (ring != NULL) {
+        INFO("ring size=%zd, using hugepages\n", size);
+        return ring;
+    }
+    INFO("hugepages not available for ring, using normal pages\n");
+#endif
+
+    ring = mccdaq_map_ring(size, false);
+    if (ring != NULL) {
+        INFO("ring size=%zd\n", size);
+    }
+    return ring;
+}
+
+static uint16_t * mccdaq_map_ring(size_t size, bool hugepages)
+{
+    int    fd;
+    void * reserve, * p1, * p2;
+    size_t align, reserve_size;
+
+    // create the memfd
+    align = (hugepages ? 2*1024*1024 : sysconf(_SC_PAGESIZE));
+    fd = memfd_create("mccdaq_ring", MFD_CLOEXEC | (hugepages ? MFD_HUGETLB : 0));
+    if (fd < 0) {
+        DEBUG("memfd_create, %s\n", strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, size) < 0) {
+        DEBUG("ftruncate size %zd, %s\n", size, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    // reserve address space for the 2 mappings, aligned to the page size
+    reserve_size = 2*size + align;
+    reserve = mmap(NULL, reserve_size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (reserve == MAP_FAILED) {
+        ERROR("mmap reserve size %zd, %s\n", reserve_size, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    p1 = (void*)(((uintptr_t)reserve + align - 1) & ~(uintptr_t)(align - 1));
+
+    // map the memfd twice, back to back, in the reserved address space
+    p1 = mmap(p1, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED|MAP_POPULATE, fd, 0);
+    p2 = (p1 == MAP_FAILED 
+          ? MAP_FAILED
+          : mmap((uint8_t*)p1+size, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0));
+    if (p1 == MAP_FAILED || p2 == MAP_FAILED) {
+        DEBUG("mmap ring, %s\n", strerror(errno));
+        munmap(reserve, reserve_size);
+        close(fd);
+        return NULL;
+    }
+
+    // the mappings hold a reference to the memfd, so it can be closed
+    close(fd);
+    return p1;
+}
+
+// -----------------  MCCDAQ PRODUCER / CONSUMER SIGNALLING  ------------
+
+// The g_data ring is single-producer/single-consumer. The producer publishes
+// samples by advancing g_produced with release semantics, and then increments
+// the eventfd counter. The consumer loads g_produced with acquire semantics,
+// and when there is nothing to consume it blocks in poll on the eventfd.
+// The eventfd counter coalesces multiple signals, so the consumer is woken
+// at most once per bulk transfer.
+
+static void mccdaq_wake_consumer(void)
+{
+    uint64_t val = 1;
+
+    if (write(g_event_fd, &val, sizeof(val)) != sizeof(val) && errno != EAGAIN) {
+        ERROR("write eventfd, %s\n", strerror(errno));
+    }
+}
+
+// -----------------  MCCDAQ THREAD CPU AFFINITY  ----------------------
+
+// The producer (drain stage) and consumer (analysis stage) threads can be
+// pinned to cpus, so that a slow analysis pass does not delay the handling 
+// of the usb transfer completions.
+
+static void mccdaq_set_thread_cpu(char * name, int32_t cpu)
+{
+    cpu_set_t cpuset;
+    int32_t   ret;
+
+    pthread_setname_np(pthread_self(), name);
+
+    if (cpu == -1) {
+        return;
+    }
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (ret != 0) {
+        ERROR("%s pthread_setaffinity_np cpu %d, %s\n", name, cpu, strerror(ret));
+        return;
+    }
+    INFO("%s thread running on cpu %d\n", name, cpu);
 }
 
 // -----------------  MCCDAQ PRODUCER THREAD-----------------------------
 
+// The producer streams the analog data using asynchronous bulk transfers.
+// g_max_xfer transfers are kept in flight; each transfer is submitted with a 
+// buffer that points directly at its position in the g_data ring. Transfers 
+// on the bulk endpoint complete in the order they were submitted, so when the
+// transfer at the head completes its data is published to the consumer, and 
+// the transfer is resubmitted at the end of the queue.
+//
+// The device status is read only when a transfer fails, times out, or
+// returns less data than requested. In these cases the remaining transfers
+// are cancelled and the analog input scan is restarted.
+
 static void * mccdaq_producer_thread(void * cx) 
 {
-    #define OPTIONS     0
-    #define MAX_LENGTH  20000
-    #define TOUT_MS     2000
+    int32_t          head, inflight, i;
+    uint64_t         submitted;
+    bool             restart;
+    struct timeval   tv;
+    xfer_t         * x;
+    struct libusb_transfer * t;
 
-    int32_t    ret, status;
-    int32_t    length_avail, length, transferred_bytes;
-    uint16_t * data = g_data;
+    uint64_t         start_us;
 
     g_producer_thread_running = true;
+    mccdaq_set_thread_cpu("mccdaq_drain", g_drain_cpu);
 
-    // start the analog input scan
-    usbAInScanStart_USB20X(g_udev, 0, FREQUENCY, 1<<CHANNEL, OPTIONS, 0, 0);
+    // allocate the transfers
+    for (i = 0; i < g_max_xfer; i++) {
+        g_xfer[i].transfer = libusb_alloc_transfer(0);
+        if (g_xfer[i].transfer == NULL) {
+            FATAL("libusb_alloc_transfer failed\n");
+        }
+        g_xfer[i].done = false;
+    }
 
-    // note that the code in the following loop is copied from the
-    // usbAInScanRead_USB20X routine in mccdaq/mcc-libusb/usb-20X.c;
-    // this is done because the usbAInScanRead_USB20X routine does not
-    // return error status; also the usbAInScanRead_USB20X routine does
-    // not return the actual number of scans transferred
+    // start the analog input scan, and submit the transfers;
+    // submitted is the ring position, in samples, for the next transfer submitted
+    usbAInScanStart_USB20X(g_udev, 0, FREQUENCY, 1<<CHANNEL, OPTIONS, 0, 0);
+    mccdaq_add_anchor(g_produced, realtime_ns(), 0);
+    head = 0;
+    inflight = 0;
+    submitted = g_produced;
+    mccdaq_submit_xfers(head, &inflight, &submitted);
 
-    // loop, performing usb buld transfers
+    // loop, handling transfer completions
     while (true) {
         // if state is STOPPING then
         //   exit thread
@@ -300,70 +889,66 @@ static void * mccdaq_producer_thread(void * cx)
             break;
         }
 
-        // determine number of bytes to request in call to libusb_bulk_transfer;
-        // this is normally MAX_LENGTH, but will be less when the data pointer nears
-        // the end of the g_data buffer
-        length_avail = (g_data + MAX_DATA - data) * sizeof(uint16_t);
-        length = (length_avail >= MAX_LENGTH ? MAX_LENGTH : length_avail);
-
-        // transfer analog data from mcc usb 204 device to data buffer
-        ret = libusb_bulk_transfer(g_udev, 
-                                   LIBUSB_ENDPOINT_IN|1, 
-                                   (uint8_t*)data,
-                                   length, 
-                                   &transferred_bytes, 
-                                   TOUT_MS);
-        status = usbStatus_USB20X(g_udev);
-        DEBUG("ret=%d length=%d transferred_byts=%d status=%d\n", 
-              ret, length, transferred_bytes, status);
-
-        // print warning if transferred_bytes is odd
-        if (transferred_bytes & 1) {
-            WARN("transferred_bytes = %d\n", transferred_bytes);    
-        }
+        // wait for transfers to complete; the completion callback sets the done flag
+        tv.tv_sec  = 0;
+        tv.tv_usec = 100000;
+        libusb_handle_events_timeout(NULL, &tv);
+        start_us = microsec_timer();
+
+        // process the completed transfers, in the order they were submitted
+        t = NULL;
+        restart = (inflight == 0);
+        while (inflight > 0 && g_xfer[head].done) {
+            x = &g_xfer[head];
+            t = x->transfer;
+            x->done = false;
+            inflight--;
+            head = (head + 1) % g_max_xfer;
+            DEBUG("status=%d length=%d actual_length=%d\n", t->status, t->length, t->actual_length);
+
+            // print warning if actual_length is odd
+            if (t->actual_length & 1) {
+                WARN("actual_length = %d\n", t->actual_length);    
+            }
+
+            // make data available to consumer thread, and wake the consumer
+            if (t->actual_length >= 2) {
+                mccdaq_publish(t->actual_length / 2);
+            }
 
-        // if length is a multiple of usb_max_packet_size the device will send a zero byte packet.
-        // refer to usbAInScanRead_USB20X routine in mccdaq/mcc-libusb/usb-20X.c
-        if (((length % g_usb_max_packet_size) == 0) && !(status & AIN_SCAN_RUNNING)) {
-            uint8_t value[64];
-            int32_t xfered;
-            libusb_bulk_transfer(g_udev, 
-                                 LIBUSB_ENDPOINT_IN|1, 
-                                 value, 
-                                 2, 
-                                 &xfered, 
-                                 100);
+            // if the transfer did not complete normally then restart the scan;
+            // otherwise resubmit the transfer
+            if (t->status != LIBUSB_TRANSFER_COMPLETED || t->actual_length != t->length) {
+                restart = true;
+                break;
+            }
+            mccdaq_submit_xfers(head, &inflight, &submitted);
         }
 
         // if error has occurred then
         //   restart the analog input scan, and
         //   keep track of number of resets
         // endif
-        if ((ret == LIBUSB_ERROR_PIPE) || !(status & AIN_SCAN_RUNNING) || ret != 0) {
-            if (ret != LIBUSB_ERROR_PIPE && ret != 0) {
-                WARN("restarting, ret==%d status=0x%x\n", ret, status);
-            } else {
-                DEBUG("restarting, ret==%d status=0x%x\n", ret, status); 
-            }
-
-            libusb_clear_halt(g_udev, LIBUSB_ENDPOINT_IN|1);
-            usbAInScanStart_USB20X(g_udev, 0, FREQUENCY, 1<<CHANNEL, OPTIONS, 0, 0);
-
+        if (restart) {
+            mccdaq_cancel_xfers(head, &inflight);
+            mccdaq_restart_scan(t);
             __sync_fetch_and_add(&g_restart_count, 1);
+
+            head = 0;
+            submitted = g_produced;
+            mccdaq_submit_xfers(head, &inflight, &submitted);
         }
 
-        // make data available to consumer thread
-        g_produced += transferred_bytes / 2;
+        // keep track of the drain stage queue depth and processing time
+        __atomic_store_n(&g_xfer_inflight, inflight, __ATOMIC_RELAXED);
+        __atomic_store_n(&g_drain_us, g_drain_us + microsec_timer() - start_us, __ATOMIC_RELAXED);
+    }
 
-        // update data pointer to prepare for next call to libusb_bulk_transfer
-        data += transferred_bytes / 2;
-        if (data > g_data + MAX_DATA) {
-            FATAL("data out of range, %zd\n", data-g_data);
-        }
-        if (data == g_data + MAX_DATA) {
-            DEBUG("resetting data to begining of circular buffer\n");
-            data = g_data;
-        }
+    // cancel the transfers that are in flight, and free the transfers
+    mccdaq_cancel_xfers(head, &inflight);
+    for (i = 0; i < g_max_xfer; i++) {
+        libusb_free_transfer(g_xfer[i].transfer);
+        g_xfer[i].transfer = NULL;
     }
 
     // stop the scan
@@ -374,16 +959,158 @@ static void * mccdaq_producer_thread(void * cx)
     return NULL;
 }
 
+static void mccdaq_xfer_callback(struct libusb_transfer * transfer)
+{
+    xfer_t * x = transfer->user_data;
+
+    x->done = true;
+}
+
+static void mccdaq_submit_xfers(int32_t head, int32_t * inflight, uint64_t * submitted)
+{
+    int32_t  length, ret;
+    xfer_t * x;
+
+    // submit transfers until g_max_xfer are in flight
+    while (*inflight < g_max_xfer) {
+        x = &g_xfer[(head + *inflight) % g_max_xfer];
+
+        // submit transfer of analog data from mcc usb 204 device directly to the ring;
+        // a transfer that extends beyond the end of the ring is written to the start
+        // of the ring through the mirror mapping
+        length = g_xfer_len;
+        libusb_fill_bulk_transfer(x->transfer,
+                                  g_udev,
+                                  LIBUSB_ENDPOINT_IN|1,
+                                  (uint8_t*)(g_data + (*submitted % MAX_DATA)),
+                                  length,
+                                  mccdaq_xfer_callback,
+                                  x,
+                                  g_xfer_tout_ms);
+        x->done = false;
+        ret = libusb_submit_transfer(x->transfer);
+        if (ret != LIBUSB_SUCCESS) {
+            ERROR("libusb_submit_transfer ret %d\n", ret);
+            break;
+        }
+
+        // keep track of transfers in flight, and the position of the next transfer
+        (*inflight)++;
+        *submitted += length / 2;
+    }
+}
+
+static void mccdaq_cancel_xfers(int32_t head, int32_t * inflight)
+{
+    struct timeval tv;
+    int32_t        i, wait_ms;
+
+    // cancel the transfers that are in flight
+    for (i = 0; i < *inflight; i++) {
+        libusb_cancel_transfer(g_xfer[(head + i) % g_max_xfer].transfer);
+    }
+
+    // wait for the cancelled transfers to complete
+    for (wait_ms = 0; wait_ms < 2000; wait_ms += 10) {
+        for (i = 0; i < *inflight; i++) {
+            if (!g_xfer[(head + i) % g_max_xfer].done) {
+                break;
+            }
+        }
+        if (i == *inflight) {
+            break;
+        }
+        tv.tv_sec  = 0;
+        tv.tv_usec = 10000;
+        libusb_handle_events_timeout(NULL, &tv);
+    }
+    if (wait_ms >= 2000) {
+        ERROR("transfers did not complete after being cancelled\n");
+    }
+
+    // data received by the cancelled transfers is discarded
+    for (i = 0; i < g_max_xfer; i++) {
+        g_xfer[i].done = false;
+    }
+    *inflight = 0;
+}
+
+static void mccdaq_restart_scan(struct libusb_transfer * t)
+{
+    int32_t status;
+    int32_t xfer_status  = (t ? t->status : -1);
+    int32_t length       = (t ? t->length : g_xfer_len);
+    int32_t actual_length = (t ? t->actual_length : 0);
+    int64_t now_ns, lost;
+
+    // the device status is only read here, when a transfer did not complete normally,
+    // or when no transfers are in flight
+    status = usbStatus_USB20X(g_udev);
+    if (xfer_status != LIBUSB_TRANSFER_STALL && xfer_status != LIBUSB_TRANSFER_COMPLETED) {
+        WARN("restarting, xfer_status=%d actual_length=%d status=0x%x\n", 
+             xfer_status, actual_length, status);
+    } else {
+        DEBUG("restarting, xfer_status=%d actual_length=%d status=0x%x\n", 
+              xfer_status, actual_length, status); 
+    }
+
+    // if length is a multiple of usb_max_packet_size the device will send a zero byte packet.
+    // refer to usbAInScanRead_USB20X routine in mccdaq/mcc-libusb/usb-20X.c
+    if (((length % g_usb_max_packet_size) == 0) && !(status & AIN_SCAN_RUNNING)) {
+        uint8_t value[64];
+        int32_t xfered;
+        libusb_bulk_transfer(g_udev, 
+                             LIBUSB_ENDPOINT_IN|1, 
+                             value, 
+                             2, 
+                             &xfered, 
+                             100);
+    }
+
+    // clear halt and restart the analog input scan
+    libusb_clear_halt(g_udev, LIBUSB_ENDPOINT_IN|1);
+    usbAInScanStart_USB20X(g_udev, 0, FREQUENCY, 1<<CHANNEL, OPTIONS, 0, 0);
+
+    // anchor the sample clock at the restart; the samples that the sample clock
+    // expected to be acquired between the last sample received and the restart are lost
+    now_ns = realtime_ns();
+    lost = (int64_t)mccdaq_time_to_sample_idx(now_ns) - (int64_t)g_produced;
+    if (lost < 0) {
+        lost = 0;
+    }
+    DEBUG("restarted, lost %"PRId64" samples\n", lost);
+    mccdaq_add_anchor(g_produced, now_ns, lost);
+}
+
+static void mccdaq_publish(int32_t count)
+{
+    // make data available to consumer thread, and wake the consumer
+    __atomic_store_n(&g_produced, g_produced + count, __ATOMIC_RELEASE);
+    mccdaq_wake_consumer();
+
+    // compare the sample clock with the realtime clock; 
+    // except when replaying, the sample times are from the raw capture file,
+    // or when the simulator runs faster or slower than the sample rate
+    if (!g_sample_clock_only) {
+        mccdaq_check_clock();
+    }
+}
+
 // -----------------  MCCDAQ CONSUMER THREAD-----------------------------
 
 static void * mccdaq_consumer_thread(void * cx) 
 {
-    int64_t    consumed = 0;
-    int64_t    produced;
-    int64_t    count, max_count;
-    uint16_t * data;
+    int64_t       consumed = 0;
+    int64_t       produced;
+    int64_t       count, fill;
+    uint16_t    * data;
+    uint64_t      val;
+    struct pollfd pfd;
+    uint64_t      start_us, duration_us;
+    int32_t       ret;
 
     g_consumer_thread_running = true;
+    mccdaq_set_thread_cpu("mccdaq_analysis", g_analysis_cpu);
 
     while (true) {
         // if state is STOPPING then
@@ -393,39 +1120,62 @@ static void * mccdaq_consumer_thread(void * cx)
             break;
         }
 
-        // if no data then delay 
-        produced = g_produced;
+        // if no data then wait for the producer to signal that data is available
+        produced = __atomic_load_n(&g_produced, __ATOMIC_ACQUIRE);
         if (produced == consumed) {
-            usleep(1000);
+            pfd.fd = g_event_fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, CONSUMER_WAIT_TOUT_MS) == 1) {
+                if (read(g_event_fd, &val, sizeof(val)) == sizeof(val)) {
+                    __atomic_fetch_add(&g_wakeup_count, 1, __ATOMIC_RELAXED);
+                }
+            }
             continue;
         }
 
-        // if too far behind then discard data
-        if (produced - consumed > 500000) {
+        // keep track of the ring fill level high water mark
+        fill = produced - consumed;
+        if (fill > g_fill_high_water) {
+            __atomic_store_n(&g_fill_high_water, fill, __ATOMIC_RELAXED);
+        }
+
+        // if the ring is about to be overrun then discard data
+        if (produced - consumed > MAX_FILL) {
             INFO("falling behind, discarding %"PRId64" samples\n", produced-consumed);
+            __atomic_fetch_add(&g_discarded, produced-consumed, __ATOMIC_RELAXED);
             consumed = produced;
+            __atomic_store_n(&g_consumed, consumed, __ATOMIC_RELEASE);
             continue;
         }
 
-        // call callback to process the data;
+        // call callback to process the data, the data is contiguous because of the
+        // ring mirror mapping; the data pointer is chosen so that the MCCDAQ_MAX_HISTORY
+        // samples preceding it are also mapped;
         // if callback requests stop then enter stopping state and exit thread
         count = produced - consumed;
         data = g_data + (consumed % MAX_DATA);
-        max_count = g_data + MAX_DATA - data;
-        if (count <= max_count) {
-            if (g_cb(data, count)) {
-                STATE_CHANGE(STOPPING);
-                break;
-            }
-        } else {
-            if (g_cb(data, max_count) || g_cb(g_data, count-max_count)) {
-                STATE_CHANGE(STOPPING);
-                break;
-            }
+        if (data - g_data < MCCDAQ_MAX_HISTORY) {
+            data += MAX_DATA;
+        }
+        start_us = microsec_timer();
+        ret = g_cb(data, count, consumed);
+        duration_us = microsec_timer() - start_us;
+        if (ret) {
+            STATE_CHANGE(STOPPING);
+            break;
+        }
+
+        // keep track of the analysis stage processing time
+        __atomic_store_n(&g_analysis_us, g_analysis_us + duration_us, __ATOMIC_RELAXED);
+        __atomic_store_n(&g_analysis_count, g_analysis_count + 1, __ATOMIC_RELAXED);
+        if (duration_us > g_analysis_max_us) {
+            __atomic_store_n(&g_analysis_max_us, duration_us, __ATOMIC_RELAXED);
         }
 
         // increase the amount consumed
         consumed += count;
+        __atomic_store_n(&g_consumed, consumed, __ATOMIC_RELEASE);
     }
 
     g_consumer_thread_running = false;
@@ -433,15 +1183,156 @@ static void * mccdaq_consumer_thread(void * cx)
     return NULL;
 }
 
+// -----------------  MCCDAQ REPLAY THREAD  -----------------------------
+
+// The replay thread is the producer when replaying a raw capture file. The
+// samples of each block are copied to the ring, and published, in pieces the
+// size of a bulk transfer. When replaying as fast as possible the thread waits 
+// for the consumer, so the consumer does not discard samples. The sample clock
+// is anchored at the first block, and at a block that does not follow the 
+// preceding block; the samples missing from the capture are counted as lost.
+
+static void * mccdaq_replay_thread(void * cx)
+{
+    raw_capture_hdr_t * hdr;
+    uint16_t          * samples;
+    int32_t             max_samples, i, len;
+    uint64_t            next_sample_idx = 0, replayed = 0, start_us, due_us, now_us;
+    int64_t             time_offset_ns = 0, lost;
+    bool                first = true;
+
+    g_producer_thread_running = true;
+    mccdaq_set_thread_cpu("mccdaq_replay", g_drain_cpu);
+
+    hdr = malloc(RAW_CAPTURE_BLOCK_LEN);
+    samples = malloc(RAW_CAPTURE_MAX_SAMPLES * sizeof(uint16_t));
+    if (hdr == NULL || samples == NULL) {
+        FATAL("malloc replay buffers\n");
+    }
+    start_us = microsec_timer();
+
+    while (g_state != STOPPING) {
+        // read and decode the next block; at end of file the replay is done
+        if (mccdaq_replay_read_block(hdr) < 0) {
+            break;
+        }
+        max_samples = raw_capture_decode(hdr, samples, RAW_CAPTURE_MAX_SAMPLES);
+        if (max_samples < 0) {
+            break;
+        }
+
+        // anchor the sample clock, if this is the first block or does not 
+        // follow the preceding block
+        if (first) {
+            time_offset_ns = realtime_ns() - hdr->time_ns;
+            mccdaq_add_anchor(g_produced, hdr->time_ns + time_offset_ns, 0);
+            first = false;
+        } else if (hdr->sample_idx != next_sample_idx) {
+            lost = (int64_t)(hdr->sample_idx - next_sample_idx);
+            mccdaq_add_anchor(g_produced, hdr->time_ns + time_offset_ns, lost > 0 ? lost : 0);
+        }
+        next_sample_idx = hdr->sample_idx + max_samples;
+
+        // copy the samples to the ring, and publish them
+        for (i = 0; i < max_samples && g_state != STOPPING; i += len) {
+            len = (max_samples - i < g_xfer_len / 2 ? max_samples - i : g_xfer_len / 2);
+            if (g_replay_realtime) {
+                due_us = start_us + (replayed + len) * 1000000 / FREQUENCY;
+                now_us = microsec_timer();
+                if (now_us < due_us) {
+                    usleep(due_us - now_us);
+                }
+            } else {
+                while (g_produced + len - __atomic_load_n(&g_consumed, __ATOMIC_ACQUIRE) > MAX_FILL &&
+                       g_state != STOPPING) 
+                {
+                    usleep(1000);
+                }
+            }
+            memcpy(&g_data[g_produced % MAX_DATA], samples + i, len * sizeof(uint16_t));
+            mccdaq_publish(len);
+            replayed += len;
+        }
+    }
+
+    INFO("replay done, %"PRId64" samples in %0.3f secs\n", 
+         replayed, (microsec_timer() - start_us) / 1000000.);
+    __atomic_store_n(&g_replay_done, true, __ATOMIC_RELEASE);
+
+    free(hdr);
+    free(samples);
+    g_producer_thread_running = false;
+    return NULL;
+}
+
+static int32_t mccdaq_replay_read_block(raw_capture_hdr_t * hdr)
+{
+    // read the header; if at end of file then return -1
+    if (fread(hdr, sizeof(raw_capture_hdr_t), 1, g_replay_fp) != 1) {
+        return -1;
+    }
+
+    // validate the header, and read the remainder of the block
+    if (hdr->magic != RAW_CAPTURE_MAGIC || 
+        hdr->block_len < sizeof(raw_capture_hdr_t) || hdr->block_len > RAW_CAPTURE_BLOCK_LEN) 
+    {
+        ERROR("invalid raw capture block, magic=0x%x block_len=%u\n", hdr->magic, hdr->block_len);
+        return -1;
+    }
+    if (fread(hdr + 1, hdr->block_len - sizeof(raw_capture_hdr_t), 1, g_replay_fp) != 1) {
+        ERROR("raw capture block truncated\n");
+        return -1;
+    }
+    return 0;
+}
+
 // -----------------  MCCDAQ TEST ---------------------------------------
 
-// unit test - simple simulation of the MCCDAQ ADC device
+// unit test - simple simulation of the MCCDAQ ADC device; 
+// when mccdaq_sim_config is called the samples are from the synthetic
+// pulse generator, otherwise a fixed pulse is produced every 25 transfers
 
 #ifdef MCCDAQ_TEST
 
-#define MAX_SIM_DATA 10000
+#define MAX_SIM_DATA  (MAX_XFER_LEN/2)
+#define MAX_SIM_QUEUE MAX_XFER
+
+static uint16_t                 g_sim_data[MAX_SIM_DATA];
+static struct libusb_transfer * g_sim_queue[MAX_SIM_QUEUE];
+static int32_t                  g_sim_queue_head;
+static int32_t                  g_sim_queue_count;
+static uint64_t                 g_sim_start_us;
+static uint64_t                 g_sim_samples;
+static pulse_gen_t            * g_sim_gen;
+static double                   g_sim_speed = 1;
+
+static void sim_fill(uint16_t * data, int32_t max_data);
+
+// must be called prior to mccdaq_init; the spec is described in util_pulse_gen.c,
+// and the generated pulses are written to truth_filename, if not NULL
+int32_t mccdaq_sim_config(char * spec, char * truth_filename)
+{
+    g_sim_gen = calloc(1, sizeof(pulse_gen_t));
+    if (g_sim_gen == NULL) {
+        FATAL("calloc failed\n");
+    }
+    if (pulse_gen_init(g_sim_gen, spec, FREQUENCY, truth_filename) < 0) {
+        free(g_sim_gen);
+        g_sim_gen = NULL;
+        return -1;
+    }
+
+    g_sim_speed = g_sim_gen->speed;
+    if (g_sim_speed != 1) {
+        g_sample_clock_only = true;
+    }
+    return 0;
+}
 
-static uint16_t g_sim_data[MAX_SIM_DATA];
+pulse_gen_t * mccdaq_sim_get_pulse_gen(void)
+{
+    return g_sim_gen;
+}
 
 int libusb_init (void ** cx)
 {
@@ -465,8 +1356,6 @@ int libusb_bulk_transfer (struct libusb_device_handle *dev_handle, unsigned char
     uint16_t *data = (uint16_t*)data_arg;
     uint32_t max_data = length / 2;
 
-    static uint64_t count;
-
     // validate length and max_data
     if (length <= 0 || (length & 1) || max_data > MAX_SIM_DATA) {
         FATAL("invalid length %d, max_data %d\n", length, max_data);
@@ -479,7 +1368,104 @@ int libusb_bulk_transfer (struct libusb_device_handle *dev_handle, unsigned char
     }
 
     // init the simulated return data
-    memcpy(data, g_sim_data, length);
+    sim_fill(data, max_data);
+
+    // set transferred length 
+    *transferred = length;
+
+    // delay 
+    us = max_data * 1000000L / FREQUENCY / g_sim_speed;
+    DEBUG("SLEEP %ld, MAX_DATA = %d\n", us, max_data);
+    usleep(us);
+
+    // return success
+    return 0;
+}
+
+struct libusb_transfer * libusb_alloc_transfer(int iso_packets)
+{
+    return calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+    free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+    // validate length
+    if (transfer->length <= 0 || (transfer->length & 1) || transfer->length/2 > MAX_SIM_DATA) {
+        FATAL("invalid length %d\n", transfer->length);
+    }
+
+    // add the transfer to the tail of the queue
+    if (g_sim_queue_count == MAX_SIM_QUEUE) {
+        return LIBUSB_ERROR_BUSY;
+    }
+    transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    transfer->actual_length = 0;
+    g_sim_queue[(g_sim_queue_head + g_sim_queue_count) % MAX_SIM_QUEUE] = transfer;
+    g_sim_queue_count++;
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+    transfer->status = LIBUSB_TRANSFER_CANCELLED;
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_handle_events_timeout(void *ctx, struct timeval *tv)
+{
+    struct libusb_transfer * t;
+    uint64_t now_us, due_us, tout_us;
+
+    // if no transfers are queued then just delay
+    tout_us = tv->tv_sec * 1000000L + tv->tv_usec;
+    if (g_sim_queue_count == 0) {
+        usleep(tout_us);
+        return LIBUSB_SUCCESS;
+    }
+
+    // the transfer at the head of the queue completes when the simulated
+    // device has acquired enough samples to fill it; cancelled transfers
+    // complete immediately
+    t = g_sim_queue[g_sim_queue_head];
+    if (t->status != LIBUSB_TRANSFER_CANCELLED) {
+        due_us = g_sim_start_us + (g_sim_samples + t->length/2) * 1000000L / FREQUENCY / g_sim_speed;
+        now_us = microsec_timer();
+        if (now_us < due_us) {
+            if (due_us - now_us > tout_us) {
+                usleep(tout_us);
+                return LIBUSB_SUCCESS;
+            }
+            usleep(due_us - now_us);
+        }
+        sim_fill((uint16_t*)t->buffer, t->length/2);
+        t->actual_length = t->length;
+        g_sim_samples += t->length/2;
+    }
+
+    // remove the transfer from the queue, and call its callback
+    g_sim_queue_head = (g_sim_queue_head + 1) % MAX_SIM_QUEUE;
+    g_sim_queue_count--;
+    t->callback(t);
+    return LIBUSB_SUCCESS;
+}
+
+static void sim_fill(uint16_t * data, int32_t max_data)
+{
+    static uint64_t count;
+
+    // use the pulse generator, if configured
+    if (g_sim_gen) {
+        pulse_gen_fill(g_sim_gen, data, max_data);
+        return;
+    }
+
+    // init the simulated return data
+    memcpy(data, g_sim_data, max_data*sizeof(uint16_t));
     if (((count % 25) == 0) && (max_data > 20)) {
         if ((count/25) & 1) {
             data[0] = 3000;
@@ -494,17 +1480,6 @@ int libusb_bulk_transfer (struct libusb_device_handle *dev_handle, unsigned char
         }
     }
     count++;
-
-    // set transferred length 
-    *transferred = length;
-
-    // delay 
-    us = max_data * 1000000L / FREQUENCY;
-    DEBUG("SLEEP %ld, MAX_DATA = %d\n", us, max_data);
-    usleep(us);
-
-    // return success
-    return 0;
 }
 
 int libusb_clear_halt (libusb_device_handle *dev, unsigned char endpoint)
@@ -541,6 +1516,8 @@ void cleanup_USB20X(libusb_device_handle *udev)
 void usbAInScanStart_USB20X(libusb_device_handle *udev, uint32_t count, double frequency,
         uint8_t channels, uint8_t options, uint8_t trigger_source, uint8_t trigger_mode)
 {
+    g_sim_start_us = microsec_timer();
+    g_sim_samples = 0;
 }
 
 uint16_t usbStatus_USB20X(libusb_device_handle *udev)
@@ -23,11 +23,50 @@ SOFTWARE.
 #ifndef __UTIL_MCCDAQ_H__
 #define __UTIL_MCCDAQ_H__
 
-typedef int32_t (*mccdaq_callback_t)(uint16_t * data, int32_t max_data);
+// The data passed to the callback is a contiguous view of the mccdaq ring.
+// The MCCDAQ_MAX_HISTORY samples that precede data are also readable; these
+// are the samples that were passed to the prior calls of the callback.
+// The sample_idx is the index of data[0] in the stream of samples produced 
+// since mccdaq_start; it skips ahead when samples are discarded.
+#define MCCDAQ_MAX_HISTORY  1000000
+
+typedef int32_t (*mccdaq_callback_t)(uint16_t * data, int32_t max_data, uint64_t sample_idx);
+
+typedef struct {
+    uint64_t produced;          // total samples written to the ring by the producer
+    uint64_t consumed;          // total samples passed to the callback, or discarded
+    uint64_t discarded;         // samples discarded because the consumer fell behind
+    int64_t  fill;              // samples in the ring waiting for the consumer
+    int64_t  fill_high_water;   // max fill since mccdaq_start
+    uint64_t wakeup_count;      // number of times the producer woke the consumer
+    int32_t  xfer_inflight;     // drain stage queue depth, bulk transfers in flight
+    uint64_t drain_us;          // drain stage processing time, handling transfer completions
+    uint64_t analysis_us;       // analysis stage processing time, in the callback
+    uint64_t analysis_max_us;   // max time of a callback since mccdaq_start
+    uint64_t analysis_count;    // number of callbacks
+    int64_t  lost_samples;      // samples not acquired while the scan was being restarted
+    int64_t  clock_drift_ns;    // last measured offset of the realtime clock from the sample clock
+    int32_t  clock_correction_count;  // number of sample clock drift corrections
+    bool     replay_done;       // the raw capture file being replayed has been read
+} mccdaq_stats_t;
 
 int32_t mccdaq_init(void);
+int32_t mccdaq_init_replay(char * filename, bool realtime);
+int32_t mccdaq_set_xfer_params(int32_t max_xfer, int32_t xfer_len);
+int32_t mccdaq_set_cpu_affinity(int32_t drain_cpu, int32_t analysis_cpu);
 int32_t  mccdaq_start(mccdaq_callback_t cb);
 int32_t  mccdaq_stop(void);
 int32_t mccdaq_get_restart_count(void);
+int32_t mccdaq_get_stats(mccdaq_stats_t * stats);
+int64_t mccdaq_sample_time_ns(uint64_t sample_idx);
+uint64_t mccdaq_time_to_sample_idx(int64_t time_ns);
+int64_t mccdaq_lost_samples(uint64_t sample_idx_start, uint64_t sample_idx_end);
+int64_t mccdaq_copy_samples(uint64_t * sample_idx, uint16_t * buff, int64_t max_buff);
+
+#ifdef MCCDAQ_TEST
+#include "util_pulse_gen.h"
+int32_t mccdaq_sim_config(char * spec, char * truth_filename);
+pulse_gen_t * mccdaq_sim_get_pulse_gen(void);
+#endif
 
 #endif
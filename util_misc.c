@@ -30,6 +30,7 @@ SOFTWARE.
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 
 #include <sys/time.h>
 #include <time.h>
@@ -195,6 +196,32 @@ int config_write(char * config_path, config_t * config, int config_version)
     return 0;
 }
 
+// -----------------  FILE ROTATION  -----------------------------------
+
+// renames filename.N-1 to filename.N, ..., filename to filename.1, keeping
+// max_files files; this discards the oldest file; the caller must close
+// filename before calling, and create a new filename afterwards
+void rotate_files(char * filename, int32_t max_files)
+{
+    char from[PATH_MAX+16], to[PATH_MAX+16];
+    int  i;
+
+    for (i = max_files - 1; i >= 1; i--) {
+        sprintf(to, "%s.%d", filename, i);
+        if (i == 1) {
+            strcpy(from, filename);
+        } else {
+            sprintf(from, "%s.%d", filename, i-1);
+        }
+        if (rename(from, to) < 0 && errno != ENOENT) {
+            ERROR("rename %s to %s, %s\n", from, to, strerror(errno));
+        }
+    }
+    if (max_files == 1) {
+        unlink(filename);
+    }
+}
+
 // -----------------  NETWORKING  ----------------------------------------
 
 int getsockaddr(char * node, int port, struct sockaddr_in * ret_addr)
@@ -81,6 +81,10 @@ typedef struct {
 int config_read(char * config_path, config_t * config, int config_version);
 int config_write(char * config_path, config_t * config, int config_version);
 
+// -----------------  FILE ROTATION  ---------------------------------------------
+
+void rotate_files(char * filename, int32_t max_files);
+
 // -----------------  NETWORKING  ----------------------------------------
 
 int getsockaddr(char * node, int port, struct sockaddr_in * ret_addr);
@@ -0,0 +1,980 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "util_pulse.h"
+#include "util_misc.h"
+
+// NOTES:
+//
+// The detector is a state machine that is fed the sample stream in arbitrary
+// sized pieces. The most recent samples are kept in the hist[] circular buffer,
+// and each sample is evaluated EVAL_DELAY samples after it has been received.
+// This delay provides the samples following the pulse that are needed for the
+// pulse_t raw data, so that a pulse is reported as soon as its end has been 
+// evaluated.
+// 
+// The pulse_t waveform and raw data start PULSE_WAVEFORM_LEN/2 samples before
+// the pulse start, and these samples are also in hist[]; therefore evaluation
+// starts at that sample index.
+//
+// In PULSE_DETECT_MODE_SIMD the samples are scanned in SCAN_BLOCK_LEN blocks.
+// When the detector is not in a pulse, evaluating a sample that is within 
+// the scan band around the baseline does not start a pulse. So a block of such
+// samples is skipped,
+// only the baseline tracker is updated, and hist[] is refilled from the caller's
+// data before the next sample is evaluated. The blocks start at the first sample
+// of each call; the samples evaluated while receiving the first block were
+// received in the preceding call, and are taken from hist[]. All other blocks, which contain pulse
+// candidates, are evaluated by the state machine. The scan uses AVX2 (when 
+// supported by the cpu), SSE2, or NEON; and a scalar version otherwise.
+//
+// Baseline: the baseline is the mode of a running histogram of every 
+// BASELINE_DECIMATE'th sample, over the last PULSE_BASELINE_WINDOW of these.
+// The mode is robust to the pulses, so all samples are included. Each update
+// is O(1): the added sample's bin becomes the mode if its count exceeds the
+// mode's count, and when a sample is removed from the mode's bin the mode moves
+// to a neighboring bin that has a larger count. The baseline is determined by
+// the first sample, and follows a gain or offset shift once the samples at the
+// new level are the majority of the window, about 8 ms. An upward shift of more
+// than threshold counts is seen as an excursion that is too long; when this 
+// occurs the tracker is restarted at the current sample, so the baseline 
+// recovers immediately. The baseline can move
+// by at most 1 count per update, or to the value of a sample in the block. So
+// while a block whose samples are within baseline +/- band is skipped, the baseline
+// stays above the baseline when the block was scanned less band + SCAN_BLOCK_LEN / 
+// BASELINE_DECIMATE; the band is chosen so that the skipped samples could not have 
+// started a pulse: 2 * band + SCAN_BLOCK_LEN / BASELINE_DECIMATE < threshold.
+//
+// Pile-up: while in a pulse, the detector tracks the peaks of the excursion.
+// After a peak, a fall of at least threshold counts followed by a rise of at
+// least threshold counts from the valley starts another peak. An excursion 
+// with more than one peak is a pile-up of overlapping pulses; it is reported
+// once, with the height of each peak, and is allowed to be up to MAX_PILEUP_LEN
+// long instead of MAX_PULSE_LEN. The samples spent in excursions, including
+// those that are discarded as too long, are counted in busy_count; this is the
+// detector's dead time.
+//
+// Parallel: pulse_detect_process_parallel divides the data into chunks, one per
+// thread. The detector for each chunk, other than the first, is started
+// PARALLEL_WARMUP_LEN samples before the chunk; this is long enough to fill the
+// baseline tracker window twice, so that the detector's state at the start of
+// the chunk is usually the same as the state of a detector that processed all
+// of the preceding samples. The pulses reported during the warmup are not kept.
+// The chunks are then merged in order: a chunk's pulses and counters are used
+// when its state at the start of the chunk equals the merged state at the end
+// of the preceding chunk; otherwise (for example, the baseline tracker's mode
+// took a different path) the chunk is reprocessed sequentially, starting from
+// the merged state. The chunk's detector saves its baseline, baseline rms, and 
+// counters with each pulse; when the pulse is reported to the caller's callback
+// these are copied to the caller's detector, adjusted by the merged counters, 
+// so that the callback sees the detector state it would see with 
+// pulse_detect_process. So the result is identical to pulse_detect_process. 
+
+//
+// defines
+//
+
+#define HIST_MASK           (PULSE_HIST_LEN-1)
+#define HIST(pd,idx)        ((pd)->hist[(idx) & HIST_MASK])
+
+#define EVAL_DELAY          16
+#define MAX_PULSE_LEN       10
+#define MAX_PILEUP_LEN      30
+
+#define COUNTS_TO_MV(x)     ((x) * 10000 / 2048)
+
+#define SCAN_BLOCK_LEN      64
+
+#define BASELINE_DECIMATE   16    // must be power of 2
+#define BL_HIST(pd,val)     ((pd)->bl_hist[(val)+1])
+#define SCAN_BAND(thresh)   (((thresh) - 1 - SCAN_BLOCK_LEN / BASELINE_DECIMATE) / 2)
+
+#define PARALLEL_WARMUP_LEN     (2 * PULSE_BASELINE_WINDOW * BASELINE_DECIMATE)
+#define PARALLEL_MIN_CHUNK_LEN  (1 << 20)
+#define PARALLEL_MAX_PROCESS    (1 << 30)   // max samples per call to pulse_detect_process
+
+// the chunks start on a SCAN_BLOCK_LEN boundary from the start of the data, as the 
+// SIMD mode blocks do, so that the same blocks are skipped as by pulse_detect_process
+#define CHUNK_FIRST(max_data,i,max_chunks)  (((max_data) * (i) / (max_chunks)) & ~(int64_t)(SCAN_BLOCK_LEN-1))
+
+#if PULSE_RAW_LEN - PULSE_WAVEFORM_LEN/2 - 2 > EVAL_DELAY
+#error "EVAL_DELAY too small"
+#endif
+#if PULSE_WAVEFORM_LEN/2 + MAX_PILEUP_LEN + EVAL_DELAY >= PULSE_HIST_LEN
+#error "PULSE_HIST_LEN too small"
+#endif
+#if PULSE_WAVEFORM_LEN > PULSE_RAW_LEN
+#error "PULSE_RAW_LEN too small"
+#endif
+
+//
+// typedefs
+//
+
+typedef struct {
+    pulse_t          pulse;
+    int64_t          sample_count;     // the chunk detector's state when the pulse was reported
+    int32_t          baseline;
+    double           baseline_rms;
+    uint64_t         pulse_count;
+    uint64_t         too_long_count;
+    uint64_t         out_of_range_count;
+    uint64_t         skipped_count;
+    uint64_t         pileup_count;
+    uint64_t         busy_count;
+} chunk_pulse_t;
+
+typedef struct {
+    uint16_t       * data;         // the chunk's samples
+    int64_t          len;
+    int64_t          warmup_len;   // samples preceding data that are processed first
+    pulse_detect_t   pd;           // the chunk's detector
+    pulse_detect_t   start;        // the detector's state at the start of the chunk
+    bool             keep;         // the warmup is done, pulses are kept
+    chunk_pulse_t  * pulses;       // the pulses reported in the chunk
+    int32_t          max_pulses;
+    int32_t          alloc_pulses;
+    pthread_t        thread;
+} chunk_t;
+
+//
+// variables
+//
+
+static bool (*scan_block_quiet)(uint16_t * data, uint16_t lo, uint16_t hi);
+static char * scan_block_name;
+
+//
+// prototypes
+//
+
+static inline void pulse_detect_sample(pulse_detect_t * pd, uint16_t val);
+static inline void pulse_detect_eval(pulse_detect_t * pd, int64_t idx);
+static inline void pulse_detect_baseline_update(pulse_detect_t * pd, int32_t val);
+static void pulse_detect_baseline_restart(pulse_detect_t * pd, int32_t val);
+static void pulse_detect_report(pulse_detect_t * pd, int64_t pulse_end);
+static void pulse_detect_refill_hist(pulse_detect_t * pd, uint16_t * data, int32_t cnt);
+static inline uint16_t * scan_block_data(pulse_detect_t * pd, uint16_t * data, int32_t i, uint16_t * first_block);
+static void scan_block_select(void);
+static void counts_to_mv(int16_t * mv, uint16_t * raw, int32_t baseline, int32_t cnt);
+static void pulse_detect_process_long(pulse_detect_t * pd, uint16_t * data, int64_t max_data);
+static void * parallel_chunk_thread(void * cx);
+static void parallel_chunk_cb(pulse_t * pulse, void * cx);
+static bool parallel_state_equal(pulse_detect_t * a, pulse_detect_t * b);
+static void parallel_merge_pulse(pulse_detect_t * pd, pulse_detect_t * base, chunk_t * c, chunk_pulse_t * p);
+static void parallel_merge_state(pulse_detect_t * pd, pulse_detect_t * base, chunk_t * c);
+
+// -----------------  API  ---------------------------------------------------------
+
+void pulse_detect_init(pulse_detect_t * pd, int32_t threshold, pulse_detect_cb_t cb, void * cb_cx)
+{
+    bzero(pd, sizeof(pulse_detect_t));
+    pd->threshold   = threshold;
+    pd->cb          = cb;
+    pd->cb_cx       = cb_cx;
+    pd->mode        = PULSE_DETECT_MODE_SIMD;
+    pd->pulse_start = -1;
+    pd->eval_start  = PULSE_WAVEFORM_LEN/2;
+
+    scan_block_select();
+}
+
+void pulse_detect_set_mode(pulse_detect_t * pd, int32_t mode)
+{
+    pd->mode = mode;
+}
+
+// the next sample passed to pulse_detect_process will be sample_idx, this is used when
+// the sample stream has a gap; a pulse in progress is discarded, and evaluation
+// resumes once the samples that preceded sample_idx are no longer needed
+void pulse_detect_resync(pulse_detect_t * pd, int64_t sample_idx)
+{
+    if (sample_idx == pd->sample_count) {
+        return;
+    }
+    pd->sample_count = sample_idx;
+    pd->eval_start   = sample_idx + PULSE_WAVEFORM_LEN/2;
+    pd->pulse_start  = -1;
+}
+
+// all pulses that start before the returned sample index have been reported
+int64_t pulse_detect_settled_idx(pulse_detect_t * pd)
+{
+    return (pd->pulse_start != -1 ? pd->pulse_start : pd->sample_count - EVAL_DELAY);
+}
+
+// returns the rms noise of the baseline, adc counts; this is computed from the 
+// baseline tracker's histogram bins within threshold of the baseline
+double pulse_detect_baseline_rms(pulse_detect_t * pd)
+{
+    int32_t val, lo, hi, cnt;
+    double  n = 0, sum = 0, sum_sq = 0, mean;
+
+    if (pd->merging) {
+        return pd->baseline_rms_merge;
+    }
+    if (pd->baseline == 0) {
+        return 0;
+    }
+
+    lo = (pd->baseline - pd->threshold < 0 ? 0 : pd->baseline - pd->threshold);
+    hi = (pd->baseline + pd->threshold > 4095 ? 4095 : pd->baseline + pd->threshold);
+    for (val = lo; val <= hi; val++) {
+        cnt = BL_HIST(pd,val);
+        n      += cnt;
+        sum    += (double)cnt * val;
+        sum_sq += (double)cnt * val * val;
+    }
+    if (n == 0) {
+        return 0;
+    }
+    mean = sum / n;
+    return sqrt(sum_sq / n - mean * mean > 0 ? sum_sq / n - mean * mean : 0);
+}
+
+// returns the true pulse rate, given the measured rate and the dead time per 
+// measured pulse (rate in pulses/sec, tau in secs)
+// - NONPARALYZABLE: m = n / (1 + n * tau), so n = m / (1 - m * tau)
+// - PARALYZABLE: m = n * exp(-n * tau); the measured rate is at most 
+//   1 / (e * tau), at n = 1 / tau; the solution with n < 1 / tau is 
+//   found using newton's method, which converges from below starting at n = m
+double pulse_rate_corrected(int32_t model, double m, double tau)
+{
+    double n, n_next, e;
+    int32_t i;
+
+    if (m <= 0 || tau <= 0) {
+        return m;
+    }
+
+    switch (model) {
+    case PULSE_DEAD_TIME_MODEL_NONPARALYZABLE:
+        if (m * tau > 0.99) {
+            m = 0.99 / tau;
+        }
+        return m / (1 - m * tau);
+    case PULSE_DEAD_TIME_MODEL_PARALYZABLE:
+        if (m * tau >= 1 / M_E) {
+            return 1 / tau;
+        }
+        n = m;
+        for (i = 0; i < 50; i++) {
+            e = exp(-n * tau);
+            n_next = n - (n * e - m) / (e * (1 - n * tau));
+            if (n_next - n < n * 1e-9) {
+                return n_next;
+            }
+            n = n_next;
+        }
+        return n;
+    default:
+        return m;
+    }
+}
+
+char * pulse_detect_simd_name(void)
+{
+    scan_block_select();
+    return scan_block_name;
+}
+
+void pulse_detect_process(pulse_detect_t * pd, uint16_t * data, int32_t max_data)
+{
+    int32_t    i, j, end, band;
+    int64_t    idx;
+    bool       hist_stale = false;
+    uint16_t   first_block[SCAN_BLOCK_LEN];
+    uint16_t * scan;
+
+    // scalar mode: evaluate every sample
+    if (pd->mode == PULSE_DETECT_MODE_SCALAR) {
+        for (i = 0; i < max_data; i++) {
+            pulse_detect_sample(pd, data[i]);
+        }
+        return;
+    }
+
+    // simd mode ...
+    // the samples evaluated while receiving data[i .. i+SCAN_BLOCK_LEN-1] are
+    // data[i-EVAL_DELAY .. i-EVAL_DELAY+SCAN_BLOCK_LEN-1]; if these are all within
+    // the scan band then the block is skipped, otherwise the block 
+    // is processed by the state machine; for the first block, i is 0, and the 
+    // first EVAL_DELAY of these samples are the last samples in hist
+    band = SCAN_BAND(pd->threshold);
+    i = 0;
+    while (i < max_data) {
+        if (pd->pulse_start == -1 &&
+            pd->baseline != 0 &&
+            band >= 1 &&
+            i + SCAN_BLOCK_LEN <= max_data &&
+            scan_block_quiet((scan = scan_block_data(pd, data, i, first_block)), 
+                             pd->baseline - band < 0 ? 0 : pd->baseline - band, 
+                             pd->baseline + band > 4095 ? 4095 : pd->baseline + band))
+        {
+            // the last EVAL_DELAY samples received were not scanned, so check them
+            // for out of range values
+            for (j = i + SCAN_BLOCK_LEN - EVAL_DELAY; j < i + SCAN_BLOCK_LEN; j++) {
+                if (data[j] > 4095) {
+                    pd->out_of_range_count++;
+                }
+            }
+
+            // update the baseline tracker with the samples that would have been
+            // evaluated, scan[j] is sample idx+j
+            idx = pd->sample_count - EVAL_DELAY;
+            for (j = (-idx) & (BASELINE_DECIMATE-1); j < SCAN_BLOCK_LEN; j += BASELINE_DECIMATE) {
+                if (idx + j >= pd->eval_start) {
+                    pulse_detect_baseline_update(pd, scan[j]);
+                }
+            }
+            pd->sample_count += SCAN_BLOCK_LEN;
+            pd->skipped_count += SCAN_BLOCK_LEN;
+            i += SCAN_BLOCK_LEN;
+            hist_stale = true;
+            continue;
+        }
+
+        if (hist_stale) {
+            pulse_detect_refill_hist(pd, data, i);
+            hist_stale = false;
+        }
+
+        end = i + SCAN_BLOCK_LEN;
+        if (end > max_data) {
+            end = max_data;
+        }
+        for (; i < end; i++) {
+            pulse_detect_sample(pd, data[i]);
+        }
+    }
+
+    if (hist_stale) {
+        pulse_detect_refill_hist(pd, data, i);
+    }
+}
+
+// same result as pulse_detect_process, using up to max_threads threads; the data 
+// is divided into chunks of at least PARALLEL_MIN_CHUNK_LEN samples, so when 
+// max_data is small this is the same as pulse_detect_process
+void pulse_detect_process_parallel(pulse_detect_t * pd, uint16_t * data, int64_t max_data, int32_t max_threads)
+{
+    chunk_t      * chunks;
+    pulse_detect_t base;
+    int32_t        max_chunks, i, j;
+    int64_t        first;
+
+    // determine the number of chunks, one per thread; 
+    // if just 1 then process the data sequentially
+    max_chunks = max_threads;
+    if (max_chunks > max_data / PARALLEL_MIN_CHUNK_LEN) {
+        max_chunks = max_data / PARALLEL_MIN_CHUNK_LEN;
+    }
+    if (max_chunks <= 1) {
+        pulse_detect_process_long(pd, data, max_data);
+        return;
+    }
+
+    // init the chunks; the first chunk's detector is a copy of the caller's, 
+    // and the others are started PARALLEL_WARMUP_LEN samples before their chunk
+    chunks = calloc(max_chunks, sizeof(chunk_t));
+    if (chunks == NULL) {
+        FATAL("calloc chunks, max_chunks=%d\n", max_chunks);
+    }
+    for (i = 0; i < max_chunks; i++) {
+        chunk_t * c = &chunks[i];
+        first    = CHUNK_FIRST(max_data, i, max_chunks);
+        c->data  = data + first;
+        c->len   = (i == max_chunks - 1 ? max_data : CHUNK_FIRST(max_data, i+1, max_chunks)) - first;
+        if (i == 0) {
+            c->pd = *pd;
+            c->pd.cb = parallel_chunk_cb;
+            c->pd.cb_cx = c;
+        } else {
+            pulse_detect_init(&c->pd, pd->threshold, parallel_chunk_cb, c);
+            pulse_detect_set_mode(&c->pd, pd->mode);
+            pulse_detect_resync(&c->pd, pd->sample_count + first - PARALLEL_WARMUP_LEN);
+            c->warmup_len = PARALLEL_WARMUP_LEN;
+        }
+    }
+
+    // process the chunks, the first in this thread
+    for (i = 1; i < max_chunks; i++) {
+        if (pthread_create(&chunks[i].thread, NULL, parallel_chunk_thread, &chunks[i]) != 0) {
+            FATAL("pthread_create parallel_chunk_thread, %s\n", strerror(errno));
+        }
+    }
+    parallel_chunk_thread(&chunks[0]);
+    for (i = 1; i < max_chunks; i++) {
+        pthread_join(chunks[i].thread, NULL);
+    }
+
+    // merge the chunks in order; if a chunk's starting state differs from
+    // the merged state then the chunk is reprocessed from the merged state;
+    // before each of the chunk's pulses is reported the detector state is 
+    // advanced to the state when the chunk's detector reported the pulse
+    for (i = 0; i < max_chunks; i++) {
+        chunk_t * c = &chunks[i];
+        if (i == 0 || parallel_state_equal(pd, &c->start)) {
+            base = *pd;
+            for (j = 0; j < c->max_pulses; j++) {
+                parallel_merge_pulse(pd, &base, c, &c->pulses[j]);
+                pd->cb(&c->pulses[j].pulse, pd->cb_cx);
+            }
+            parallel_merge_state(pd, &base, c);
+        } else {
+            pd->parallel_redo_count++;
+            pulse_detect_process_long(pd, c->data, c->len);
+        }
+        free(c->pulses);
+    }
+    free(chunks);
+}
+
+// -----------------  PRIVATE  -----------------------------------------------------
+
+static inline void pulse_detect_sample(pulse_detect_t * pd, uint16_t val)
+{
+    int64_t idx;
+
+    // replace out of range value
+    if (val > 4095) {
+        pd->out_of_range_count++;
+        val = 2048;
+    }
+
+    // save the sample in hist
+    HIST(pd, pd->sample_count) = val;
+
+    // evaluate the sample that was received EVAL_DELAY samples ago
+    idx = pd->sample_count - EVAL_DELAY;
+    if (idx >= pd->eval_start) {
+        pulse_detect_eval(pd, idx);
+    }
+    pd->sample_count++;
+}
+
+static void pulse_detect_refill_hist(pulse_detect_t * pd, uint16_t * data, int32_t cnt)
+{
+    int32_t i, first;
+    uint16_t val;
+
+    // data[0 .. cnt-1] have been received, and the last of these is sample
+    // sample_count-1; copy the most recent of these to hist, the out of range
+    // values were counted when they were evaluated
+    first = (cnt > PULSE_HIST_LEN ? cnt - PULSE_HIST_LEN : 0);
+    for (i = first; i < cnt; i++) {
+        val = data[i];
+        HIST(pd, pd->sample_count - cnt + i) = (val > 4095 ? 2048 : val);
+    }
+}
+
+// returns the samples evaluated while receiving data[i .. i+SCAN_BLOCK_LEN-1];
+// the blocks start at data[0], so when i is less than EVAL_DELAY it is 0, and 
+// the first EVAL_DELAY samples, which were received in the preceding call, are 
+// copied from hist to first_block, followed by the first samples of data
+static inline uint16_t * scan_block_data(pulse_detect_t * pd, uint16_t * data, int32_t i, uint16_t * first_block)
+{
+    int32_t j;
+
+    if (i >= EVAL_DELAY) {
+        return data + i - EVAL_DELAY;
+    }
+    for (j = 0; j < EVAL_DELAY; j++) {
+        first_block[j] = HIST(pd, pd->sample_count - EVAL_DELAY + j);
+    }
+    memcpy(first_block + EVAL_DELAY, data, (SCAN_BLOCK_LEN - EVAL_DELAY) * sizeof(uint16_t));
+    return first_block;
+}
+
+static inline void pulse_detect_eval(pulse_detect_t * pd, int64_t idx)
+{
+    int32_t val = HIST(pd, idx);
+
+    // update the baseline tracker with every BASELINE_DECIMATE'th sample
+    if ((idx & (BASELINE_DECIMATE-1)) == 0) {
+        pulse_detect_baseline_update(pd, val);
+    }
+
+    // if baseline has not yet been determined then return
+    if (pd->baseline == 0) {
+        return;
+    }
+
+    // state machine ...
+    // - not in a pulse: a value at or above threshold starts a pulse
+    // - in a pulse: a value below threshold ends the pulse, and the
+    //   pulse is reported; a pulse that is too long is discarded;
+    //   otherwise the peaks of the pulse are tracked
+    if (pd->pulse_start == -1) {
+        if (val >= pd->baseline + pd->threshold) {
+            pd->pulse_start = idx;
+            pd->pulse_peaks = 1;
+            pd->pulse_peak_max[0] = val;
+            pd->pulse_falling = false;
+        }
+    } else if (val < pd->baseline + pd->threshold) {
+        pulse_detect_report(pd, idx-1);
+        pd->busy_count += idx - pd->pulse_start;
+        pd->pulse_start = -1;
+    } else if (idx - pd->pulse_start >= (pd->pulse_peaks > 1 ? MAX_PILEUP_LEN : MAX_PULSE_LEN)) {
+        pd->too_long_count++;
+        pd->busy_count += idx - pd->pulse_start;
+        pd->pulse_start = -1;
+        pulse_detect_baseline_restart(pd, val);
+    } else if (!pd->pulse_falling) {
+        if (val > pd->pulse_peak_max[pd->pulse_peaks-1]) {
+            pd->pulse_peak_max[pd->pulse_peaks-1] = val;
+        } else if (val <= pd->pulse_peak_max[pd->pulse_peaks-1] - pd->threshold) {
+            pd->pulse_falling = true;
+            pd->pulse_valley = val;
+        }
+    } else {
+        if (val < pd->pulse_valley) {
+            pd->pulse_valley = val;
+        } else if (val >= pd->pulse_valley + pd->threshold && pd->pulse_peaks < PULSE_MAX_PEAKS) {
+            pd->pulse_peak_max[pd->pulse_peaks++] = val;
+            pd->pulse_falling = false;
+        }
+    }
+}
+
+static inline void pulse_detect_baseline_update(pulse_detect_t * pd, int32_t val)
+{
+    int32_t old;
+
+    // remove the oldest sample from the histogram, once the window is full;
+    // if it was removed from the mode's bin then the mode moves to a neighbor
+    // bin with a larger count
+    if (pd->bl_count == PULSE_BASELINE_WINDOW) {
+        old = pd->bl_ring[pd->bl_ring_idx];
+        BL_HIST(pd,old)--;
+        if (old == pd->baseline) {
+            if (BL_HIST(pd,old-1) > BL_HIST(pd,old)) {
+                pd->baseline = old-1;
+            } else if (BL_HIST(pd,old+1) > BL_HIST(pd,old)) {
+                pd->baseline = old+1;
+            }
+        }
+    } else {
+        pd->bl_count++;
+    }
+
+    // add the new sample; if its bin count exceeds the mode's then it is the mode
+    pd->bl_ring[pd->bl_ring_idx] = val;
+    pd->bl_ring_idx = (pd->bl_ring_idx + 1) % PULSE_BASELINE_WINDOW;
+    BL_HIST(pd,val)++;
+    if (BL_HIST(pd,val) > BL_HIST(pd,pd->baseline)) {
+        pd->baseline = val;
+    }
+}
+
+static void pulse_detect_baseline_restart(pulse_detect_t * pd, int32_t val)
+{
+    int32_t i;
+
+    // clear the histogram bins of the samples in the window, and
+    // restart the tracker with val
+    for (i = 0; i < pd->bl_count; i++) {
+        BL_HIST(pd,pd->bl_ring[i]) = 0;
+    }
+    pd->bl_count = 0;
+    pd->bl_ring_idx = 0;
+    pd->baseline = val;
+    pulse_detect_baseline_update(pd, val);
+}
+
+static void pulse_detect_report(pulse_detect_t * pd, int64_t pulse_end)
+{
+    pulse_t pulse;
+    int64_t first;
+    int32_t i, max;
+
+    // the raw data and waveform start PULSE_WAVEFORM_LEN/2 samples before pulse start
+    first = pd->pulse_start - PULSE_WAVEFORM_LEN/2;
+
+    // init the pulse
+    pulse.start_idx = pd->pulse_start;
+    pulse.time_ns   = 0;
+    pulse.length    = pulse_end - pd->pulse_start + 1;
+    pulse.baseline  = pd->baseline;
+    pulse.peaks     = pd->pulse_peaks;
+    max = 0;
+    for (i = 0; i < PULSE_MAX_PEAKS; i++) {
+        if (i >= pd->pulse_peaks) {
+            pulse.peak_mv[i] = 0;
+            continue;
+        }
+        pulse.peak_mv[i] = COUNTS_TO_MV(pd->pulse_peak_max[i] - pd->baseline);
+        if (pd->pulse_peak_max[i] > max) {
+            max = pd->pulse_peak_max[i];
+        }
+    }
+    pulse.height_mv = COUNTS_TO_MV(max - pd->baseline);
+    for (i = 0; i < PULSE_RAW_LEN; i++) {
+        pulse.raw[i] = HIST(pd, first+i);
+    }
+    if (pd->mode == PULSE_DETECT_MODE_SCALAR) {
+        for (i = 0; i < PULSE_WAVEFORM_LEN; i++) {
+            pulse.waveform_mv[i] = COUNTS_TO_MV(pulse.raw[i] - pd->baseline);
+        }
+    } else {
+        counts_to_mv(pulse.waveform_mv, pulse.raw, pd->baseline, PULSE_WAVEFORM_LEN);
+    }
+
+    // report the pulse to the caller
+    pd->pulse_count++;
+    if (pd->pulse_peaks > 1) {
+        pd->pileup_count++;
+    }
+    pd->cb(&pulse, pd->cb_cx);
+}
+
+// -----------------  PRIVATE - PARALLEL  ------------------------------------------
+
+static void pulse_detect_process_long(pulse_detect_t * pd, uint16_t * data, int64_t max_data)
+{
+    int64_t i, len;
+
+    for (i = 0; i < max_data; i += len) {
+        len = (max_data - i < PARALLEL_MAX_PROCESS ? max_data - i : PARALLEL_MAX_PROCESS);
+        pulse_detect_process(pd, data + i, len);
+    }
+}
+
+static void * parallel_chunk_thread(void * cx)
+{
+    chunk_t * c = cx;
+
+    // run the detector on the warmup samples that precede the chunk, 
+    // and save the detector's state at the start of the chunk
+    if (c->warmup_len > 0) {
+        pulse_detect_process(&c->pd, c->data - c->warmup_len, c->warmup_len);
+    }
+    c->start = c->pd;
+    c->keep = true;
+
+    // run the detector on the chunk
+    pulse_detect_process_long(&c->pd, c->data, c->len);
+    return NULL;
+}
+
+static void parallel_chunk_cb(pulse_t * pulse, void * cx)
+{
+    chunk_t       * c = cx;
+    chunk_pulse_t * p;
+
+    if (!c->keep) {
+        return;
+    }
+    if (c->max_pulses == c->alloc_pulses) {
+        c->alloc_pulses = (c->alloc_pulses == 0 ? 1024 : 2 * c->alloc_pulses);
+        c->pulses = realloc(c->pulses, c->alloc_pulses * sizeof(chunk_pulse_t));
+        if (c->pulses == NULL) {
+            FATAL("realloc pulses, alloc=%d\n", c->alloc_pulses);
+        }
+    }
+
+    // save the pulse, and the chunk detector's state when the pulse was reported
+    p = &c->pulses[c->max_pulses++];
+    p->pulse              = *pulse;
+    p->sample_count       = c->pd.sample_count;
+    p->baseline           = c->pd.baseline;
+    p->baseline_rms       = pulse_detect_baseline_rms(&c->pd);
+    p->pulse_count        = c->pd.pulse_count;
+    p->too_long_count     = c->pd.too_long_count;
+    p->out_of_range_count = c->pd.out_of_range_count;
+    p->skipped_count      = c->pd.skipped_count;
+    p->pileup_count       = c->pd.pileup_count;
+    p->busy_count         = c->pd.busy_count;
+}
+
+// returns true if detectors a and b will report the same pulses for the samples that follow
+static bool parallel_state_equal(pulse_detect_t * a, pulse_detect_t * b)
+{
+    int32_t i, ia, ib;
+
+    if (a->sample_count != b->sample_count ||
+        a->baseline != b->baseline ||
+        a->bl_count != b->bl_count ||
+        a->pulse_start != b->pulse_start)
+    {
+        return false;
+    }
+
+    // the eval_start values are equivalent if evaluation has started for both
+    if (a->eval_start != b->eval_start &&
+        (a->eval_start > a->sample_count - EVAL_DELAY || b->eval_start > b->sample_count - EVAL_DELAY))
+    {
+        return false;
+    }
+
+    // the pile-up state, when in a pulse
+    if (a->pulse_start != -1) {
+        if (a->pulse_peaks != b->pulse_peaks ||
+            a->pulse_valley != b->pulse_valley ||
+            a->pulse_falling != b->pulse_falling ||
+            memcmp(a->pulse_peak_max, b->pulse_peak_max, a->pulse_peaks * sizeof(a->pulse_peak_max[0])) != 0)
+        {
+            return false;
+        }
+    }
+
+    // the baseline tracker window, oldest first; the histogram is determined by the window
+    for (i = 0; i < a->bl_count; i++) {
+        ia = (a->bl_count == PULSE_BASELINE_WINDOW ? (a->bl_ring_idx + i) % PULSE_BASELINE_WINDOW : i);
+        ib = (b->bl_count == PULSE_BASELINE_WINDOW ? (b->bl_ring_idx + i) % PULSE_BASELINE_WINDOW : i);
+        if (a->bl_ring[ia] != b->bl_ring[ib]) {
+            return false;
+        }
+    }
+
+    // the most recent samples
+    for (i = 1; i <= PULSE_HIST_LEN; i++) {
+        if (HIST(a, a->sample_count - i) != HIST(b, b->sample_count - i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the state when the chunk's detector reported pulse p: the sample count, 
+// baseline and baseline rms are the chunk detector's, and the counters are
+// those of base, the merged state at the start of the chunk, incremented by 
+// the amounts they were incremented in the chunk before the pulse was reported;
+// the other state is not used by the callback, and is set by parallel_merge_state
+static void parallel_merge_pulse(pulse_detect_t * pd, pulse_detect_t * base, chunk_t * c, chunk_pulse_t * p)
+{
+    pulse_detect_t * start = &c->start;
+
+    pd->sample_count        = p->sample_count;
+    pd->baseline            = p->baseline;
+    pd->baseline_rms_merge  = p->baseline_rms;
+    pd->pulse_count         = base->pulse_count + p->pulse_count - start->pulse_count;
+    pd->too_long_count      = base->too_long_count + p->too_long_count - start->too_long_count;
+    pd->out_of_range_count  = base->out_of_range_count + p->out_of_range_count - start->out_of_range_count;
+    pd->skipped_count       = base->skipped_count + p->skipped_count - start->skipped_count;
+    pd->pileup_count        = base->pileup_count + p->pileup_count - start->pileup_count;
+    pd->busy_count          = base->busy_count + p->busy_count - start->busy_count;
+    pd->merging             = true;
+}
+
+// the merged state is the state at the end of the chunk, with the counters
+// of base, the merged state at the start of the chunk, incremented by the 
+// amounts they were incremented in the chunk
+static void parallel_merge_state(pulse_detect_t * pd, pulse_detect_t * base, chunk_t * c)
+{
+    pulse_detect_t * end = &c->pd;
+    pulse_detect_t * start = &c->start;
+
+    *pd = *end;
+    pd->cb                  = base->cb;
+    pd->cb_cx               = base->cb_cx;
+    pd->pulse_count         = base->pulse_count + end->pulse_count - start->pulse_count;
+    pd->too_long_count      = base->too_long_count + end->too_long_count - start->too_long_count;
+    pd->out_of_range_count  = base->out_of_range_count + end->out_of_range_count - start->out_of_range_count;
+    pd->skipped_count       = base->skipped_count + end->skipped_count - start->skipped_count;
+    pd->pileup_count        = base->pileup_count + end->pileup_count - start->pileup_count;
+    pd->busy_count          = base->busy_count + end->busy_count - start->busy_count;
+    pd->parallel_redo_count = base->parallel_redo_count;
+    pd->merging             = false;
+}
+
+// -----------------  SIMD  --------------------------------------------------------
+
+// scan_block_quiet_xxx: returns true if all SCAN_BLOCK_LEN values are within lo..hi
+
+#if !defined(__SSE2__) && !defined(__ARM_NEON)
+static bool scan_block_quiet_scalar(uint16_t * data, uint16_t lo, uint16_t hi)
+{
+    int32_t i;
+    uint16_t min = 65535, max = 0;
+
+    for (i = 0; i < SCAN_BLOCK_LEN; i++) {
+        if (data[i] < min) min = data[i];
+        if (data[i] > max) max = data[i];
+    }
+    return min >= lo && max <= hi;
+}
+#endif
+
+#ifdef __SSE2__
+static bool scan_block_quiet_sse2(uint16_t * data, uint16_t lo, uint16_t hi)
+{
+    __m128i lo_v = _mm_set1_epi16(lo);
+    __m128i hi_v = _mm_set1_epi16(hi);
+    __m128i out  = _mm_setzero_si128();
+    __m128i v;
+    int32_t i;
+
+    // SSE2 does not have unsigned 16 bit compare; the unsigned saturating 
+    // subtracts are non zero for values below lo or above hi
+    for (i = 0; i < SCAN_BLOCK_LEN; i += 8) {
+        v = _mm_loadu_si128((__m128i*)(data+i));
+        out = _mm_or_si128(out, _mm_subs_epu16(lo_v, v));
+        out = _mm_or_si128(out, _mm_subs_epu16(v, hi_v));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi16(out, _mm_setzero_si128())) == 0xffff;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static bool scan_block_quiet_avx2(uint16_t * data, uint16_t lo, uint16_t hi)
+{
+    __m256i min = _mm256_set1_epi16(-1);
+    __m256i max = _mm256_setzero_si256();
+    __m256i v;
+    int32_t i;
+
+    for (i = 0; i < SCAN_BLOCK_LEN; i += 16) {
+        v = _mm256_loadu_si256((__m256i*)(data+i));
+        min = _mm256_min_epu16(min, v);
+        max = _mm256_max_epu16(max, v);
+    }
+
+    // all values are within lo..hi if min == max(min,lo) and max == min(max,hi)
+    min = _mm256_cmpeq_epi16(min, _mm256_max_epu16(min, _mm256_set1_epi16(lo)));
+    max = _mm256_cmpeq_epi16(max, _mm256_min_epu16(max, _mm256_set1_epi16(hi)));
+    return _mm256_movemask_epi8(_mm256_and_si256(min, max)) == -1;
+}
+#endif
+
+#ifdef __ARM_NEON
+static bool scan_block_quiet_neon(uint16_t * data, uint16_t lo, uint16_t hi)
+{
+    uint16x8_t min = vdupq_n_u16(65535);
+    uint16x8_t max = vdupq_n_u16(0);
+    uint16x8_t v;
+    uint16x4_t min4, max4;
+    int32_t i;
+
+    for (i = 0; i < SCAN_BLOCK_LEN; i += 8) {
+        v = vld1q_u16(data+i);
+        min = vminq_u16(min, v);
+        max = vmaxq_u16(max, v);
+    }
+
+    // reduce using pairwise min/max, which is available on 32 bit arm
+    min4 = vpmin_u16(vget_low_u16(min), vget_high_u16(min));
+    min4 = vpmin_u16(min4, min4);
+    min4 = vpmin_u16(min4, min4);
+    max4 = vpmax_u16(vget_low_u16(max), vget_high_u16(max));
+    max4 = vpmax_u16(max4, max4);
+    max4 = vpmax_u16(max4, max4);
+    return vget_lane_u16(min4, 0) >= lo && vget_lane_u16(max4, 0) <= hi;
+}
+#endif
+
+static void scan_block_select(void)
+{
+    if (scan_block_quiet != NULL) {
+        return;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_block_name = "avx2";
+        scan_block_quiet = scan_block_quiet_avx2;
+        return;
+    }
+#endif
+#ifdef __SSE2__
+    scan_block_name = "sse2";
+    scan_block_quiet = scan_block_quiet_sse2;
+#elif defined(__ARM_NEON)
+    scan_block_name = "neon";
+    scan_block_quiet = scan_block_quiet_neon;
+#else
+    scan_block_name = "none";
+    scan_block_quiet = scan_block_quiet_scalar;
+#ifdef __arm__
+    WARN("built without NEON, the pulse detector scan is scalar\n");
+#endif
+#endif
+}
+
+// counts_to_mv: same result as COUNTS_TO_MV(raw[i] - baseline); the division
+// truncates toward zero, so negative products are biased by 2047 before the shift
+
+static void counts_to_mv(int16_t * mv, uint16_t * raw, int32_t baseline, int32_t cnt)
+{
+    int32_t i = 0;
+
+#ifdef __SSE2__
+    __m128i base_v = _mm_set1_epi16(baseline);
+    __m128i mult_v = _mm_set1_epi16(10000);
+    __m128i bias_v = _mm_set1_epi32(2047);
+    __m128i x, lo, hi, p0, p1;
+
+    for (; i + 8 <= cnt; i += 8) {
+        x  = _mm_sub_epi16(_mm_loadu_si128((__m128i*)(raw+i)), base_v);
+        lo = _mm_mullo_epi16(x, mult_v);
+        hi = _mm_mulhi_epi16(x, mult_v);
+        p0 = _mm_unpacklo_epi16(lo, hi);
+        p1 = _mm_unpackhi_epi16(lo, hi);
+        p0 = _mm_srai_epi32(_mm_add_epi32(p0, _mm_and_si128(_mm_srai_epi32(p0,31), bias_v)), 11);
+        p1 = _mm_srai_epi32(_mm_add_epi32(p1, _mm_and_si128(_mm_srai_epi32(p1,31), bias_v)), 11);
+        _mm_storeu_si128((__m128i*)(mv+i), _mm_packs_epi32(p0, p1));
+    }
+#elif defined(__ARM_NEON)
+    int16x8_t base_v = vdupq_n_s16(baseline);
+    int16x4_t mult_v = vdup_n_s16(10000);
+    int32x4_t bias_v = vdupq_n_s32(2047);
+    int16x8_t x;
+    int32x4_t p0, p1;
+
+    for (; i + 8 <= cnt; i += 8) {
+        x  = vsubq_s16(vreinterpretq_s16_u16(vld1q_u16(raw+i)), base_v);
+        p0 = vmull_s16(vget_low_s16(x), mult_v);
+        p1 = vmull_s16(vget_high_s16(x), mult_v);
+        p0 = vshrq_n_s32(vaddq_s32(p0, vandq_s32(vshrq_n_s32(p0,31), bias_v)), 11);
+        p1 = vshrq_n_s32(vaddq_s32(p1, vandq_s32(vshrq_n_s32(p1,31), bias_v)), 11);
+        vst1q_s16(mv+i, vcombine_s16(vqmovn_s32(p0), vqmovn_s32(p1)));
+    }
+#endif
+
+    for (; i < cnt; i++) {
+        mv[i] = COUNTS_TO_MV(raw[i] - baseline);
+    }
+}
@@ -0,0 +1,109 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef __UTIL_PULSE_H__
+#define __UTIL_PULSE_H__
+
+// streaming pulse detector, for the neutron detector samples acquired by mccdaq
+
+#define PULSE_WAVEFORM_LEN  20   // samples saved for each pulse, starting 10 samples before pulse start
+#define PULSE_RAW_LEN       24   // raw samples saved for each pulse, starting at the same sample
+#define PULSE_HIST_LEN      64   // must be power of 2
+#define PULSE_MAX_PEAKS     8    // max peaks tracked in a pile-up
+#define PULSE_BASELINE_WINDOW  512   // samples in the baseline tracker histogram
+
+typedef struct {
+    int64_t  start_idx;                         // sample index of first sample above threshold
+    int64_t  time_ns;                           // realtime of start_idx, 0 unless set by the caller
+    int32_t  length;                            // number of samples above threshold
+    int32_t  height_mv;                         // pulse height above baseline
+    int32_t  baseline;                          // adc counts
+    int32_t  peaks;                             // number of peaks, more than 1 is a pile-up
+    int16_t  peak_mv[PULSE_MAX_PEAKS];          // height of each peak, mv above baseline
+    int16_t  waveform_mv[PULSE_WAVEFORM_LEN];   // mv above baseline
+    uint16_t raw[PULSE_RAW_LEN];                // adc counts
+} pulse_t;
+
+typedef void (*pulse_detect_cb_t)(pulse_t * pulse, void * cx);
+
+// detector modes
+// - PULSE_DETECT_MODE_SIMD: blocks of samples that are all within the baseline noise
+//   band are skipped using a vectorized scan; the remaining samples are evaluated
+//   by the state machine; the detected pulses are identical to the scalar mode
+// - PULSE_DETECT_MODE_SCALAR: every sample is evaluated by the state machine, this
+//   is the reference implementation
+#define PULSE_DETECT_MODE_SIMD    0
+#define PULSE_DETECT_MODE_SCALAR  1
+
+// the detector state is carried across calls to pulse_detect_process, so that 
+// pulses are detected regardless of how the sample stream is divided into calls
+typedef struct {
+    // configuration
+    int32_t           threshold;                // adc counts above baseline
+    pulse_detect_cb_t cb;
+    void            * cb_cx;
+    int32_t           mode;                     // PULSE_DETECT_MODE_xxx
+
+    // state
+    int64_t           sample_count;             // sample index of the next sample
+    int64_t           eval_start;               // first sample index that can be evaluated
+    int32_t           baseline;                 // adc counts, 0 until determined
+    uint16_t          bl_ring[PULSE_BASELINE_WINDOW];  // baseline tracker samples
+    uint16_t          bl_hist[4096+2];          // baseline tracker histogram, see BL_HIST
+    int32_t           bl_ring_idx;
+    int32_t           bl_count;
+    int64_t           pulse_start;              // sample index, -1 when not in a pulse
+    int32_t           pulse_peaks;              // number of peaks in the pulse
+    int32_t           pulse_peak_max[PULSE_MAX_PEAKS];  // max adc counts of each peak
+    int32_t           pulse_valley;             // min adc counts since the last peak
+    bool              pulse_falling;            // the last peak has ended
+    uint16_t          hist[PULSE_HIST_LEN];     // the most recent samples
+    bool              merging;                  // pulse_detect_process_parallel is reporting a chunk's pulses
+    double            baseline_rms_merge;       // the baseline rms while merging
+
+    // counters
+    uint64_t          pulse_count;
+    uint64_t          too_long_count;           // excursions discarded because they are too long
+    uint64_t          out_of_range_count;       // samples > 4095
+    uint64_t          skipped_count;            // samples skipped by the SIMD mode block scan
+    uint64_t          pileup_count;             // pulses with more than one peak
+    uint64_t          busy_count;               // samples in pulses, including those discarded
+    uint64_t          parallel_redo_count;      // chunks reprocessed by pulse_detect_process_parallel
+} pulse_detect_t;
+
+// dead time models, used to correct the measured pulse rate
+#define PULSE_DEAD_TIME_MODEL_NONE            0
+#define PULSE_DEAD_TIME_MODEL_NONPARALYZABLE  1
+#define PULSE_DEAD_TIME_MODEL_PARALYZABLE     2
+
+void pulse_detect_init(pulse_detect_t * pd, int32_t threshold, pulse_detect_cb_t cb, void * cb_cx);
+void pulse_detect_process(pulse_detect_t * pd, uint16_t * data, int32_t max_data);
+void pulse_detect_process_parallel(pulse_detect_t * pd, uint16_t * data, int64_t max_data, int32_t max_threads);
+void pulse_detect_set_mode(pulse_detect_t * pd, int32_t mode);
+void pulse_detect_resync(pulse_detect_t * pd, int64_t sample_idx);
+int64_t pulse_detect_settled_idx(pulse_detect_t * pd);
+double pulse_detect_baseline_rms(pulse_detect_t * pd);
+char * pulse_detect_simd_name(void);
+double pulse_rate_corrected(int32_t model, double rate, double tau);
+
+#endif
@@ -0,0 +1,377 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "util_pulse_gen.h"
+#include "util_misc.h"
+
+// NOTES:
+//
+// The generator spec is a comma separated list of name=value, any of which
+// may be omitted; the defaults are shown:
+// - rate=5000           : mean pulse rate, pulses per second; the arrivals are
+//                         a Poisson process
+// - height=gauss:500:150: pulse height distribution, mv; one of fixed:h, 
+//                         gauss:mean:sigma, exp:mean, or uniform:lo:hi
+// - shape=0.5:2         : pulse rise and fall time constants, samples; the pulse
+//                         is the difference of two exponentials, scaled to the height
+// - baseline=0          : mv
+// - drift=0:10          : sinusoidal baseline drift, amplitude mv and period secs
+// - noise=5             : gaussian noise sigma, mv
+// - ripple=0:60         : mains ripple, amplitude mv and frequency hz
+// - sat=0               : fraction of pulses whose height is increased so that
+//                         they saturate the adc
+// - speed=1             : multiple of the sample rate at which the samples are
+//                         generated; used by the mccdaq simulator
+// - seed=1              : random number generator seed
+//
+// The adc count is 2048 + mv * 2048 / 10000, rounded and clipped to 0..4095.
+//
+// Each pulse is added to the acc[] circular buffer, which holds the sum of the 
+// pulses for the next PULSE_GEN_ACC_LEN samples; so the cost of a pulse is 
+// the shape length, and overlapping pulses (pile-up) are summed. The gaussian
+// noise is from a table indexed by the random number generator, which is much
+// faster than computing a gaussian for every sample.
+//
+// The ground truth file has a line per pulse: the sample index of the pulse
+// start, the height mv, whether the pulse is a pile-up (it starts within 
+// pileup_len samples of the prior pulse, where pileup_len is the number of
+// samples the prior pulse is above 10 percent of its height), and whether 
+// the pulse saturates the adc. The caller can also set truth[] to keep the
+// generated pulses in memory.
+
+//
+// defines
+//
+
+#define MAX_ADC_VAL     4095
+#define MV_TO_COUNTS(x) ((x) * 2048 / 10000)
+
+#define ACC_MASK        (PULSE_GEN_ACC_LEN-1)
+#define NOISE_MASK      (PULSE_GEN_NOISE_TBL_LEN-1)
+#define RIPPLE_SHIFT    (32 - 10)    // log2(PULSE_GEN_RIPPLE_TBL_LEN) is 10
+
+//
+// prototypes
+//
+
+static int32_t pulse_gen_parse(pulse_gen_t * g, char * spec);
+static void pulse_gen_add_pulse(pulse_gen_t * g, uint64_t sample_idx);
+static double pulse_gen_height(pulse_gen_t * g);
+static inline uint64_t rng_next(pulse_gen_t * g);
+static inline double rng_uniform(pulse_gen_t * g);
+static double rng_gauss(pulse_gen_t * g);
+
+// -----------------  API  ---------------------------------------------------------
+
+int32_t pulse_gen_init(pulse_gen_t * g, char * spec, double sample_rate, char * truth_filename)
+{
+    int32_t i;
+    double  t, v, peak;
+
+    bzero(g, sizeof(pulse_gen_t));
+    snprintf(g->desc, sizeof(g->desc), "%s", spec);
+    g->sample_rate = sample_rate;
+
+    // parse the spec
+    if (pulse_gen_parse(g, spec) < 0) {
+        return -1;
+    }
+
+    // init the random number generator; xorshift state must not be 0
+    g->rng = g->seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    // create the pulse shape, the difference of two exponentials, with peak 1;
+    // the shape ends when it has decayed to 0.1 percent of the peak
+    peak = 0;
+    for (i = 0; i < PULSE_GEN_MAX_SHAPE_LEN; i++) {
+        t = i + 1;
+        v = exp(-t / g->fall) - exp(-t / g->rise);
+        g->shape[i] = v;
+        if (v > peak) {
+            peak = v;
+        }
+    }
+    g->shape_len = PULSE_GEN_MAX_SHAPE_LEN;
+    g->pileup_len = 0;
+    for (i = 0; i < PULSE_GEN_MAX_SHAPE_LEN; i++) {
+        g->shape[i] /= peak;
+        if (g->shape[i] >= 0.1) {
+            g->pileup_len = i + 1;
+        }
+        if (i > 0 && g->shape[i] < 0.001 && g->shape[i] < g->shape[i-1]) {
+            g->shape_len = i;
+            break;
+        }
+    }
+
+    // init the gaussian noise table, in adc counts
+    for (i = 0; i < PULSE_GEN_NOISE_TBL_LEN; i++) {
+        g->noise_tbl[i] = MV_TO_COUNTS(g->noise_mv) * rng_gauss(g);
+    }
+
+    // init the ripple table, in adc counts, and the phase step per sample
+    for (i = 0; i < PULSE_GEN_RIPPLE_TBL_LEN; i++) {
+        g->ripple_tbl[i] = MV_TO_COUNTS(g->ripple_mv) * sin(2 * M_PI * i / PULSE_GEN_RIPPLE_TBL_LEN);
+    }
+    g->ripple_step = g->ripple_hz / g->sample_rate * 4294967296.0;
+
+    // the first pulse
+    g->next_pulse = -log(1 - rng_uniform(g)) * g->sample_rate / g->rate;
+    g->last_pulse_idx = -(uint64_t)PULSE_GEN_ACC_LEN;
+
+    // open the ground truth file
+    if (truth_filename) {
+        g->truth_fp = fopen(truth_filename, "w");
+        if (g->truth_fp == NULL) {
+            ERROR("failed to create %s, %s\n", truth_filename, strerror(errno));
+            return -1;
+        }
+        fprintf(g->truth_fp, "# %s\n", g->desc);
+        fprintf(g->truth_fp, "# sample_rate=%.0f shape_len=%d pileup_len=%d\n",
+                g->sample_rate, g->shape_len, g->pileup_len);
+        fprintf(g->truth_fp, "# sample_idx height_mv pileup saturated\n");
+    }
+
+    INFO("pulse generator '%s': shape_len=%d pileup_len=%d\n", g->desc, g->shape_len, g->pileup_len);
+    return 0;
+}
+
+void pulse_gen_fill(pulse_gen_t * g, uint16_t * data, int32_t max_data)
+{
+    int32_t  v;
+    uint64_t idx, end_idx, seg_end_idx;
+    double   base;
+
+    // the baseline, including drift, in adc counts; drift is slow so it 
+    // is updated once per call
+    base = 2048 + MV_TO_COUNTS(g->baseline_mv);
+    if (g->drift_mv != 0) {
+        base += MV_TO_COUNTS(g->drift_mv) * 
+                sin(2 * M_PI * g->sample_count / (g->drift_secs * g->sample_rate));
+    }
+
+    // generate the samples, in segments that end at the start of the next pulse;
+    // the pulse is then added to acc[], which covers the samples that follow
+    idx = g->sample_count;
+    end_idx = g->sample_count + max_data;
+    while (true) {
+        seg_end_idx = (g->next_pulse < end_idx ? (uint64_t)g->next_pulse : end_idx);
+        for (; idx < seg_end_idx; idx++) {
+            v = lrintf(base + 
+                       g->acc[idx & ACC_MASK] + 
+                       g->noise_tbl[rng_next(g) & NOISE_MASK] + 
+                       g->ripple_tbl[g->ripple_phase >> RIPPLE_SHIFT]);
+            g->acc[idx & ACC_MASK] = 0;
+            g->ripple_phase += g->ripple_step;
+            *data++ = (v < 0 ? 0 : v > MAX_ADC_VAL ? MAX_ADC_VAL : v);
+        }
+        if (idx == end_idx) {
+            break;
+        }
+        pulse_gen_add_pulse(g, idx);
+        g->next_pulse += -log(1 - rng_uniform(g)) * g->sample_rate / g->rate;
+    }
+    g->sample_count = end_idx;
+
+    // flush the ground truth file
+    if (g->truth_fp) {
+        fflush(g->truth_fp);
+    }
+}
+
+// -----------------  PRIVATE  -----------------------------------------------------
+
+static int32_t pulse_gen_parse(pulse_gen_t * g, char * spec)
+{
+    char   str[200], *saveptr, *tok, *value;
+    double a, b;
+
+    // defaults
+    g->speed       = 1;
+    g->rate        = 5000;
+    g->height_dist = PULSE_GEN_HEIGHT_GAUSS;
+    g->height_a    = 500;
+    g->height_b    = 150;
+    g->rise        = 0.5;
+    g->fall        = 2;
+    g->drift_secs  = 10;
+    g->noise_mv    = 5;
+    g->ripple_hz   = 60;
+    g->seed        = 1;
+
+    // parse the name=value pairs
+    snprintf(str, sizeof(str), "%s", spec);
+    for (tok = strtok_r(str, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+        if ((value = strchr(tok, '=')) == NULL) {
+            ERROR("pulse generator spec '%s' expected name=value\n", tok);
+            return -1;
+        }
+        *value++ = '\0';
+
+        if (strcmp(tok, "rate") == 0 && sscanf(value, "%lf", &g->rate) == 1 && g->rate > 0) {
+            // ok
+        } else if (strcmp(tok, "height") == 0 && sscanf(value, "fixed:%lf", &a) == 1 && a > 0) {
+            g->height_dist = PULSE_GEN_HEIGHT_FIXED;
+            g->height_a = a;
+        } else if (strcmp(tok, "height") == 0 && sscanf(value, "gauss:%lf:%lf", &a, &b) == 2 && a > 0 && b >= 0) {
+            g->height_dist = PULSE_GEN_HEIGHT_GAUSS;
+            g->height_a = a;
+            g->height_b = b;
+        } else if (strcmp(tok, "height") == 0 && sscanf(value, "exp:%lf", &a) == 1 && a > 0) {
+            g->height_dist = PULSE_GEN_HEIGHT_EXP;
+            g->height_a = a;
+        } else if (strcmp(tok, "height") == 0 && sscanf(value, "uniform:%lf:%lf", &a, &b) == 2 && a > 0 && b >= a) {
+            g->height_dist = PULSE_GEN_HEIGHT_UNIFORM;
+            g->height_a = a;
+            g->height_b = b;
+        } else if (strcmp(tok, "shape") == 0 && sscanf(value, "%lf:%lf", &a, &b) == 2 && a > 0 && b > a) {
+            g->rise = a;
+            g->fall = b;
+        } else if (strcmp(tok, "baseline") == 0 && sscanf(value, "%lf", &g->baseline_mv) == 1) {
+            // ok
+        } else if (strcmp(tok, "drift") == 0 && sscanf(value, "%lf:%lf", &a, &b) == 2 && b > 0) {
+            g->drift_mv = a;
+            g->drift_secs = b;
+        } else if (strcmp(tok, "noise") == 0 && sscanf(value, "%lf", &g->noise_mv) == 1 && g->noise_mv >= 0) {
+            // ok
+        } else if (strcmp(tok, "ripple") == 0 && sscanf(value, "%lf:%lf", &a, &b) == 2 && b > 0) {
+            g->ripple_mv = a;
+            g->ripple_hz = b;
+        } else if (strcmp(tok, "sat") == 0 && sscanf(value, "%lf", &g->sat) == 1 && g->sat >= 0 && g->sat <= 1) {
+            // ok
+        } else if (strcmp(tok, "speed") == 0 && sscanf(value, "%lf", &g->speed) == 1 && g->speed > 0) {
+            // ok
+        } else if (strcmp(tok, "seed") == 0 && sscanf(value, "%" SCNu64, &g->seed) == 1) {
+            // ok
+        } else {
+            ERROR("pulse generator spec '%s=%s' is invalid\n", tok, value);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void pulse_gen_add_pulse(pulse_gen_t * g, uint64_t sample_idx)
+{
+    int32_t i;
+    double  height, counts, sat_counts;
+    bool    pileup, saturated;
+
+    // determine the height; a saturating pulse's height is increased so that its
+    // peak is above the adc range
+    height = pulse_gen_height(g);
+    counts = MV_TO_COUNTS(height);
+    sat_counts = MAX_ADC_VAL - 2048 - MV_TO_COUNTS(g->baseline_mv) + MV_TO_COUNTS(g->drift_mv);
+    if (g->sat > 0 && rng_uniform(g) < g->sat && counts < 1.5 * sat_counts) {
+        counts = 1.5 * sat_counts;
+        height = counts * 10000 / 2048;
+    }
+    saturated = (counts >= sat_counts);
+    pileup = (sample_idx - g->last_pulse_idx < (uint64_t)g->pileup_len);
+
+    // add the pulse to acc[]
+    for (i = 0; i < g->shape_len; i++) {
+        g->acc[(sample_idx + i) & ACC_MASK] += counts * g->shape[i];
+    }
+
+    // update counters, and write the ground truth
+    g->pulse_count++;
+    if (pileup) {
+        g->pileup_count++;
+    }
+    if (saturated) {
+        g->saturated_count++;
+    }
+    g->last_pulse_idx = sample_idx;
+    if (g->truth_fp) {
+        fprintf(g->truth_fp, "%" PRIu64 " %.1f %d %d\n", sample_idx, height, pileup, saturated);
+    }
+    if (g->truth && g->truth_count < g->max_truth) {
+        pulse_gen_truth_t * t = &g->truth[g->truth_count++];
+        t->sample_idx = sample_idx;
+        t->height_mv  = height;
+        t->pileup     = pileup;
+        t->saturated  = saturated;
+    }
+}
+
+static double pulse_gen_height(pulse_gen_t * g)
+{
+    double h;
+
+    switch (g->height_dist) {
+    case PULSE_GEN_HEIGHT_FIXED:
+        h = g->height_a;
+        break;
+    case PULSE_GEN_HEIGHT_GAUSS:
+        h = g->height_a + g->height_b * rng_gauss(g);
+        break;
+    case PULSE_GEN_HEIGHT_EXP:
+        h = -g->height_a * log(1 - rng_uniform(g));
+        break;
+    case PULSE_GEN_HEIGHT_UNIFORM:
+        h = g->height_a + (g->height_b - g->height_a) * rng_uniform(g);
+        break;
+    default:
+        FATAL("invalid height_dist %d\n", g->height_dist);
+    }
+
+    return h > 0 ? h : 0;
+}
+
+// xorshift64*
+static inline uint64_t rng_next(pulse_gen_t * g)
+{
+    g->rng ^= g->rng >> 12;
+    g->rng ^= g->rng << 25;
+    g->rng ^= g->rng >> 27;
+    return (g->rng * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+// returns 0 <= value < 1
+static inline double rng_uniform(pulse_gen_t * g)
+{
+    return rng_next(g) / 4294967296.0;
+}
+
+// Box-Muller, mean 0, sigma 1
+static double rng_gauss(pulse_gen_t * g)
+{
+    double u1, u2;
+
+    u1 = 1 - rng_uniform(g);
+    u2 = rng_uniform(g);
+    return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
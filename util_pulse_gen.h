@@ -0,0 +1,95 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef __UTIL_PULSE_GEN_H__
+#define __UTIL_PULSE_GEN_H__
+
+// synthetic neutron detector samples, for stress testing the pulse detector;
+// the pulses that are generated are optionally written to a ground truth file
+
+#define PULSE_GEN_MAX_SHAPE_LEN  128      // samples
+#define PULSE_GEN_ACC_LEN        256      // must be power of 2, and >= PULSE_GEN_MAX_SHAPE_LEN
+#define PULSE_GEN_NOISE_TBL_LEN  4096     // must be power of 2
+#define PULSE_GEN_RIPPLE_TBL_LEN 1024     // must be power of 2
+
+// pulse height distributions
+// - FIXED: height_a
+// - GAUSS: mean height_a, sigma height_b
+// - EXP: exponential, mean height_a
+// - UNIFORM: height_a to height_b
+#define PULSE_GEN_HEIGHT_FIXED    0
+#define PULSE_GEN_HEIGHT_GAUSS    1
+#define PULSE_GEN_HEIGHT_EXP      2
+#define PULSE_GEN_HEIGHT_UNIFORM  3
+
+// a generated pulse
+typedef struct {
+    uint64_t sample_idx;
+    float    height_mv;
+    bool     pileup;
+    bool     saturated;
+} pulse_gen_truth_t;
+
+typedef struct {
+    // configuration, see util_pulse_gen.c for the spec
+    char     desc[200];                 // generator spec, for logging
+    double   sample_rate;               // samples per second
+    double   speed;                     // multiple of the sample rate at which the simulator runs
+    double   rate;                      // mean pulses per second
+    int32_t  height_dist;               // PULSE_GEN_HEIGHT_xxx
+    double   height_a, height_b;        // mv
+    double   rise, fall;                // pulse shape time constants, samples
+    double   baseline_mv;
+    double   drift_mv, drift_secs;      // sinusoidal baseline drift, amplitude and period
+    double   noise_mv;                  // gaussian noise sigma
+    double   ripple_mv, ripple_hz;      // mains ripple, amplitude and frequency
+    double   sat;                       // fraction of pulses that saturate the adc
+    uint64_t seed;
+
+    // state
+    uint64_t rng;
+    uint64_t sample_count;              // sample index of the next sample
+    double   next_pulse;                // sample index of the next pulse, fractional
+    uint64_t last_pulse_idx;
+    int32_t  shape_len;
+    int32_t  pileup_len;                // a pulse within this many samples of the prior is a pile-up
+    float    shape[PULSE_GEN_MAX_SHAPE_LEN];     // pulse shape, peak is 1
+    float    acc[PULSE_GEN_ACC_LEN];             // sum of the pulses, by sample index
+    float    noise_tbl[PULSE_GEN_NOISE_TBL_LEN]; // gaussian, adc counts
+    float    ripple_tbl[PULSE_GEN_RIPPLE_TBL_LEN];  // adc counts
+    uint32_t ripple_phase, ripple_step;
+    FILE   * truth_fp;
+    pulse_gen_truth_t * truth;          // optional, set by caller to keep the generated pulses in memory
+    int64_t  max_truth;
+    int64_t  truth_count;
+
+    // counters
+    uint64_t pulse_count;
+    uint64_t pileup_count;
+    uint64_t saturated_count;
+} pulse_gen_t;
+
+int32_t pulse_gen_init(pulse_gen_t * g, char * spec, double sample_rate, char * truth_filename);
+void pulse_gen_fill(pulse_gen_t * g, uint16_t * data, int32_t max_data);
+
+#endif
@@ -0,0 +1,311 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+
+#include "util_pulse.h"
+#include "util_pulse_trace.h"
+#include "util_misc.h"
+
+// NOTES:
+//
+// pulse_trace_add is called from the mccdaq analysis thread, for each pulse.
+// It copies the pulse to a single-producer/single-consumer ring of binary
+// records, and does not block, make system calls, or use stdio; when the ring
+// is full the record is dropped and counted. 
+//
+// The writer thread runs at SCHED_IDLE priority; it periodically writes the 
+// records in the ring to the trace file. When the file reaches max_file_size it 
+// is rotated: filename.N-1 is renamed filename.N, ..., filename is renamed 
+// filename.1, and a new filename is created; max_files files are kept.
+//
+// If the file can not be opened or written then it is closed, and the records
+// are dropped and counted until the file is reopened. The open is retried with
+// a backoff that doubles from REOPEN_INTVL_MIN_US to REOPEN_INTVL_MAX_US; the
+// files are not rotated, so an error such as a full disk does not discard the 
+// existing trace files.
+
+//
+// defines
+//
+
+#define MAX_RING              8192    // must be power of 2
+#define WRITER_INTVL_US       200000
+#define REOPEN_INTVL_MIN_US   1000000
+#define REOPEN_INTVL_MAX_US   60000000
+
+//
+// variables
+//
+
+static pulse_trace_rec_t g_ring[MAX_RING];
+static uint64_t          g_head;          // written by pulse_trace_add (release), read by writer (acquire)
+static uint64_t          g_tail;          // written by writer (release), read by pulse_trace_add (acquire)
+static uint64_t          g_dropped;
+static uint64_t          g_written;
+static uint64_t          g_write_errors;
+static int32_t           g_rotations;
+static bool              g_initialized;
+static bool              g_writer_exit_req;
+static bool              g_writer_thread_running;
+
+static char              g_filename[PATH_MAX];
+static int64_t           g_max_file_size;
+static int32_t           g_max_files;
+static int               g_fd = -1;
+static int64_t           g_file_size;
+static uint64_t          g_reopen_time_us;
+static uint64_t          g_reopen_intvl_us = REOPEN_INTVL_MIN_US;
+
+//
+// prototypes
+//
+
+static void pulse_trace_exit(void);
+static void * pulse_trace_writer_thread(void * cx);
+static void pulse_trace_write(void);
+static int32_t pulse_trace_open(void);
+static void pulse_trace_open_failed(void);
+static void pulse_trace_rotate(void);
+
+// -----------------  API  ---------------------------------------------------------
+
+int32_t pulse_trace_init(char * filename, int64_t max_file_size, int32_t max_files)
+{
+    pthread_t thread;
+
+    // save params
+    if (strlen(filename) >= sizeof(g_filename) || max_file_size <= 0 || max_files < 1) {
+        ERROR("invalid params, filename=%s max_file_size=%"PRId64" max_files=%d\n",
+              filename, max_file_size, max_files);
+        return -1;
+    }
+    strcpy(g_filename, filename);
+    g_max_file_size = max_file_size;
+    g_max_files = max_files;
+
+    // open the trace file, appending to an existing file
+    if (pulse_trace_open() < 0) {
+        return -1;
+    }
+
+    // create the writer thread
+    g_writer_thread_running = true;
+    if (pthread_create(&thread, NULL, pulse_trace_writer_thread, NULL) != 0) {
+        FATAL("pthread_create pulse_trace_writer_thread, %s\n", strerror(errno));
+    }
+
+    // register exit handler, which writes the records remaining in the ring
+    atexit(pulse_trace_exit);
+
+    // return success
+    INFO("filename=%s max_file_size=%"PRId64" max_files=%d\n", filename, max_file_size, max_files);
+    __atomic_store_n(&g_initialized, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void pulse_trace_add(pulse_t * pulse)
+{
+    uint64_t            head;
+    pulse_trace_rec_t * rec;
+
+    // if not initialized then return
+    if (!__atomic_load_n(&g_initialized, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    // if the ring is full then drop the record
+    head = g_head;
+    if (head - __atomic_load_n(&g_tail, __ATOMIC_ACQUIRE) >= MAX_RING) {
+        __atomic_fetch_add(&g_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // fill in the record, and publish it to the writer
+    rec = &g_ring[head % MAX_RING];
+    rec->magic     = PULSE_TRACE_MAGIC;
+    rec->length    = pulse->length;
+    rec->raw_len   = PULSE_RAW_LEN;
+    rec->time_ns   = pulse->time_ns;
+    rec->start_idx = pulse->start_idx;
+    rec->baseline  = pulse->baseline;
+    rec->height_mv = pulse->height_mv;
+    memcpy(rec->raw, pulse->raw, sizeof(rec->raw));
+    __atomic_store_n(&g_head, head + 1, __ATOMIC_RELEASE);
+}
+
+void pulse_trace_get_stats(pulse_trace_stats_t * stats)
+{
+    stats->added        = __atomic_load_n(&g_head, __ATOMIC_ACQUIRE);
+    stats->dropped      = __atomic_load_n(&g_dropped, __ATOMIC_RELAXED);
+    stats->written      = __atomic_load_n(&g_written, __ATOMIC_RELAXED);
+    stats->write_errors = __atomic_load_n(&g_write_errors, __ATOMIC_RELAXED);
+    stats->rotations    = __atomic_load_n(&g_rotations, __ATOMIC_RELAXED);
+}
+
+// -----------------  EXIT HANDLER  ------------------------------------------------
+
+static void pulse_trace_exit(void)
+{
+    // stop the writer thread, it writes the remaining records before exitting
+    g_writer_exit_req = true;
+    while (g_writer_thread_running) {
+        usleep(1000);
+    }
+
+    if (g_fd != -1) {
+        close(g_fd);
+        g_fd = -1;
+    }
+}
+
+// -----------------  WRITER THREAD  -----------------------------------------------
+
+static void * pulse_trace_writer_thread(void * cx)
+{
+    struct sched_param param;
+    bool exit_req;
+
+    pthread_setname_np(pthread_self(), "pulse_trace");
+
+    // run at idle priority, so that writing the trace does not compete 
+    // with acquisition and analysis
+    bzero(&param, sizeof(param));
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+        WARN("failed to set SCHED_IDLE\n");
+    }
+
+    while (true) {
+        exit_req = g_writer_exit_req;
+        pulse_trace_write();
+        if (exit_req) {
+            break;
+        }
+        usleep(WRITER_INTVL_US);
+    }
+
+    g_writer_thread_running = false;
+    return NULL;
+}
+
+static void pulse_trace_write(void)
+{
+    uint64_t head, tail, cnt;
+    ssize_t  len;
+
+    // write the records in the ring to the file; at most 2 writes are
+    // needed, because the records may wrap the end of the ring
+    head = __atomic_load_n(&g_head, __ATOMIC_ACQUIRE);
+    tail = g_tail;
+
+    // if the file has been closed because of an error then retry the open,
+    // when the backoff interval has elapsed
+    if (g_fd == -1 && tail != head && microsec_timer() >= g_reopen_time_us) {
+        pulse_trace_open();
+    }
+
+    while (tail != head) {
+        cnt = head - tail;
+        if ((tail % MAX_RING) + cnt > MAX_RING) {
+            cnt = MAX_RING - (tail % MAX_RING);
+        }
+
+        // if the file has been closed because of an error then drop the records,
+        // otherwise write them
+        if (g_fd != -1) {
+            len = write(g_fd, &g_ring[tail % MAX_RING], cnt * sizeof(pulse_trace_rec_t));
+            if (len != cnt * sizeof(pulse_trace_rec_t)) {
+                ERROR("write %s, %s\n", g_filename, len < 0 ? strerror(errno) : "short write");
+                g_write_errors++;
+                close(g_fd);
+                g_fd = -1;
+                pulse_trace_open_failed();
+            } else {
+                g_written += cnt;
+                g_file_size += len;
+                g_reopen_intvl_us = REOPEN_INTVL_MIN_US;
+            }
+        }
+        if (g_fd == -1) {
+            __atomic_fetch_add(&g_dropped, cnt, __ATOMIC_RELAXED);
+        }
+
+        tail += cnt;
+        __atomic_store_n(&g_tail, tail, __ATOMIC_RELEASE);
+    }
+
+    // if the file has reached max size then rotate
+    if (g_fd != -1 && g_file_size >= g_max_file_size) {
+        pulse_trace_rotate();
+    }
+}
+
+static int32_t pulse_trace_open(void)
+{
+    struct stat st;
+
+    g_fd = open(g_filename, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+    if (g_fd < 0) {
+        ERROR("open %s, %s\n", g_filename, strerror(errno));
+        pulse_trace_open_failed();
+        return -1;
+    }
+    g_file_size = (fstat(g_fd, &st) == 0 ? st.st_size : 0);
+    return 0;
+}
+
+static void pulse_trace_open_failed(void)
+{
+    // schedule the next open attempt, and double the backoff interval;
+    // the interval is reset to the minimum by a successful write
+    g_reopen_time_us = microsec_timer() + g_reopen_intvl_us;
+    g_reopen_intvl_us = (2 * g_reopen_intvl_us < REOPEN_INTVL_MAX_US
+                         ? 2 * g_reopen_intvl_us : REOPEN_INTVL_MAX_US);
+}
+
+static void pulse_trace_rotate(void)
+{
+    close(g_fd);
+    g_fd = -1;
+
+    rotate_files(g_filename, g_max_files);
+    pulse_trace_open();
+    g_rotations++;
+}
@@ -0,0 +1,57 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef __UTIL_PULSE_TRACE_H__
+#define __UTIL_PULSE_TRACE_H__
+
+// binary trace of the pulses found by the pulse detector; the records are
+// written to a rotating file by a low priority thread, and are rendered
+// offline by support/pulse_trace/pulse_trace_print
+
+#define PULSE_TRACE_MAGIC  0x32525450   // "PTR2"
+
+typedef struct {
+    uint32_t magic;
+    uint16_t length;                    // number of samples above threshold
+    uint16_t raw_len;                   // PULSE_RAW_LEN
+    int64_t  time_ns;                   // realtime of the pulse start, from the sample index
+    int64_t  start_idx;                 // sample index of first sample above threshold
+    int32_t  baseline;                  // adc counts
+    int32_t  height_mv;                 // pulse height above baseline
+    uint16_t raw[PULSE_RAW_LEN];        // adc counts, starting PULSE_WAVEFORM_LEN/2 before start_idx;
+                                        // the filter output when get_data uses a filter (-f)
+} pulse_trace_rec_t;
+
+typedef struct {
+    uint64_t added;                     // records added to the trace ring
+    uint64_t dropped;                   // records dropped because the ring was full, or the file was closed
+    uint64_t written;                   // records written to the file
+    uint64_t write_errors;
+    int32_t  rotations;                 // number of times the file was rotated
+} pulse_trace_stats_t;
+
+int32_t pulse_trace_init(char * filename, int64_t max_file_size, int32_t max_files);
+void pulse_trace_add(pulse_t * pulse);
+void pulse_trace_get_stats(pulse_trace_stats_t * stats);
+
+#endif
@@ -0,0 +1,654 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "util_raw_capture.h"
+#include "util_misc.h"
+
+// NOTES:
+//
+// raw_capture_add is called from the mccdaq analysis thread, with the samples
+// passed to the mccdaq callback. It copies the samples to the block being
+// filled, in a single-producer/single-consumer ring of blocks; it does not
+// block, make system calls, or use stdio. A block holds contiguous samples; it 
+// is completed when it is full, or when the sample index skips ahead because 
+// mccdaq discarded samples. When the ring is full the samples are dropped and 
+// counted, so the capture never slows the acquisition or analysis.
+//
+// The writer thread periodically writes the completed blocks to the capture 
+// file, using O_DIRECT when the filesystem supports it; the blocks are aligned
+// in memory, and padded to a multiple of RAW_CAPTURE_ALIGN on disk, as O_DIRECT 
+// requires. The capture file is rotated, and reopened after an error, in the 
+// same way as the pulse trace file; the blocks written while the file is closed
+// are dropped and their samples counted. The block being filled when the 
+// program exits is not written.
+//
+// Compression: when enabled, the writer encodes each block before writing it.
+// The samples are delta encoded, the difference from the preceding sample is 
+// mapped to an unsigned value by zigzag encoding (0,-1,1,-2,... to 0,1,2,3,...),
+// and these values are rice coded in groups of RAW_CAPTURE_RICE_GROUP_LEN. Each 
+// group starts with its 4 bit rice parameter k, which is chosen from the mean 
+// of the group's values; each value is coded as value>>k in unary (that many 
+// 1 bits followed by a 0 bit) followed by the low k bits of the value. A value 
+// whose unary part would be RICE_ESCAPE or more bits is coded as RICE_ESCAPE 
+// 1 bits followed by the value in RICE_ESCAPE_BITS bits. The baseline noise of 
+// a few adc counts codes in about 4 bits per sample. If the encoded block is
+// not smaller than the samples then the block is written unencoded.
+
+//
+// defines
+//
+
+#define MAX_RING           16       // blocks, 16 secs of samples
+#define WRITER_INTVL_US    50000
+#define REOPEN_INTVL_MIN_US 1000000
+#define REOPEN_INTVL_MAX_US 60000000
+
+#define RICE_ESCAPE        24
+#define RICE_ESCAPE_BITS   17
+
+#define ALIGN_UP(x)        (((x) + RAW_CAPTURE_ALIGN - 1) & ~(RAW_CAPTURE_ALIGN - 1))
+
+//
+// typedefs
+//
+
+typedef struct {
+    uint8_t * buff;
+    int32_t   max;
+    int32_t   len;
+    uint64_t  acc;
+    int32_t   bits;
+} bits_t;
+
+//
+// variables
+//
+
+static uint8_t           * g_ring[MAX_RING];
+static uint64_t            g_head;          // written by raw_capture_add (release), read by writer (acquire)
+static uint64_t            g_tail;          // written by writer (release), read by raw_capture_add (acquire)
+static raw_capture_hdr_t * g_cur;           // block being filled, NULL when none
+static uint8_t           * g_encode_buff;
+static uint64_t            g_samples_added;
+static uint64_t            g_samples_dropped;
+static uint64_t            g_blocks_written;
+static uint64_t            g_bytes_written;
+static uint64_t            g_bytes_raw;
+static uint64_t            g_write_errors;
+static int32_t             g_rotations;
+static int32_t             g_ring_high_water;
+static bool                g_initialized;
+static bool                g_writer_exit_req;
+static bool                g_writer_thread_running;
+
+static char                g_filename[PATH_MAX];
+static int64_t             g_max_file_size;
+static int32_t             g_max_files;
+static bool                g_compress;
+static int64_t          (* g_sample_time_ns)(uint64_t sample_idx);
+static int                 g_fd = -1;
+static bool                g_direct;
+static int64_t             g_file_size;
+static uint64_t            g_reopen_time_us;
+static uint64_t            g_reopen_intvl_us = REOPEN_INTVL_MIN_US;
+
+//
+// prototypes
+//
+
+static void raw_capture_exit(void);
+static void raw_capture_complete_block(void);
+static void * raw_capture_writer_thread(void * cx);
+static void raw_capture_write(void);
+static int32_t raw_capture_encode(raw_capture_hdr_t * hdr, raw_capture_hdr_t * out, int32_t max_out);
+static int32_t raw_capture_open(void);
+static void raw_capture_open_failed(void);
+static void raw_capture_rotate(void);
+static inline void put_bits(bits_t * b, uint32_t val, int32_t n);
+static inline int32_t get_bits(bits_t * b, int32_t n, uint32_t * val);
+
+// -----------------  API  ---------------------------------------------------------
+
+int32_t raw_capture_init(char * filename, int64_t max_file_size, int32_t max_files, bool compress,
+                         int64_t (*sample_time_ns)(uint64_t sample_idx))
+{
+    pthread_t thread;
+    int32_t   i;
+
+    // save params
+    if (strlen(filename) >= sizeof(g_filename) || max_file_size <= 0 || max_files < 1) {
+        ERROR("invalid params, filename=%s max_file_size=%"PRId64" max_files=%d\n",
+              filename, max_file_size, max_files);
+        return -1;
+    }
+    strcpy(g_filename, filename);
+    g_max_file_size = max_file_size;
+    g_max_files = max_files;
+    g_compress = compress;
+    g_sample_time_ns = sample_time_ns;
+
+    // allocate the ring blocks, and the encode buffer, aligned for O_DIRECT
+    for (i = 0; i < MAX_RING; i++) {
+        if (posix_memalign((void**)&g_ring[i], RAW_CAPTURE_ALIGN, RAW_CAPTURE_BLOCK_LEN) != 0) {
+            FATAL("posix_memalign ring block\n");
+        }
+    }
+    if (posix_memalign((void**)&g_encode_buff, RAW_CAPTURE_ALIGN, RAW_CAPTURE_BLOCK_LEN) != 0) {
+        FATAL("posix_memalign encode buff\n");
+    }
+
+    // open the capture file, appending to an existing file
+    if (raw_capture_open() < 0) {
+        return -1;
+    }
+
+    // create the writer thread
+    g_writer_thread_running = true;
+    if (pthread_create(&thread, NULL, raw_capture_writer_thread, NULL) != 0) {
+        FATAL("pthread_create raw_capture_writer_thread, %s\n", strerror(errno));
+    }
+
+    // register exit handler, which writes the blocks remaining in the ring
+    atexit(raw_capture_exit);
+
+    // return success
+    INFO("filename=%s max_file_size=%"PRId64" max_files=%d compress=%d direct=%d\n", 
+         filename, max_file_size, max_files, compress, g_direct);
+    __atomic_store_n(&g_initialized, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void raw_capture_add(uint16_t * data, int32_t max_data, uint64_t sample_idx)
+{
+    int32_t    i, n;
+    uint16_t * samples;
+
+    // if not initialized then return
+    if (!__atomic_load_n(&g_initialized, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    i = 0;
+    while (i < max_data) {
+        // if the block being filled does not continue at this sample then complete it
+        if (g_cur != NULL && g_cur->sample_idx + g_cur->samples != sample_idx + i) {
+            raw_capture_complete_block();
+        }
+
+        // if there is no block being filled then start one; 
+        // if the ring is full then drop the remaining samples
+        if (g_cur == NULL) {
+            if (g_head - __atomic_load_n(&g_tail, __ATOMIC_ACQUIRE) >= MAX_RING) {
+                __atomic_fetch_add(&g_samples_dropped, max_data - i, __ATOMIC_RELAXED);
+                return;
+            }
+            g_cur = (raw_capture_hdr_t *)g_ring[g_head % MAX_RING];
+            bzero(g_cur, sizeof(raw_capture_hdr_t));
+            g_cur->magic      = RAW_CAPTURE_MAGIC;
+            g_cur->encoding   = RAW_CAPTURE_ENCODING_NONE;
+            g_cur->sample_idx = sample_idx + i;
+            g_cur->time_ns    = g_sample_time_ns(sample_idx + i);
+        }
+
+        // copy samples to the block, and if the block is full then complete it
+        n = RAW_CAPTURE_MAX_SAMPLES - g_cur->samples;
+        if (n > max_data - i) {
+            n = max_data - i;
+        }
+        samples = (uint16_t *)(g_cur + 1);
+        memcpy(samples + g_cur->samples, data + i, n * sizeof(uint16_t));
+        g_cur->samples += n;
+        i += n;
+        __atomic_store_n(&g_samples_added, g_samples_added + n, __ATOMIC_RELAXED);
+        if (g_cur->samples == RAW_CAPTURE_MAX_SAMPLES) {
+            raw_capture_complete_block();
+        }
+    }
+}
+
+void raw_capture_get_stats(raw_capture_stats_t * stats)
+{
+    uint64_t tail = __atomic_load_n(&g_tail, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&g_head, __ATOMIC_ACQUIRE);
+
+    stats->samples_added   = __atomic_load_n(&g_samples_added, __ATOMIC_RELAXED);
+    stats->samples_dropped = __atomic_load_n(&g_samples_dropped, __ATOMIC_RELAXED);
+    stats->blocks_written  = __atomic_load_n(&g_blocks_written, __ATOMIC_RELAXED);
+    stats->bytes_written   = __atomic_load_n(&g_bytes_written, __ATOMIC_RELAXED);
+    stats->bytes_raw       = __atomic_load_n(&g_bytes_raw, __ATOMIC_RELAXED);
+    stats->write_errors    = __atomic_load_n(&g_write_errors, __ATOMIC_RELAXED);
+    stats->rotations       = __atomic_load_n(&g_rotations, __ATOMIC_RELAXED);
+    stats->ring_blocks     = head - tail;
+    stats->ring_high_water = __atomic_load_n(&g_ring_high_water, __ATOMIC_RELAXED);
+    stats->ring_max        = MAX_RING;
+}
+
+// writes the samples to a new file, in the raw capture file format; this is used
+// for snapshots of samples that are not being captured, and is independent of
+// raw_capture_init; the caller's thread does the writes
+int32_t raw_capture_write_file(char * filename, uint16_t * data, int64_t max_data, uint64_t sample_idx,
+                               bool compress, int64_t (*sample_time_ns)(uint64_t sample_idx))
+{
+    raw_capture_hdr_t * hdr, * out;
+    uint8_t           * encode_buff;
+    int64_t             i;
+    int32_t             fd, used, ret = 0;
+
+    // create the file, and allocate block buffers
+    fd = open(filename, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+    if (fd < 0) {
+        ERROR("create %s, %s\n", filename, strerror(errno));
+        return -1;
+    }
+    hdr = malloc(RAW_CAPTURE_BLOCK_LEN);
+    encode_buff = malloc(RAW_CAPTURE_BLOCK_LEN);
+    if (hdr == NULL || encode_buff == NULL) {
+        FATAL("malloc failed\n");
+    }
+
+    // write the samples in blocks of up to RAW_CAPTURE_MAX_SAMPLES
+    for (i = 0; i < max_data; i += hdr->samples) {
+        bzero(hdr, sizeof(raw_capture_hdr_t));
+        hdr->magic        = RAW_CAPTURE_MAGIC;
+        hdr->encoding     = RAW_CAPTURE_ENCODING_NONE;
+        hdr->samples      = (max_data - i < RAW_CAPTURE_MAX_SAMPLES ? max_data - i : RAW_CAPTURE_MAX_SAMPLES);
+        hdr->sample_idx   = sample_idx + i;
+        hdr->time_ns      = (sample_time_ns ? sample_time_ns(sample_idx + i) : 0);
+        hdr->first_sample = data[i];
+        hdr->payload_len  = hdr->samples * sizeof(uint16_t);
+        hdr->block_len    = ALIGN_UP(sizeof(raw_capture_hdr_t) + hdr->payload_len);
+        memcpy(hdr + 1, data + i, hdr->payload_len);
+
+        out = hdr;
+        if (compress && 
+            raw_capture_encode(hdr, (raw_capture_hdr_t *)encode_buff, RAW_CAPTURE_BLOCK_LEN) == 0) 
+        {
+            out = (raw_capture_hdr_t *)encode_buff;
+        }
+        used = sizeof(raw_capture_hdr_t) + out->payload_len;
+        memset((uint8_t *)out + used, 0, out->block_len - used);
+
+        if (write(fd, out, out->block_len) != out->block_len) {
+            ERROR("write %s, %s\n", filename, strerror(errno));
+            ret = -1;
+            break;
+        }
+    }
+
+    // clean up
+    close(fd);
+    free(hdr);
+    free(encode_buff);
+    return ret;
+}
+
+// decodes the samples of a block; the hdr is followed by the payload_len bytes
+// of the block's payload; returns the number of samples, or -1 on error
+int32_t raw_capture_decode(raw_capture_hdr_t * hdr, uint16_t * samples, int32_t max_samples)
+{
+    bits_t   b;
+    int32_t  i, j, k, q, group_len;
+    uint32_t val, zz, bit;
+    int32_t  prev;
+
+    // sanity check the header
+    if (hdr->magic != RAW_CAPTURE_MAGIC || hdr->samples > max_samples || 
+        hdr->payload_len > RAW_CAPTURE_BLOCK_LEN - sizeof(raw_capture_hdr_t))
+    {
+        ERROR("invalid block, magic=0x%x samples=%u payload_len=%u\n", 
+              hdr->magic, hdr->samples, hdr->payload_len);
+        return -1;
+    }
+
+    switch (hdr->encoding) {
+    case RAW_CAPTURE_ENCODING_NONE:
+        if (hdr->payload_len != hdr->samples * sizeof(uint16_t)) {
+            ERROR("invalid block, samples=%u payload_len=%u\n", hdr->samples, hdr->payload_len);
+            return -1;
+        }
+        memcpy(samples, hdr + 1, hdr->payload_len);
+        return hdr->samples;
+
+    case RAW_CAPTURE_ENCODING_RICE:
+        bzero(&b, sizeof(b));
+        b.buff = (uint8_t *)(hdr + 1);
+        b.max  = hdr->payload_len;
+        prev = hdr->first_sample;
+        for (i = 0; i < hdr->samples; i += group_len) {
+            group_len = (hdr->samples - i < RAW_CAPTURE_RICE_GROUP_LEN 
+                         ? hdr->samples - i : RAW_CAPTURE_RICE_GROUP_LEN);
+            if (get_bits(&b, 4, &val) < 0) {
+                goto truncated;
+            }
+            k = val;
+            for (j = 0; j < group_len; j++) {
+                for (q = 0; q < RICE_ESCAPE; q++) {
+                    if (get_bits(&b, 1, &bit) < 0) {
+                        goto truncated;
+                    }
+                    if (bit == 0) {
+                        break;
+                    }
+                }
+                if (q == RICE_ESCAPE) {
+                    if (get_bits(&b, RICE_ESCAPE_BITS, &zz) < 0) {
+                        goto truncated;
+                    }
+                } else {
+                    if (get_bits(&b, k, &val) < 0) {
+                        goto truncated;
+                    }
+                    zz = ((uint32_t)q << k) | val;
+                }
+                prev += (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+                samples[i+j] = prev;
+            }
+        }
+        return hdr->samples;
+
+    default:
+        ERROR("invalid block, encoding=%d\n", hdr->encoding);
+        return -1;
+    }
+
+truncated:
+    ERROR("invalid block, payload truncated\n");
+    return -1;
+}
+
+// -----------------  EXIT HANDLER  ------------------------------------------------
+
+static void raw_capture_exit(void)
+{
+    // stop the writer thread, it writes the remaining blocks before exitting
+    g_writer_exit_req = true;
+    while (g_writer_thread_running) {
+        usleep(1000);
+    }
+
+    if (g_fd != -1) {
+        close(g_fd);
+        g_fd = -1;
+    }
+}
+
+// -----------------  RING  --------------------------------------------------------
+
+static void raw_capture_complete_block(void)
+{
+    int32_t blocks;
+
+    // fill in the remaining header fields, and publish the block to the writer
+    g_cur->first_sample = ((uint16_t *)(g_cur + 1))[0];
+    g_cur->payload_len  = g_cur->samples * sizeof(uint16_t);
+    g_cur->block_len    = ALIGN_UP(sizeof(raw_capture_hdr_t) + g_cur->payload_len);
+    __atomic_store_n(&g_head, g_head + 1, __ATOMIC_RELEASE);
+    g_cur = NULL;
+
+    // keep track of the ring occupancy high water mark
+    blocks = g_head - __atomic_load_n(&g_tail, __ATOMIC_ACQUIRE);
+    if (blocks > g_ring_high_water) {
+        __atomic_store_n(&g_ring_high_water, blocks, __ATOMIC_RELAXED);
+    }
+}
+
+// -----------------  WRITER THREAD  -----------------------------------------------
+
+static void * raw_capture_writer_thread(void * cx)
+{
+    bool exit_req;
+
+    pthread_setname_np(pthread_self(), "raw_capture");
+
+    while (true) {
+        exit_req = g_writer_exit_req;
+        raw_capture_write();
+        if (exit_req) {
+            break;
+        }
+        usleep(WRITER_INTVL_US);
+    }
+
+    g_writer_thread_running = false;
+    return NULL;
+}
+
+static void raw_capture_write(void)
+{
+    uint64_t            head, tail;
+    raw_capture_hdr_t * hdr, * out;
+    int32_t             used;
+    ssize_t             len;
+
+    head = __atomic_load_n(&g_head, __ATOMIC_ACQUIRE);
+    tail = g_tail;
+    while (tail != head) {
+        hdr = (raw_capture_hdr_t *)g_ring[tail % MAX_RING];
+
+        // if the file has been closed because of an error then retry the open,
+        // when the backoff interval has elapsed
+        if (g_fd == -1 && microsec_timer() >= g_reopen_time_us) {
+            raw_capture_open();
+        }
+
+        // if the file is closed then drop the block
+        if (g_fd == -1) {
+            __atomic_fetch_add(&g_samples_dropped, hdr->samples, __ATOMIC_RELAXED);
+            tail++;
+            __atomic_store_n(&g_tail, tail, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        // encode the block, if compression is enabled and the encoded block is smaller;
+        // and zero the padding that follows the payload
+        out = hdr;
+        if (g_compress && 
+            raw_capture_encode(hdr, (raw_capture_hdr_t *)g_encode_buff, RAW_CAPTURE_BLOCK_LEN) == 0) 
+        {
+            out = (raw_capture_hdr_t *)g_encode_buff;
+        }
+        used = sizeof(raw_capture_hdr_t) + out->payload_len;
+        memset((uint8_t *)out + used, 0, out->block_len - used);
+
+        // write the block; if the filesystem does not support O_DIRECT then
+        // the write fails with EINVAL, and is retried without O_DIRECT; 
+        // if the write fails then close the file and drop the block
+        len = write(g_fd, out, out->block_len);
+        if (len < 0 && errno == EINVAL && g_direct) {
+            WARN("%s does not support O_DIRECT, using buffered writes\n", g_filename);
+            fcntl(g_fd, F_SETFL, fcntl(g_fd, F_GETFL) & ~O_DIRECT);
+            g_direct = false;
+            len = write(g_fd, out, out->block_len);
+        }
+        if (len != out->block_len) {
+            ERROR("write %s, %s\n", g_filename, len < 0 ? strerror(errno) : "short write");
+            __atomic_store_n(&g_write_errors, g_write_errors + 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&g_samples_dropped, hdr->samples, __ATOMIC_RELAXED);
+            close(g_fd);
+            g_fd = -1;
+            raw_capture_open_failed();
+        } else {
+            __atomic_store_n(&g_blocks_written, g_blocks_written + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&g_bytes_written, g_bytes_written + len, __ATOMIC_RELAXED);
+            __atomic_store_n(&g_bytes_raw, g_bytes_raw + hdr->payload_len, __ATOMIC_RELAXED);
+            g_file_size += len;
+            g_reopen_intvl_us = REOPEN_INTVL_MIN_US;
+        }
+
+        tail++;
+        __atomic_store_n(&g_tail, tail, __ATOMIC_RELEASE);
+
+        // if the file has reached max size then rotate
+        if (g_fd != -1 && g_file_size >= g_max_file_size) {
+            raw_capture_rotate();
+        }
+    }
+}
+
+// encodes the block hdr to out; returns -1 if the encoded block 
+// would not be smaller than the unencoded block
+static int32_t raw_capture_encode(raw_capture_hdr_t * hdr, raw_capture_hdr_t * out, int32_t max_out)
+{
+    uint16_t * samples = (uint16_t *)(hdr + 1);
+    uint32_t   zz[RAW_CAPTURE_RICE_GROUP_LEN];
+    bits_t     b;
+    int32_t    i, j, k, q, d, group_len, prev;
+    uint64_t   sum;
+
+    bzero(&b, sizeof(b));
+    b.buff = (uint8_t *)(out + 1);
+    b.max  = hdr->payload_len;
+    prev = hdr->first_sample;
+
+    for (i = 0; i < hdr->samples; i += group_len) {
+        group_len = (hdr->samples - i < RAW_CAPTURE_RICE_GROUP_LEN 
+                     ? hdr->samples - i : RAW_CAPTURE_RICE_GROUP_LEN);
+
+        // zigzag encode the differences, and choose k so that 2^k is about the mean
+        sum = 0;
+        for (j = 0; j < group_len; j++) {
+            d = (int32_t)samples[i+j] - prev;
+            prev = samples[i+j];
+            zz[j] = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+            sum += zz[j];
+        }
+        for (k = 0; k < 15 && ((uint64_t)group_len << (k+1)) < sum; k++) ;
+
+        // code the group
+        put_bits(&b, k, 4);
+        for (j = 0; j < group_len; j++) {
+            q = zz[j] >> k;
+            if (q >= RICE_ESCAPE) {
+                put_bits(&b, (1 << RICE_ESCAPE) - 1, RICE_ESCAPE);
+                put_bits(&b, zz[j], RICE_ESCAPE_BITS);
+            } else {
+                put_bits(&b, (1 << (q + 1)) - 2, q + 1);
+                put_bits(&b, zz[j] & ((1 << k) - 1), k);
+            }
+        }
+
+        // if the encoded block is already as large as the unencoded block then give up
+        if (b.len >= b.max) {
+            return -1;
+        }
+    }
+    put_bits(&b, 0, 7);   // flush the last partial byte
+    if (b.len >= b.max) {
+        return -1;
+    }
+
+    *out = *hdr;
+    out->encoding    = RAW_CAPTURE_ENCODING_RICE;
+    out->payload_len = b.len;
+    out->block_len   = ALIGN_UP(sizeof(raw_capture_hdr_t) + b.len);
+    return 0;
+}
+
+// -----------------  FILE  --------------------------------------------------------
+
+static int32_t raw_capture_open(void)
+{
+    struct stat st;
+
+    // open with O_DIRECT, and if the filesystem does not support it then without
+    g_direct = true;
+    g_fd = open(g_filename, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC|O_DIRECT, 0644);
+    if (g_fd < 0 && errno == EINVAL) {
+        g_direct = false;
+        g_fd = open(g_filename, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+    }
+    if (g_fd < 0) {
+        ERROR("open %s, %s\n", g_filename, strerror(errno));
+        raw_capture_open_failed();
+        return -1;
+    }
+    g_file_size = (fstat(g_fd, &st) == 0 ? st.st_size : 0);
+    return 0;
+}
+
+static void raw_capture_open_failed(void)
+{
+    // schedule the next open attempt, and double the backoff interval;
+    // the interval is reset to the minimum by a successful write
+    g_reopen_time_us = microsec_timer() + g_reopen_intvl_us;
+    g_reopen_intvl_us = (2 * g_reopen_intvl_us < REOPEN_INTVL_MAX_US
+                         ? 2 * g_reopen_intvl_us : REOPEN_INTVL_MAX_US);
+}
+
+static void raw_capture_rotate(void)
+{
+    close(g_fd);
+    g_fd = -1;
+
+    rotate_files(g_filename, g_max_files);
+    raw_capture_open();
+    __atomic_store_n(&g_rotations, g_rotations + 1, __ATOMIC_RELAXED);
+}
+
+// -----------------  BIT STREAM  --------------------------------------------------
+
+// bits are stored msb first; n is at most 32
+static inline void put_bits(bits_t * b, uint32_t val, int32_t n)
+{
+    b->acc = (b->acc << n) | val;
+    b->bits += n;
+    while (b->bits >= 8) {
+        b->bits -= 8;
+        if (b->len < b->max) {
+            b->buff[b->len] = b->acc >> b->bits;
+        }
+        b->len++;
+    }
+}
+
+static inline int32_t get_bits(bits_t * b, int32_t n, uint32_t * val)
+{
+    while (b->bits < n) {
+        if (b->len >= b->max) {
+            return -1;
+        }
+        b->acc = (b->acc << 8) | b->buff[b->len++];
+        b->bits += 8;
+    }
+    b->bits -= n;
+    *val = (b->acc >> b->bits) & ((1ULL << n) - 1);
+    return 0;
+}
@@ -0,0 +1,80 @@
+/*
+Copyright (c) 2016 Steven Haid
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+#ifndef __UTIL_RAW_CAPTURE_H__
+#define __UTIL_RAW_CAPTURE_H__
+
+// capture of the raw mccdaq samples to disk; the samples are copied to a ring
+// of fixed size blocks, and written to a rotating file by a writer thread;
+// the capture file can be replayed through the pulse detector offline
+
+#define RAW_CAPTURE_MAGIC        0x31574152   // "RAW1"
+#define RAW_CAPTURE_BLOCK_LEN    (1024*1024)  // max bytes in a block, including the header
+#define RAW_CAPTURE_ALIGN        4096         // block length on disk is a multiple of this
+#define RAW_CAPTURE_MAX_SAMPLES  ((RAW_CAPTURE_BLOCK_LEN - sizeof(raw_capture_hdr_t)) / 2)
+
+// encodings of the samples in a block
+// - NONE: the samples, uint16_t
+// - RICE: the difference between each sample and the preceding sample, zigzag 
+//   encoded, in groups of RAW_CAPTURE_RICE_GROUP_LEN that are rice coded with a
+//   per group parameter; see util_raw_capture.c
+#define RAW_CAPTURE_ENCODING_NONE  0
+#define RAW_CAPTURE_ENCODING_RICE  1
+
+#define RAW_CAPTURE_RICE_GROUP_LEN  256
+
+typedef struct {
+    uint32_t magic;
+    uint16_t encoding;          // RAW_CAPTURE_ENCODING_xxx
+    uint16_t first_sample;      // the first sample, adc counts
+    uint32_t block_len;         // bytes in the block on disk, including the header
+    uint32_t payload_len;       // bytes of encoded samples following the header
+    uint32_t samples;           // number of samples in the block
+    uint32_t reserved1;
+    uint64_t sample_idx;        // mccdaq sample index of the first sample
+    int64_t  time_ns;           // realtime of the first sample
+    uint64_t reserved2[3];
+} raw_capture_hdr_t;
+
+typedef struct {
+    uint64_t samples_added;     // samples copied to the ring
+    uint64_t samples_dropped;   // samples dropped because the ring was full, or the file was closed
+    uint64_t blocks_written;
+    uint64_t bytes_written;     // bytes written to the file
+    uint64_t bytes_raw;         // bytes of the samples written, before encoding
+    uint64_t write_errors;
+    int32_t  rotations;         // number of times the file was rotated
+    int32_t  ring_blocks;       // blocks in the ring waiting to be written
+    int32_t  ring_high_water;   // max ring_blocks since raw_capture_init
+    int32_t  ring_max;          // number of blocks in the ring
+} raw_capture_stats_t;
+
+int32_t raw_capture_init(char * filename, int64_t max_file_size, int32_t max_files, bool compress,
+                         int64_t (*sample_time_ns)(uint64_t sample_idx));
+void raw_capture_add(uint16_t * data, int32_t max_data, uint64_t sample_idx);
+void raw_capture_get_stats(raw_capture_stats_t * stats);
+int32_t raw_capture_decode(raw_capture_hdr_t * hdr, uint16_t * samples, int32_t max_samples);
+int32_t raw_capture_write_file(char * filename, uint16_t * data, int64_t max_data, uint64_t sample_idx,
+                               bool compress, int64_t (*sample_time_ns)(uint64_t sample_idx));
+
+#endif